@@ -10,7 +10,8 @@ const imports = {
 		} else {
 			console.log(src);
 		}
-	}
+	},
+	_now: () => performance.now()
 };
 const { instance } = await WebAssembly.instantiateStreaming(
 	fetch("./compiler/build/binary.wasm"),
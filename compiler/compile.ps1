@@ -9,13 +9,13 @@ clang -g -O0 -D_DEBUG --target=wasm32 -msimd128 -mbulk-memory -nostdlib `
 "-Wl,--no-entry,--allow-undefined-file=../imports.sym,--reproduce=binary.wasm.map" `
 -Wno-incompatible-library-redeclaration -Wno-switch `
 -o binary.wasm `
-../src/main.c ../src/tokenize.c ../src/standard_functions.c ../src/codegen.c
+../src/main.c ../src/tokenize.c ../src/standard_functions.c ../src/symbols.c ../src/arena.c ../src/cache.c ../src/wasm_writer.c ../src/codegen.c ../src/optimize.c ../src/callgraph.c ../src/peephole.c ../src/ir.c ../src/ir_emit.c ../src/vectorize.c ../src/timing.c
 } else {
 clang -Ofast -flto --target=wasm32 -msimd128 -mbulk-memory -nostdlib `
 "-Wl,--no-entry,--allow-undefined-file=../imports.sym,--lto-O3" `
 -Wno-incompatible-library-redeclaration -Wno-switch `
 -o binary.wasm `
-../src/main.c ../src/tokenize.c ../src/standard_functions.c ../src/codegen.c
+../src/main.c ../src/tokenize.c ../src/standard_functions.c ../src/symbols.c ../src/arena.c ../src/cache.c ../src/wasm_writer.c ../src/codegen.c ../src/optimize.c ../src/callgraph.c ../src/peephole.c ../src/ir.c ../src/ir_emit.c ../src/vectorize.c ../src/timing.c
 }
 
 popd
@@ -20,6 +20,7 @@ enum Valtype {
 	VAL_I64 = 0x7E,
 	VAL_F32 = 0x7D,
 	VAL_F64 = 0x7C,
+	VAL_V128 = 0x7B,
 
 	VAL_FUNC_REF = 0x70,
 	VAL_EXTERN_REF = 0x6F
@@ -36,9 +37,11 @@ enum OpCode {
 	OP_F32_ADD = 0x92,
 
 	OP_DROP = 0x1A,
+	OP_SELECT = 0x1B,
 
 	OP_I32_CONST = 0x41,
 
+	OP_I32_EQZ = 0x45,
 	OP_I32_EQ = 0x46,
 	OP_I32_NE = 0x47,
 	OP_I32_LT_S = 0x48,
@@ -55,10 +58,27 @@ enum OpCode {
 	OP_I32_MUL = 0x6C,
 	OP_I32_DIV_S = 0x6D,
 	OP_I32_DIV_U = 0x6E,
+	OP_I32_REM_S = 0x6F,
+	OP_I32_REM_U = 0x70,
+	OP_I32_AND = 0x71,
+	OP_I32_OR = 0x72,
+	OP_I32_XOR = 0x73,
+	OP_I32_SHL = 0x74,
+	OP_I32_SHR_S = 0x75,
+	OP_I32_SHR_U = 0x76,
+
+	// Only for the high half of a product, see emit_high_product
+	OP_I64_CONST = 0x42,
+	OP_I64_MUL = 0x7E,
+	OP_I64_SHR_S = 0x87,
+	OP_I32_WRAP_I64 = 0xA7,
+	OP_I64_EXTEND_I32_S = 0xAC,
 
 	OP_I32_LOAD = 0x28,
 	OP_I32_STORE = 0x36,
+	OP_MEMORY_SIZE = 0x3F,
 
+	OP_UNREACHABLE = 0x00,
 	OP_NONE = 0x01,
 	OP_BLOCK = 0x02,
 	OP_LOOP = 0x03,
@@ -70,7 +90,38 @@ enum OpCode {
 	OP_RETURN = 0x0F,
 	OP_CALL = 0x10,
 	OP_CALL_INDIRECT = 0x11,
-	OP_END = 0x0B
+	OP_RETURN_CALL = 0x12, // tail call proposal
+	OP_END = 0x0B,
+
+	OP_SIMD = 0xFD, // prefix, followed by a SimdOpCode as a uleb
+};
+
+// https://webassembly.github.io/spec/core/binary/instructions.html#vector-instructions
+enum SimdOpCode {
+	SIMD_V128_LOAD = 0x00,
+	SIMD_V128_STORE = 0x0B,
+	SIMD_I32X4_SPLAT = 0x11,
+	SIMD_I32X4_EXTRACT_LANE = 0x1B,
+
+	SIMD_I32X4_EQ = 0x37,
+	SIMD_I32X4_NE = 0x38,
+	SIMD_I32X4_LT_S = 0x39,
+	SIMD_I32X4_GT_S = 0x3B,
+	SIMD_I32X4_LE_S = 0x3D,
+	SIMD_I32X4_GE_S = 0x3F,
+
+	SIMD_V128_AND = 0x4E,
+	SIMD_V128_OR = 0x50,
+	SIMD_V128_XOR = 0x51,
+
+	SIMD_I32X4_NEG = 0xA1,
+	SIMD_I32X4_SHL = 0xAB,
+	SIMD_I32X4_SHR_S = 0xAC,
+	SIMD_I32X4_ADD = 0xAE,
+	SIMD_I32X4_SUB = 0xB1,
+	SIMD_I32X4_MUL = 0xB5,
+	SIMD_I32X4_MIN_S = 0xB6,
+	SIMD_I32X4_MAX_S = 0xB8,
 };
 
 // http://webassembly.github.io/spec/core/binary/modules.html#export-section
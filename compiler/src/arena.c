@@ -0,0 +1,121 @@
+#include "arena.h"
+#include "standard_functions.h"
+
+#define WASM_PAGE_SIZE 65536
+#define ARENA_BLOCK_SIZE (16 * 1024)
+#define ARENA_ALIGN 8
+
+struct ArenaBlock {
+	ArenaBlock *next;
+	unsigned int size;
+	unsigned int offset;
+};
+
+extern unsigned char __heap_base;
+static unsigned char *RegionTop = 0;
+static Arena *Arenas = 0;
+
+static unsigned long align_up(unsigned long n, unsigned long align) {
+	return (n + align - 1) & ~(align - 1);
+}
+
+// Bump allocator over the end of linear memory, nothing is ever returned to it
+static void *region_alloc(unsigned int size) {
+	if (!RegionTop)
+		RegionTop = (unsigned char *)align_up((unsigned long)&__heap_base, ARENA_ALIGN);
+
+	unsigned long end = (unsigned long)__builtin_wasm_memory_size(0) * WASM_PAGE_SIZE;
+	unsigned long needed = (unsigned long)RegionTop + size;
+	if (needed > end) {
+		unsigned long pages = (needed - end + WASM_PAGE_SIZE - 1) / WASM_PAGE_SIZE;
+		if (__builtin_wasm_memory_grow(0, pages) == (unsigned long)-1)
+			return 0;
+	}
+
+	void *result = RegionTop;
+	RegionTop += size;
+	return result;
+}
+
+// Oversized blocks are rounded up to a power of two, a pool that grows a
+// little on every pass then finds its spare block instead of leaking a new one
+static ArenaBlock *new_block(unsigned int min_size) {
+	unsigned int needed = align_up(sizeof(ArenaBlock), ARENA_ALIGN) + min_size;
+	unsigned int size = ARENA_BLOCK_SIZE;
+	while (size < needed) size *= 2;
+	ArenaBlock *block = region_alloc(size);
+	if (!block) return 0;
+	block->next = 0;
+	block->size = size;
+	block->offset = align_up(sizeof(ArenaBlock), ARENA_ALIGN);
+	return block;
+}
+
+void *arena_push(Arena *arena, unsigned int size) {
+	size = align_up(size, ARENA_ALIGN);
+
+	if (!arena->first) {
+		arena->first = arena->current = new_block(size);
+		if (!arena->first) goto out_of_memory;
+		arena->next = Arenas;
+		Arenas = arena;
+	}
+
+	ArenaBlock *block = arena->current;
+	if (block->offset + size > block->size) {
+		// Move the first spare block big enough to the front of the spares,
+		// so blocks kept from earlier passes are reused instead of piling up
+		ArenaBlock **link = &block->next;
+		while (*link && (*link)->size - align_up(sizeof(ArenaBlock), ARENA_ALIGN) < size)
+			link = &(*link)->next;
+		ArenaBlock *next = *link;
+		if (next) {
+			*link = next->next;
+		} else {
+			next = new_block(size);
+			if (!next) goto out_of_memory;
+		}
+		next->next = block->next;
+		block->next = next;
+		block = next;
+		block->offset = align_up(sizeof(ArenaBlock), ARENA_ALIGN);
+	}
+	arena->current = block;
+
+	void *result = (unsigned char *)block + block->offset;
+	block->offset += size;
+	arena->used += size;
+	if (arena->used > arena->high_water)
+		arena->high_water = arena->used;
+	memset(result, 0, size);
+	return result;
+
+out_of_memory:
+	printf("out of memory in the %s arena", arena->name);
+	__builtin_trap();
+}
+
+ArenaMark arena_mark(Arena *arena) {
+	if (!arena->current) return (ArenaMark){0};
+	return (ArenaMark){arena->current, arena->current->offset, arena->used};
+}
+
+void arena_reset_to(Arena *arena, ArenaMark mark) {
+	if (!arena->first) return;
+	if (!mark.block) {
+		mark.block = arena->first;
+		mark.offset = align_up(sizeof(ArenaBlock), ARENA_ALIGN);
+	}
+	arena->current = mark.block;
+	arena->current->offset = mark.offset;
+	arena->used = mark.used;
+}
+
+void arena_reset(Arena *arena) {
+	arena_reset_to(arena, (ArenaMark){0});
+}
+
+void print_arena_stats() {
+	for (Arena *arena = Arenas; arena; arena = arena->next)
+		printf("%s: %u bytes used, %u bytes high water", arena->name, arena->used, arena->high_water);
+}
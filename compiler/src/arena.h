@@ -0,0 +1,37 @@
+#pragma once
+#include "defines.h"
+
+// Growable region allocator. Every pool in the compiler is an Arena made of
+// blocks carved off the top of linear memory (grown with memory.grow as
+// needed). Blocks are kept after a reset and reused, so a reset costs time
+// proportional to the blocks that were used, not to the pool's capacity.
+
+typedef struct ArenaBlock ArenaBlock;
+typedef struct Arena Arena;
+typedef struct ArenaMark ArenaMark;
+
+struct Arena {
+	const char *name;
+	ArenaBlock *first;
+	ArenaBlock *current;
+	unsigned int used; // bytes handed out since the last reset
+	unsigned int high_water;
+	Arena *next; // registered arenas, for print_arena_stats
+};
+
+struct ArenaMark {
+	ArenaBlock *block;
+	unsigned int offset;
+	unsigned int used;
+};
+
+// Returns zeroed memory, traps if linear memory cannot grow any further
+void *arena_push(Arena *arena, unsigned int size);
+#define arena_push_struct(arena, T) ((T *)arena_push(arena, sizeof(T)))
+#define arena_push_array(arena, T, n) ((T *)arena_push(arena, sizeof(T) * (n)))
+
+ArenaMark arena_mark(Arena *arena);
+void arena_reset_to(Arena *arena, ArenaMark mark);
+void arena_reset(Arena *arena);
+
+void print_arena_stats();
@@ -0,0 +1,81 @@
+#include "cache.h"
+#include "standard_functions.h"
+#include "arena.h"
+
+#define CACHE_BUCKETS 64
+
+typedef struct CacheGeneration CacheGeneration;
+struct CacheGeneration {
+	Arena arena;
+	CachedFunction *buckets[CACHE_BUCKETS];
+};
+
+static CacheGeneration Generations[2] = {
+	{{"function cache (a)"}},
+	{{"function cache (b)"}},
+};
+static CacheGeneration *Previous = Generations + 0;
+static CacheGeneration *Current = Generations + 1;
+
+// FNV-1a over what the parser sees: token kinds, ids, numbers and
+// identifier spellings. Whitespace and comments do not change the hash
+u64 hash_tokens(const Token *begin, const Token *end) {
+	u64 hash = 14695981039346656037ull;
+#define HASH_BYTE(b) hash = (hash ^ (u8)(b)) * 1099511628211ull
+	for (const Token *tok = begin; tok != end; ++tok) {
+		HASH_BYTE(tok->kind);
+		HASH_BYTE(tok->id);
+		if (tok->kind == TK_NUM) {
+			for (unsigned int i = 0; i < 4; ++i)
+				HASH_BYTE(tok->val >> (i * 8));
+		} else if (tok->kind == TK_IDENTIFIER) {
+			for (unsigned int i = 0; i < tok->len; ++i)
+				HASH_BYTE(tok->loc[i]);
+			HASH_BYTE(0);
+		}
+	}
+#undef HASH_BYTE
+	return hash;
+}
+
+CachedFunction *find_cached_function(u64 hash, unsigned int token_count) {
+	for (CachedFunction *entry = Previous->buckets[hash % CACHE_BUCKETS]; entry; entry = entry->next) {
+		if (entry->hash == hash && entry->token_count == token_count)
+			return entry;
+	}
+	return 0;
+}
+
+void cache_function(u64 hash, unsigned int token_count, const unsigned char *code, unsigned int code_len, const CallReloc *relocs, unsigned int reloc_count) {
+	Arena *arena = &Current->arena;
+	CachedFunction *entry = arena_push_struct(arena, CachedFunction);
+	entry->hash = hash;
+	entry->token_count = token_count;
+	entry->code = arena_push(arena, code_len);
+	memcpy(entry->code, code, code_len);
+	entry->code_len = code_len;
+	entry->relocs = arena_push_array(arena, CallReloc, reloc_count);
+	entry->reloc_count = reloc_count;
+	for (unsigned int i = 0; i < reloc_count; ++i) {
+		// Callee names may point into the symbol arena, which a full
+		// tokenize resets
+		char *callee = arena_push(arena, relocs[i].callee_len + 1);
+		memcpy(callee, relocs[i].callee, relocs[i].callee_len);
+		entry->relocs[i] = (CallReloc){relocs[i].offset, callee, relocs[i].callee_len, relocs[i].arg_count};
+	}
+
+	CachedFunction **bucket = Current->buckets + hash % CACHE_BUCKETS;
+	entry->next = *bucket;
+	*bucket = entry;
+}
+
+void begin_cache_generation() {
+	arena_reset(&Current->arena);
+	memset(Current->buckets, 0, sizeof(Current->buckets));
+}
+
+void end_cache_generation() {
+	CacheGeneration *tmp = Previous;
+	Previous = Current;
+	Current = tmp;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "defines.h"
+#include "tokenize.h"
+
+// Per function code cache. A function whose tokens hash the same as in the
+// previous compile is not parsed or generated again, its encoded body is
+// copied from the cache and only the call indices in it are patched.
+//
+// Entries live in two generations: lookups hit the previous compile's
+// entries while the current compile writes every function it emits into the
+// other one, so dropped functions fall out of the cache when it flips.
+
+typedef struct CallReloc CallReloc;
+typedef struct CachedFunction CachedFunction;
+
+// OP_CALL index inside a body, encoded LEB128_PADDED_SIZE bytes wide
+struct CallReloc {
+	unsigned int offset; // from the start of the body's code
+	const char *callee;
+	unsigned int callee_len;
+	unsigned int arg_count; // checked against the callee when the body is reused
+};
+
+struct CachedFunction {
+	CachedFunction *next; // hash bucket chain
+	u64 hash;
+	unsigned int token_count;
+	unsigned char *code; // the body after its size: local declarations, code and OP_END
+	unsigned int code_len;
+	CallReloc *relocs;
+	unsigned int reloc_count;
+};
+
+u64 hash_tokens(const Token *begin, const Token *end);
+
+// Looks in the previous generation
+CachedFunction *find_cached_function(u64 hash, unsigned int token_count);
+
+// Copies a body into the current generation
+void cache_function(u64 hash, unsigned int token_count, const unsigned char *code, unsigned int code_len, const CallReloc *relocs, unsigned int reloc_count);
+
+void begin_cache_generation();
+void end_cache_generation();
@@ -0,0 +1,272 @@
+#include "callgraph.h"
+#include "optimize.h"
+#include "symbols.h"
+
+// A function can be inlined when its whole body is one value that reads
+// nothing but its parameters, { return E; } or { E; }, and E fits the
+// budget. The arguments of an inlined call are evaluated in order into
+// temporaries of the caller, which E then reads instead of the parameters.
+// Constants, and locals that stay in WASM locals when every argument is one
+// of those, are read in place: nothing in E can change them.
+// Calls are inlined bottom up: a callee has its own calls inlined before its
+// value is copied anywhere, and a callee met again while that is going on is
+// recursive and stays a call.
+//
+// Inlined code depends on tokens the code cache does not hash, so a caller
+// that inlines anything is not cached, and neither are inline candidates,
+// which keeps them parsed and inlinable in every compile.
+
+enum {
+	INLINE_UNVISITED,
+	INLINE_VISITING,
+	INLINE_DONE,
+};
+
+unsigned int InlineBudget = INLINE_BUDGET_DEFAULT;
+static Function *Caller;
+
+// Whether id is a value without side effects other than calls, counting
+// its nodes against *budget
+static bool is_inlinable(NodeId id, unsigned int *budget) {
+	if (!*budget) return false;
+	*budget -= 1;
+	const Node *node = N(id);
+	switch (node->kind) {
+		case ND_NUM:
+			return true;
+		case ND_VAR:
+			return node->var->is_param && !node->var->escapes;
+		case ND_ADDR:
+		case ND_DEREF:
+		case ND_ASSIGN:
+		case ND_RETURN:
+		case ND_BLOCK:
+		case ND_IF:
+		case ND_FOR:
+		case ND_SWITCH:
+		case ND_BREAK:
+			return false;
+		case ND_FUNCCALL:
+			for (NodeId arg = node->lhs; arg; arg = N(arg)->next) {
+				if (!is_inlinable(arg, budget)) return false;
+			}
+			return true;
+		case ND_NEG:
+			return is_inlinable(node->lhs, budget);
+		case ND_COND:
+			if (!is_inlinable(node->els, budget)) return false;
+			break;
+	}
+	return is_inlinable(node->lhs, budget) && is_inlinable(node->rhs, budget);
+}
+
+static NodeId find_inline_value(const Function *fn) {
+	if (!fn->body || !InlineBudget) return 0;
+	NodeId value = N(fn->body)->kind == ND_BLOCK ? N(fn->body)->lhs : fn->body;
+	if (!value || N(value)->next) return 0;
+	if (N(value)->kind == ND_RETURN)
+		value = N(value)->lhs;
+	unsigned int budget = InlineBudget;
+	return value && is_inlinable(value, &budget) ? value : 0;
+}
+
+static NodeId Arguments; // of the call being inlined, what each parameter reads
+
+// A local kept in a WASM local only changes when it is assigned, and an
+// argument evaluated later could assign it
+static bool is_leaf(NodeId id) {
+	NodeKind kind = N(id)->kind;
+	return kind == ND_NUM || (kind == ND_VAR && !N(id)->var->escapes);
+}
+
+static NodeId copy_node(NodeId id) {
+	NodeId copy = new_node(N(id)->kind);
+	Nodes[copy] = Nodes[id];
+	NodesCold[copy] = NodesCold[id];
+	N(copy)->next = 0;
+	return copy;
+}
+
+static NodeId clone(NodeId id) {
+	if (!id) return 0;
+	if (N(id)->kind == ND_VAR) {
+		NodeId argument = Arguments;
+		for (unsigned int i = N(id)->var->local_index; i > 0; --i)
+			argument = N(argument)->next;
+		return copy_node(argument);
+	}
+	NodeId copy = copy_node(id);
+	switch (N(id)->kind) {
+		case ND_NUM:
+			return copy;
+		case ND_FUNCCALL: {
+			NodeId head = 0, tail = 0;
+			for (NodeId arg = N(id)->lhs; arg; arg = N(arg)->next) {
+				NodeId arg_copy = clone(arg);
+				if (tail)
+					N(tail)->next = arg_copy;
+				else
+					head = arg_copy;
+				tail = arg_copy;
+			}
+			N(copy)->lhs = head;
+			return copy;
+		}
+		case ND_COND: {
+			NodeId els = clone(N(id)->els);
+			N(copy)->els = els;
+			break;
+		}
+	}
+	NodeId lhs = clone(N(id)->lhs);
+	NodeId rhs = clone(N(id)->rhs);
+	N(copy)->lhs = lhs;
+	N(copy)->rhs = rhs;
+	return copy;
+}
+
+static void inline_calls(Function *fn);
+
+static NodeId inline_call(NodeId id) {
+	if (N(id)->kind != ND_FUNCCALL) return id;
+	Function *callee = N(id)->sym->func;
+	if (!callee || callee->inline_state == INLINE_VISITING) return id;
+	if (callee->inline_state == INLINE_UNVISITED) {
+		Function *caller = Caller;
+		inline_calls(callee);
+		Caller = caller;
+	}
+	if (!callee->inline_value) return id;
+	unsigned int count = 0;
+	bool all_leaves = true;
+	for (NodeId arg = N(id)->lhs; arg; arg = N(arg)->next) {
+		count += 1;
+		all_leaves &= is_leaf(arg);
+	}
+	// Codegen reports the wrong number of arguments
+	if (count != callee->param_count) return id;
+
+	Caller->token_count = 0;
+	NodeId first = 0, tail = 0, bound = 0, bound_tail = 0;
+	unsigned int index = 0;
+	for (NodeId arg = N(id)->lhs; arg; ++index) {
+		NodeId next = N(arg)->next;
+		NodeId read;
+		if (N(arg)->kind == ND_NUM || (all_leaves && is_leaf(arg))) {
+			read = copy_node(arg);
+		} else {
+			Obj *param = callee->locals;
+			while (!param->is_param || param->local_index != index)
+				param = param->next;
+			Obj *tmp = new_temp_lvar(Caller, param->type);
+			N(arg)->next = 0;
+			NodeId set = new_binary(ND_ASSIGN, new_variable(tmp), arg);
+			if (tail)
+				N(tail)->next = set;
+			else
+				first = set;
+			tail = set;
+			read = new_variable(tmp);
+		}
+		if (bound_tail)
+			N(bound_tail)->next = read;
+		else
+			bound = read;
+		bound_tail = read;
+		arg = next;
+	}
+	Arguments = bound;
+	NodeId value = clone(callee->inline_value);
+	if (!first) return value;
+	N(tail)->next = value;
+	NodeId block = new_node(ND_BLOCK);
+	N(block)->lhs = first;
+	N(block)->type = N(value)->type;
+	return block;
+}
+
+static void inline_calls(Function *fn) {
+	fn->inline_state = INLINE_VISITING;
+	if (fn->body) {
+		Caller = fn;
+		NodeId body = rewrite_tree(fn->body, inline_call);
+		fn->body = body;
+	}
+	fn->inline_value = find_inline_value(fn);
+	if (fn->inline_value)
+		fn->token_count = 0;
+	fn->inline_state = INLINE_DONE;
+}
+
+void inline_functions(Function *prog) {
+	for (Function *fn = prog; fn; fn = fn->next) {
+		if (fn->inline_state == INLINE_UNVISITED)
+			inline_calls(fn);
+	}
+}
+
+static void mark_reachable(Function *fn);
+
+static NodeId mark_callee(NodeId id) {
+	if (N(id)->kind == ND_FUNCCALL && N(id)->sym->func)
+		mark_reachable(N(id)->sym->func);
+	return id;
+}
+
+static void mark_reachable(Function *fn) {
+	if (fn->reachable) return;
+	fn->reachable = true;
+	if (fn->body) {
+		rewrite_tree(fn->body, mark_callee);
+		return;
+	}
+	// Cached bodies only have their calls left
+	for (unsigned int i = 0; fn->cached && i < fn->cached->reloc_count; ++i) {
+		const CallReloc *reloc = fn->cached->relocs + i;
+		Symbol *callee = find_symbol(reloc->callee, reloc->callee_len);
+		if (callee && callee->func)
+			mark_reachable(callee->func);
+	}
+}
+
+static bool FoundUndefinedCall;
+
+static NodeId find_undefined_call(NodeId id) {
+	if (N(id)->kind == ND_FUNCCALL && !N(id)->sym->func)
+		FoundUndefinedCall = true;
+	return id;
+}
+
+// Functions calling something undefined are kept for codegen to report
+static bool calls_undefined(Function *fn) {
+	if (!fn->body) return false;
+	FoundUndefinedCall = false;
+	rewrite_tree(fn->body, find_undefined_call);
+	return FoundUndefinedCall;
+}
+
+// Calls are found on the tree, so a call that only the SSA IR folds away,
+// like the one in c = 1; c = c % 125 ? 3 : f(), keeps its callee. A cached
+// body lists the calls its code still makes, so once main comes from the
+// cache the same callee is dropped. The results are the same either way,
+// only the module is smaller
+void remove_unreachable_functions() {
+	Symbol *main_sym = find_symbol("main", 4);
+	if (!main_sym || !main_sym->func) return;
+	mark_reachable(main_sym->func);
+	for (Function *fn = Functions; fn; fn = fn->next) {
+		if (!fn->reachable && calls_undefined(fn))
+			mark_reachable(fn);
+	}
+
+	Function head = {};
+	Function *tail = &head;
+	FunctionCount = 0;
+	for (Function *fn = Functions; fn; fn = fn->next) {
+		if (!fn->reachable) continue;
+		fn->index = FunctionCount++;
+		tail = tail->next = fn;
+	}
+	tail->next = 0;
+	Functions = head.next;
+}
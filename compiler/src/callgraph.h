@@ -0,0 +1,14 @@
+#pragma once
+#include "codegen.h"
+
+#define INLINE_BUDGET_DEFAULT 16
+
+// Largest callee, in nodes, that gets inlined. 0 turns inlining off
+extern unsigned int InlineBudget;
+
+// Replaces calls to small functions by a copy of their value
+void inline_functions(Function *prog);
+
+// Drops the functions main can no longer reach from Functions and numbers
+// the rest again
+void remove_unreachable_functions();
@@ -1,93 +1,131 @@
 #include "codegen.h"
 #include "tokenize.h"
 #include "standard_functions.h"
-
-// TODO: Make Unified Memory Allocator
-Node AllNodes[512] = {0};
-Node *CurrentNode = AllNodes;
+#include "arena.h"
+#include "wasm_writer.h"
+#include "peephole.h"
+#include "ir.h"
+#include "optimize.h"
+#include "timing.h"
+
+static Arena NodeArena = {"nodes"};
+static Arena NodeColdArena = {"nodes (cold)"};
+static Arena LocalArena = {"locals"};
+static Arena FunctionArena = {"functions"};
+static Arena TypeArena = {"types"};
+static Arena RelocArena = {"relocations"};
 static bool error_parsing = false;
 
-static Type TypeInt = (Type){TYPE_INT, 0};
+static Type TypeInt = (Type){TYPE_INT};
+Type TypeV128 = (Type){TYPE_V128};
 
 static int align_to(int n, int align) {
 	return (n + align - 1) / align * align;
 }
 
-static Node *new_node(NodeKind kind) {
-	Node *node = CurrentNode++;
-	node->kind = kind;
-	node->tok = (struct Token *)CurrentToken();
+Node *Nodes;
+NodeCold *NodesCold;
+static unsigned int NodeCount;
+static unsigned int NodeCapacity;
+
+// Doubles the pool, the old arrays stay in the arena until the next reset
+static void grow_nodes() {
+	unsigned int capacity = NodeCapacity ? NodeCapacity * 2 : 256;
+	Node *nodes = arena_push_array(&NodeArena, Node, capacity);
+	NodeCold *cold = arena_push_array(&NodeColdArena, NodeCold, capacity);
+	if (NodeCount) {
+		memcpy(nodes, Nodes, NodeCount * sizeof(Node));
+		memcpy(cold, NodesCold, NodeCount * sizeof(NodeCold));
+	}
+	Nodes = nodes;
+	NodesCold = cold;
+	NodeCapacity = capacity;
+}
+
+static void reset_nodes() {
+	arena_reset(&NodeArena);
+	arena_reset(&NodeColdArena);
+	NodeCount = 0;
+	NodeCapacity = 0;
+	grow_nodes();
+	NodeCount = 1; // null node
+}
+
+NodeId new_node(NodeKind kind) {
+	if (NodeCount == NodeCapacity)
+		grow_nodes();
+	NodeId node = NodeCount++;
+	N(node)->kind = kind;
+	NodesCold[node].tok = (Token *)CurrentToken();
 	return node;
 }
 
-static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs) {
-	Node *node = new_node(kind);
-	node->lhs = lhs;
-	node->rhs = rhs;
+// Nodes are typed once, as they are built. Children always exist before
+// their parent, so add_type only has to look one level down
+
+NodeId new_binary(NodeKind kind, NodeId lhs, NodeId rhs) {
+	NodeId node = new_node(kind);
+	N(node)->lhs = lhs;
+	N(node)->rhs = rhs;
+	add_type(node);
 	return node;
 }
 
-static Node *new_unary(NodeKind kind, Node *expr) {
-	Node *node = new_node(kind);
-	node->lhs = expr;
+NodeId new_unary(NodeKind kind, NodeId expr) {
+	NodeId node = new_node(kind);
+	N(node)->lhs = expr;
+	add_type(node);
 	return node;
 }
 
-static Node *new_num(int val) {
-	Node *node = new_node(ND_NUM);
-	node->val = val;
+NodeId new_num(int val) {
+	NodeId node = new_node(ND_NUM);
+	N(node)->val = val;
+	N(node)->type = &TypeInt;
 	return node;
 }
 
-#define is_int(n) (n->type->kind == TYPE_INT)
-static Node *new_add(Node *lhs, Node *rhs) {
-	add_type(lhs);
-	add_type(rhs);
-	
+#define is_int(n) (N(n)->type && N(n)->type->kind == TYPE_INT)
+#define is_ptr(n) (N(n)->type && N(n)->type->kind == TYPE_PTR)
+static NodeId new_add(NodeId lhs, NodeId rhs) {
 	// num + num
 	if (is_int(lhs) && is_int(rhs))
 		return new_binary(ND_ADD, lhs, rhs);
 
+	// num + ptr
+	if (is_int(lhs) && is_ptr(rhs)) {
+		NodeId tmp = lhs;
+		lhs = rhs;
+		rhs = tmp;
+	}
+
 	// ptr + ptr
-	if (lhs->type->base && rhs->type->base) {
+	if (!is_ptr(lhs) || !is_int(rhs)) {
 		error_tok(CurrentToken(), "invalid operands");
 		error_parsing = true;
 		return 0;
 	}
 
-	// num + ptr
-	if (!lhs->type->base && rhs->type->base) {
-		Node *tmp = lhs;
-		lhs = rhs;
-		rhs = tmp;
-	}
-
 	// ptr + num
 	rhs = new_binary(ND_MUL, rhs, new_num(4));
 	return new_binary(ND_ADD, lhs, rhs);
 }
 
-static Node *new_sub(Node *lhs, Node *rhs) {
-	add_type(lhs);
-	add_type(rhs);
-
+static NodeId new_sub(NodeId lhs, NodeId rhs) {
 	// num - num
 	if (is_int(lhs) && is_int(rhs))
 		return new_binary(ND_SUB, lhs, rhs);
 
 	// ptr - num
-	if (lhs->type->base && is_int(rhs)) {
+	if (is_ptr(lhs) && is_int(rhs)) {
 		rhs = new_binary(ND_MUL, rhs, new_num(4));
-		add_type(rhs);
-		Node *node = new_binary(ND_SUB, lhs, rhs);
-		node->type = lhs->type;
-		return node;
+		return new_binary(ND_SUB, lhs, rhs);
 	}
 
 	// ptr - ptr
-	if (lhs->type->base && rhs->type->base) {
-		Node *node = new_binary(ND_SUB, lhs, rhs);
-		node->type = &TypeInt;
+	if (is_ptr(lhs) && is_ptr(rhs)) {
+		NodeId node = new_binary(ND_SUB, lhs, rhs);
+		N(node)->type = &TypeInt;
 		return new_binary(ND_DIV, node, new_num(4));
 	}
 
@@ -97,346 +135,494 @@ static Node *new_sub(Node *lhs, Node *rhs) {
 	return 0;
 }
 
-static Obj Locals[512];
-Obj *CurrentLocal = 0;
-static char *Names[2048] = {0};
-char *CurrentChar = (char *)Names;
-static Function Functions[128] = {0};
-static Function *CurrentFunction;
-static unsigned int FunctionCount;
-static Type Types[128] = {0};
-static Type *CurrentType;
+Function *Functions;
+unsigned int FunctionCount;
 
-static Node *new_variable(Obj *var) {
-	Node *node = new_node(ND_VAR);
-	node->var = var;
+NodeId new_variable(Obj *var) {
+	NodeId node = new_node(ND_VAR);
+	N(node)->var = var;
+	N(node)->type = var->type;
 	return node;
 }
 
-static Obj *new_lvar(char *name, unsigned int len) {
-	Obj *var = CurrentLocal;
-	CurrentLocal += 1;
-	memcpy(CurrentChar, name, len);
-	var->name = CurrentChar;
-	CurrentChar += len;
-	*CurrentChar = 0;
-	CurrentChar += 1;
-	return var;
+// Appends node to the list starting at *head, returns the new tail
+static NodeId append(NodeId *head, NodeId tail, NodeId node) {
+	if (!node) return tail;
+	if (tail)
+		N(tail)->next = node;
+	else
+		*head = node;
+	return node;
+}
+
+// Block scopes. FunctionLocals is the current function's locals, newest
+// first, so everything declared inside a scope sits in front of the head the
+// scope saw when it was entered. Leaving a scope walks back to that head and
+// restores whatever each local shadowed, the oldest declaration is visited
+// last and restores the binding from outside the scope
+static Obj *FunctionLocals;
+static unsigned int FunctionLocalCount;
+static int ScopeDepth;
+
+// Whether a break is allowed here. break only leaves a switch, and a loop
+// inside one hides it
+static bool InSwitch;
+
+static Obj *enter_scope() {
+	ScopeDepth += 1;
+	return FunctionLocals;
 }
 
-static char *new_funcname(char *name, unsigned int len) {
-	char *value = CurrentChar;
-	memcpy(CurrentChar, name, len);
-	CurrentChar += len;
-	*CurrentChar = 0;
-	CurrentChar += 1;
-	return value;
+static void leave_scope(Obj *outer) {
+	for (Obj *var = FunctionLocals; var != outer; var = var->next) {
+		if (var->sym)
+			var->sym->var = var->shadowed;
+	}
+	ScopeDepth -= 1;
 }
 
-static bool equal(const Token *token, char *op) {
-	for (unsigned int i = 0; i < token->len; ++i) {
-		if (token->loc[i] != op[i]) return 0;
+static Obj *new_lvar(const Token *tok) {
+	Symbol *sym = tok->sym;
+	if (sym->var && sym->var->scope_depth == ScopeDepth) {
+		error_tok(tok, "redefinition of '%s'", sym->name);
+		error_parsing = true;
 	}
-	return (op[token->len] == '\0');
+
+	Obj *var = arena_push_struct(&LocalArena, Obj);
+	var->sym = sym;
+	var->name = sym->name;
+	var->scope_depth = ScopeDepth;
+	var->shadowed = sym->var;
+	sym->var = var;
+	var->next = FunctionLocals;
+	FunctionLocals = var;
+	FunctionLocalCount += 1;
+	return var;
+}
+
+// A local for a value the parser has to read more than once, with no name
+static Obj *new_hidden_lvar() {
+	Obj *var = arena_push_struct(&LocalArena, Obj);
+	var->name = "(temporary)";
+	var->type = &TypeInt;
+	var->scope_depth = ScopeDepth;
+	var->next = FunctionLocals;
+	FunctionLocals = var;
+	FunctionLocalCount += 1;
+	return var;
+}
+
+// Locals made up by the optimizer never have a name in scope
+Obj *new_temp_lvar(Function *fn, Type *type) {
+	Obj *var = arena_push_struct(&LocalArena, Obj);
+	var->name = "(temporary)";
+	var->type = type ? type : &TypeInt;
+	var->next = fn->locals;
+	fn->locals = var;
+	fn->local_count += 1;
+	return var;
+}
+
+static bool equal(const Token *token, TokenId id) {
+	return token->id == id;
 }
 
-void skip(char *s) {
+void skip(TokenId id) {
 	const Token *tok = CurrentToken();
-	if (!equal(tok, s)) {
-		error_tok(tok, "expected '%s' at '%s'", s, tok->loc);
+	if (!equal(tok, id)) {
+		error_tok(tok, "expected '%s' at '%s'", TokenId_str(id), tok->loc);
 		error_parsing = true;
 	}
 	NextToken();
 }
 
 Function *ParseTokens();
-static Node *expr();
-static Node *new_expr();
-static Node *mul();
-static Node *unary();
-static Node *primary();
-static Node *equality();
-static Node *relational();
-static Node *add();
-static Node *assign();
-static Node *complex_expr();
-static Node *declaration();
-static Node *funcall();
+static NodeId expr();
+static NodeId new_expr();
+static NodeId unary();
+static NodeId primary();
+static NodeId binary(int min_precedence);
+static NodeId conditional();
+static NodeId assign();
+static NodeId complex_expr();
+static NodeId switch_statement();
+static NodeId declaration();
+static NodeId funcall();
 static Function *function();
 
-static Obj *find_var(const Token *tok) {
-	for (Obj *var = Locals; var != CurrentLocal; ++var) {
-		if (strlen(var->name) == tok->len && !strncmp(tok->loc, var->name, tok->len))
-			return var;
-	}
-	return 0;
-}
-
 Function *ParseTokens() {
-	CurrentLocal = Locals;
-	CurrentChar = (char *)Names;
+	reset_nodes();
+	arena_reset(&LocalArena);
+	arena_reset(&FunctionArena);
+	arena_reset(&TypeArena);
+	TypeInt.pointer = 0;
+	ClearSymbolBindings();
+	ScopeDepth = 0;
+	InSwitch = false;
 	ResetCurrentToken();
 	error_parsing = false;
-	memset(AllNodes, 0, sizeof(AllNodes));
-	CurrentFunction = Functions;
-	CurrentType = Types;
-	while (CurrentToken()->kind && !error_parsing)
-		function();
-	FunctionCount = CurrentFunction - Functions;
+	Function head = {};
+	Function *current = &head;
+	FunctionCount = 0;
+	while (CurrentToken()->kind && !error_parsing) {
+		current = current->next = function();
+		current->index = FunctionCount++;
+	}
+	Functions = head.next;
 	return (!error_parsing && FunctionCount) ? Functions : 0;
 }
 
-static Node *new_expr() {
-	Node *node = expr();
-	skip(";");
+static NodeId new_expr() {
+	NodeId node = expr();
+	skip(PUNCT_SEMICOLON);
 	return node;
 }
 
-static Node *expr_or_block() {
-	Node *node = 0;
-
-	if (equal(CurrentToken(), ";")) {
-		NextToken();
-		return node;
-	}
+static NodeId expr_or_block() {
+	NodeId node = 0;
 
-	if (equal(CurrentToken(), "if")) {
-		node = new_node(ND_IF);
-		NextToken();
-		skip("(");
-		node->_if.condition = expr();
-		skip(")");
-		node->_if.then = expr_or_block();
-		node->_if.els = 0;
-		if (equal(CurrentToken(), "else")) {
+	switch (CurrentToken()->id) {
+		case PUNCT_SEMICOLON: {
 			NextToken();
-			node->_if.els = expr_or_block();
+			return node;
+		}
+		case KW_IF: {
+			node = new_node(ND_IF);
+			NextToken();
+			skip(PUNCT_LPAREN);
+			NodeId condition = expr();
+			skip(PUNCT_RPAREN);
+			NodeId then = expr_or_block();
+			NodeId els = 0;
+			if (equal(CurrentToken(), KW_ELSE)) {
+				NextToken();
+				els = expr_or_block();
+			}
+			N(node)->lhs = condition;
+			N(node)->rhs = then;
+			N(node)->els = els;
+			return node;
+		}
+		case KW_FOR: {
+			node = new_node(ND_FOR);
+			NodeId clauses = new_node(ND_FOR_CLAUSES);
+			N(node)->clauses = clauses;
+			NextToken();
+			skip(PUNCT_LPAREN);
+			NodeId init = 0, condition = 0, increment = 0;
+			if (!equal(CurrentToken(), PUNCT_SEMICOLON))
+				init = expr();
+			skip(PUNCT_SEMICOLON);
+			if (!equal(CurrentToken(), PUNCT_SEMICOLON))
+				condition = expr();
+			skip(PUNCT_SEMICOLON);
+			if (!equal(CurrentToken(), PUNCT_RPAREN))
+				increment = expr();
+			skip(PUNCT_RPAREN);
+			bool in_switch = InSwitch;
+			InSwitch = false;
+			NodeId then = expr_or_block();
+			InSwitch = in_switch;
+			N(clauses)->lhs = init;
+			N(clauses)->rhs = increment;
+			N(node)->lhs = condition;
+			N(node)->rhs = then;
+			return node;
+		}
+		case KW_WHILE: {
+			node = new_node(ND_FOR);
+			NodeId clauses = new_node(ND_FOR_CLAUSES);
+			N(node)->clauses = clauses;
+			NextToken();
+			skip(PUNCT_LPAREN);
+			NodeId condition = expr();
+			skip(PUNCT_RPAREN);
+			bool in_switch = InSwitch;
+			InSwitch = false;
+			NodeId then = expr_or_block();
+			InSwitch = in_switch;
+			N(node)->lhs = condition;
+			N(node)->rhs = then;
+			return node;
+		}
+		case KW_SWITCH:
+			return switch_statement();
+		case KW_BREAK: {
+			if (!InSwitch) {
+				error_tok(CurrentToken(), "break outside of a switch");
+				error_parsing = true;
+			}
+			node = new_node(ND_BREAK);
+			NextToken();
+			skip(PUNCT_SEMICOLON);
+			return node;
+		}
+		case KW_CASE:
+		case KW_DEFAULT: {
+			error_tok(CurrentToken(), "'%s' outside of the braces of a switch", TokenId_str(CurrentToken()->id));
+			error_parsing = true;
+			return node;
+		}
+		case KW_RETURN: {
+			NextToken();
+			node = new_unary(ND_RETURN, assign());
+			skip(PUNCT_SEMICOLON);
+			return node;
+		}
+		case PUNCT_LBRACE: {
+			NextToken();
+			return complex_expr();
 		}
-		return node;
-	}
-
-	if (equal(CurrentToken(), "for")) {
-		node = new_node(ND_FOR);
-		NextToken();
-		skip("(");
-		if (!equal(CurrentToken(), ";"))
-			node->_for.init = expr();
-		skip(";");
-		if (!equal(CurrentToken(), ";"))
-			node->_for.condition = expr();
-		skip(";");
-		if (!equal(CurrentToken(), ")"))
-			node->_for.increment = expr();
-		skip(")");
-		node->_for.then = expr_or_block();
-		return node;
-	}
-
-	if (equal(CurrentToken(), "while")) {
-		node = new_node(ND_FOR);
-		NextToken();
-		skip("(");
-		node->_for.condition = expr();
-		skip(")");
-		node->_for.then = expr_or_block();
-		return node;
-	}
-
-	if (equal(CurrentToken(), "return")) {
-		NextToken();
-		node = new_unary(ND_RETURN, assign());
-		skip(";");
-		return node;
 	}
 
-	if (equal(CurrentToken(), "{")) {
-		NextToken();
-		node = complex_expr();
-	} else {
-		node = expr();
-		skip(";");
-	}
+	node = expr();
+	skip(PUNCT_SEMICOLON);
 	return node;
 }
 
-static Node *complex_expr() {
-	Node head = {};
-	Node *current = &head;
+static NodeId complex_expr() {
+	NodeId head = 0;
+	NodeId current = 0;
+	Obj *outer = enter_scope();
 
-	while (*CurrentToken()->loc != '}' && !error_parsing) {
-		if (equal(CurrentToken(), "{")) {
+	while (!equal(CurrentToken(), PUNCT_RBRACE) && CurrentToken()->kind != TK_EOF && !error_parsing) {
+		if (equal(CurrentToken(), PUNCT_LBRACE)) {
 			NextToken();
-			current = current->next = complex_expr();
+			current = append(&head, current, complex_expr());
 			continue;
 		}
 
-		current = current->next = expr_or_block();
+		current = append(&head, current, expr_or_block());
 	}
 
-	skip("}");
+	skip(PUNCT_RBRACE);
+	leave_scope(outer);
 
-	Node *node = new_node(ND_BLOCK);
-	node->body = head.next;
+	NodeId node = new_node(ND_BLOCK);
+	N(node)->lhs = head;
 	return node;
 }
 
-static Node *expr() {
-	Node *node = 0;
+// case labels take an integer literal, optionally negated
+static int case_value() {
+	bool negative = equal(CurrentToken(), PUNCT_SUB);
+	if (negative)
+		NextToken();
+	if (CurrentToken()->kind != TK_NUM) {
+		error_tok(CurrentToken(), "expected an integer constant");
+		error_parsing = true;
+		return 0;
+	}
+	int val = CurrentToken()->val;
+	NextToken();
+	return negative ? -(unsigned int)val : val;
+}
 
-	if (equal(CurrentToken(), ";")) {
-		return new_node(ND_BLOCK);
+// switch (value) { case 1: ... default: ... }. The labels split the braces
+// into sections, an ND_CASE each, and control falls from one section into
+// the next. Labels have to be directly inside the braces. The dispatch may
+// compare the value several times, so anything but a local or a constant
+// is copied to a hidden local first
+static NodeId switch_statement() {
+	NodeId node = new_node(ND_SWITCH);
+	NextToken();
+	skip(PUNCT_LPAREN);
+	NodeId value = expr();
+	skip(PUNCT_RPAREN);
+	NodeId copy = 0;
+	if (value && N(value)->kind != ND_NUM && (N(value)->kind != ND_VAR || N(value)->var->escapes)) {
+		Obj *var = new_hidden_lvar();
+		copy = new_binary(ND_ASSIGN, new_variable(var), value);
+		value = new_variable(var);
 	}
+	N(node)->lhs = value;
+
+	skip(PUNCT_LBRACE);
+	bool in_switch = InSwitch;
+	InSwitch = true;
+	Obj *outer = enter_scope();
+	NodeId section = 0, body = 0, tail = 0;
+	while (!equal(CurrentToken(), PUNCT_RBRACE) && CurrentToken()->kind != TK_EOF && !error_parsing) {
+		TokenId id = CurrentToken()->id;
+		if (id != KW_CASE && id != KW_DEFAULT) {
+			if (!section) {
+				error_tok(CurrentToken(), "expected a case label");
+				error_parsing = true;
+				break;
+			}
+			NodeId stmt = expr_or_block();
+			tail = append(&N(body)->lhs, tail, stmt);
+			continue;
+		}
 
-	if (equal(CurrentToken(), "int")) {
-		node = declaration();
-		return node;
+		NodeId label = new_node(ND_CASE);
+		NextToken();
+		if (id == KW_CASE) {
+			int val = case_value();
+			N(label)->val = val;
+		} else if (N(node)->default_case) {
+			error_tok(NodesCold[label].tok, "more than one default label");
+			error_parsing = true;
+		} else {
+			N(node)->default_case = label;
+		}
+		skip(PUNCT_COLON);
+		body = new_node(ND_BLOCK);
+		N(label)->lhs = body;
+		if (section)
+			N(section)->rhs = label;
+		else
+			N(node)->rhs = label;
+		section = label;
+		tail = 0;
+	}
+	skip(PUNCT_RBRACE);
+	leave_scope(outer);
+	InSwitch = in_switch;
+
+	if (!copy) return node;
+	N(copy)->next = node;
+	NodeId block = new_node(ND_BLOCK);
+	N(block)->lhs = copy;
+	return block;
+}
+
+static NodeId expr() {
+	NodeId node = 0;
+
+	switch (CurrentToken()->id) {
+		case PUNCT_SEMICOLON:
+			return new_node(ND_BLOCK);
+		case KW_INT:
+			node = declaration();
+			return node;
 	}
 
 	return assign();
 }
 
-static Node *assign() {
-	Node *node = equality();
-	if (equal(CurrentToken(), "=")) {
+static NodeId assign() {
+	NodeId node = conditional();
+	if (equal(CurrentToken(), PUNCT_ASSIGN)) {
 		NextToken();
 		node = new_binary(ND_ASSIGN, node, assign());
 	}
 	return node;
 }
 
-static Node *add() {
-	Node *node = mul();
-
-	for (;;) {
-		if (equal(CurrentToken(), "+")) {
-			NextToken();
-			node = new_add(node, mul());
-			continue;
-		}
-
-		if (equal(CurrentToken(), "-")) {
-			NextToken();
-			node = new_sub(node, mul());
-			continue;
-		}
+static NodeId conditional() {
+	NodeId condition = binary(1);
+	if (!equal(CurrentToken(), PUNCT_QUESTION))
+		return condition;
 
-		return node;
-	}
+	NextToken();
+	NodeId then = assign();
+	skip(PUNCT_COLON);
+	NodeId els = conditional();
+
+	NodeId node = new_node(ND_COND);
+	N(node)->lhs = condition;
+	N(node)->rhs = then;
+	N(node)->els = els;
+	N(node)->type = N(then)->type;
+	return node;
 }
 
-static Node *equality() {
-	Node *node = relational();
+// Binary operators indexed by token id, higher precedence binds tighter and
+// 0 means the token does not continue an expression
+static const struct {
+	u8 precedence;
+	u8 kind; // NodeKind
+} BinaryOps[TOKEN_ID_COUNT] = {
+	[PUNCT_LOGOR] = {1, ND_LOGOR},
+	[PUNCT_LOGAND] = {2, ND_LOGAND},
+	[PUNCT_PIPE] = {3, ND_BITOR},
+	[PUNCT_CARET] = {4, ND_BITXOR},
+	[PUNCT_AMP] = {5, ND_BITAND},
+	[PUNCT_EQ] = {6, ND_EQ},
+	[PUNCT_NE] = {6, ND_NE},
+	[PUNCT_LT] = {7, ND_LT},
+	[PUNCT_LE] = {7, ND_LE},
+	[PUNCT_GT] = {7, ND_GT},
+	[PUNCT_GE] = {7, ND_GE},
+	[PUNCT_SHL] = {8, ND_SHL},
+	[PUNCT_SHR] = {8, ND_SHR},
+	[PUNCT_ADD] = {9, ND_ADD},
+	[PUNCT_SUB] = {9, ND_SUB},
+	[PUNCT_MUL] = {10, ND_MUL},
+	[PUNCT_DIV] = {10, ND_DIV},
+	[PUNCT_MOD] = {10, ND_MOD},
+};
+
+// Precedence climbing, every binary operator is left associative so the
+// right operand only takes operators that bind tighter than this one
+static NodeId binary(int min_precedence) {
+	NodeId node = unary();
 
 	for (;;) {
-		if (equal(CurrentToken(), "==")) {
-			NextToken();
-			node = new_binary(ND_EQ, node, relational());
-			continue;
-		}
+		TokenId id = CurrentToken()->id;
+		int precedence = BinaryOps[id].precedence;
+		if (precedence < min_precedence || error_parsing)
+			return node;
 
-		if (equal(CurrentToken(), "!=")) {
-			NextToken();
-			node = new_binary(ND_NE, node, relational());
-			continue;
+		NodeKind kind = BinaryOps[id].kind;
+		NextToken();
+		NodeId rhs = binary(precedence + 1);
+		switch (kind) {
+			case ND_ADD: node = new_add(node, rhs); break;
+			case ND_SUB: node = new_sub(node, rhs); break;
+			default: node = new_binary(kind, node, rhs); break;
 		}
-
-		return node;
 	}
 }
 
-static Node *relational() {
-	Node *node = add();
-
-	for (;;) {
-		if (equal(CurrentToken(), "<")) {
-			NextToken();
-			node = new_binary(ND_LT, node, add());
-			continue;
-		}
-		if (equal(CurrentToken(), "<=")) {
+static NodeId unary() {
+	switch (CurrentToken()->id) {
+		case PUNCT_ADD: {
 			NextToken();
-			node = new_binary(ND_LE, node, add());
-			continue;
-		}
-		if (equal(CurrentToken(), ">")) {
-			NextToken();
-			node = new_binary(ND_GT, node, add());
-			continue;
+			return unary();
 		}
-		if (equal(CurrentToken(), ">=")) {
+		case PUNCT_SUB: {
 			NextToken();
-			node = new_binary(ND_GE, node, add());
-			continue;
+			return new_unary(ND_NEG, unary());
 		}
-
-		return node;
-	}
-}
-
-static Node *mul() {
-	Node *node = unary();
-
-	for (;;) {
-		if (equal(CurrentToken(), "*")) {
+		case PUNCT_AMP: {
 			NextToken();
-			node = new_binary(ND_MUL, node, unary());
-			continue;
+			NodeId node = new_unary(ND_ADDR, unary());
+			NodeId operand = N(node)->lhs;
+			if (N(operand)->kind == ND_VAR)
+				N(operand)->var->escapes = true;
+			return node;
 		}
-
-		if (equal(CurrentToken(), "/")) {
+		case PUNCT_MUL: {
 			NextToken();
-			node = new_binary(ND_DIV, node, unary());
-			continue;
+			return new_unary(ND_DEREF, unary());
 		}
-
-		return node;
-	}
-}
-
-static Node *unary() {
-	if (equal(CurrentToken(), "+")) {
-		NextToken();
-		return unary();
-	}
-
-	if (equal(CurrentToken(), "-")) {
-		NextToken();
-		return new_unary(ND_NEG, unary());
-	}
-
-	if (equal(CurrentToken(), "&")) {
-		NextToken();
-		return new_unary(ND_ADDR, unary());
-	}
-
-	if (equal(CurrentToken(), "*")) {
-		NextToken();
-		return new_unary(ND_DEREF, unary());
 	}
 
 	return primary();
 }
 
-static Node *primary() {
-	if (equal(CurrentToken(), "(")) {
+static NodeId primary() {
+	if (equal(CurrentToken(), PUNCT_LPAREN)) {
 		NextToken();
-		Node *node = expr();
-		skip(")");
+		NodeId node = expr();
+		skip(PUNCT_RPAREN);
 		return node;
 	}
 
 	if (CurrentToken()->kind == TK_NUM) {
-		Node *node = new_num(CurrentToken()->val);
+		NodeId node = new_num(CurrentToken()->val);
 		NextToken();
 		return node;
 	}
 
 	if (CurrentToken()->kind == TK_IDENTIFIER) {
-		if (equal(CurrentToken() + 1, "(")) {
+		if (equal(CurrentToken() + 1, PUNCT_LPAREN)) {
 			return funcall();
 		}
 
-		Obj *var = find_var(CurrentToken());
+		Obj *var = CurrentToken()->sym->var;
 		if (!var) {
 			error_tok(CurrentToken(), "undefined variable");
 			error_parsing = true;
@@ -453,24 +639,26 @@ static Node *primary() {
 	return 0;
 }
 
-static Node *funcall() {
-	Node *node = new_node(ND_FUNCCALL);
-	node->tok = (Token *)CurrentToken();
-	node->_func.funcname = new_funcname(CurrentToken()->loc, CurrentToken()->len);
+static NodeId funcall() {
+	NodeId node = new_node(ND_FUNCCALL);
+	N(node)->sym = CurrentToken()->sym;
+	N(node)->type = &TypeInt;
 
 	NextToken();
-	skip("(");
+	skip(PUNCT_LPAREN);
 
-	Node *current;
-	if (!equal(CurrentToken(), ")")) {
-		current = node->_func.args = assign();
+	NodeId args = 0;
+	NodeId current = 0;
+	if (!equal(CurrentToken(), PUNCT_RPAREN)) {
+		current = append(&args, current, assign());
 
-		while (!equal(CurrentToken(), ")")) {
-			skip(",");
-			current = current->next = assign();
+		while (!equal(CurrentToken(), PUNCT_RPAREN) && !error_parsing) {
+			skip(PUNCT_COMMA);
+			current = append(&args, current, assign());
 		}
 
 	}
+	N(node)->lhs = args;
 
 	NextToken();
 	return node;
@@ -479,96 +667,171 @@ static Node *funcall() {
 Type *pointer_to(Type *base);
 
 static Type *declspec() {
-	skip("int");
+	skip(KW_INT);
 	return &TypeInt;
 }
 
 static Type *declarator(Type *type) {
-	while (equal(CurrentToken(), "*")) {
+	while (equal(CurrentToken(), PUNCT_MUL)) {
 		type = pointer_to(type);
 		NextToken();
 	}
-
-	type->name = (Token *)CurrentToken();
-	
 	return type;
 }
 
-static Node *declaration() {
+static NodeId declaration() {
 	Type *base_type = declspec();
 
-	Node head = {};
-	Node *current = &head;
+	NodeId head = 0;
+	NodeId current = 0;
 	bool first_loop = true;
 
-	while (!equal(CurrentToken(), ";")) {
+	while (!equal(CurrentToken(), PUNCT_SEMICOLON) && !error_parsing) {
 		if (first_loop)
 			first_loop = false;
 		else
-			skip(",");
+			skip(PUNCT_COMMA);
 
 		Type *type = declarator(base_type);
-		Obj *var = new_lvar(CurrentToken()->loc, CurrentToken()->len);
+		if (CurrentToken()->kind != TK_IDENTIFIER) {
+			error_tok(CurrentToken(), "expected a variable name");
+			error_parsing = true;
+			break;
+		}
+		Obj *var = new_lvar(CurrentToken());
+		var->type = type;
 		NextToken();
 
-		if (!equal(CurrentToken(), "="))
+		if (!equal(CurrentToken(), PUNCT_ASSIGN))
 			continue;
 
-		Node *lhs = new_variable(var);
+		NodeId lhs = new_variable(var);
 		NextToken();
-		Node *rhs = assign();
-		Node *node = new_binary(ND_ASSIGN, lhs, rhs);
-		current = current->next = node;
+		NodeId rhs = assign();
+		NodeId node = new_binary(ND_ASSIGN, lhs, rhs);
+		current = append(&head, current, node);
 	}
 
-	Node *node = new_node(ND_BLOCK);
-	node->body = head.next;
+	NodeId node = new_node(ND_BLOCK);
+	N(node)->lhs = head;
 	return node;
 }
 
+// ( int a, int *b ), each parameter takes the next WASM local
+static void params(Function *fn) {
+	skip(PUNCT_LPAREN);
+	while (!equal(CurrentToken(), PUNCT_RPAREN) && !error_parsing) {
+		if (fn->param_count)
+			skip(PUNCT_COMMA);
+		Type *type = declarator(declspec());
+		if (CurrentToken()->kind != TK_IDENTIFIER) {
+			error_tok(CurrentToken(), "expected a parameter name");
+			error_parsing = true;
+			return;
+		}
+		Obj *var = new_lvar(CurrentToken());
+		var->type = type;
+		var->is_param = true;
+		var->local_index = fn->param_count++;
+		NextToken();
+	}
+	skip(PUNCT_RPAREN);
+}
+
+// The closing brace of the block opened at tok, 0 if it is never closed
+static const Token *matching_brace(const Token *tok) {
+	if (!equal(tok, PUNCT_LBRACE)) return 0;
+	unsigned int depth = 0;
+	for (; tok->kind != TK_EOF; ++tok) {
+		if (equal(tok, PUNCT_LBRACE))
+			depth += 1;
+		else if (equal(tok, PUNCT_RBRACE) && --depth == 0)
+			return tok;
+	}
+	return 0;
+}
+
 static Function *function() {
+	const Token *start = CurrentToken();
 	Type *type = declspec();
 	type = declarator(type);
 
-	Function *fn = CurrentFunction++;
-	*fn = (Function){0};
-	fn->name = new_funcname(CurrentToken()->loc, CurrentToken()->len);
+	Function *fn = arena_push_struct(&FunctionArena, Function);
+	if (CurrentToken()->kind != TK_IDENTIFIER) {
+		error_tok(CurrentToken(), "expected a function name");
+		error_parsing = true;
+		return fn;
+	}
+	fn->sym = CurrentToken()->sym;
+	fn->name = fn->sym->name;
+	if (fn->sym->func) {
+		error_tok(CurrentToken(), "redefinition of '%s'", fn->name);
+		error_parsing = true;
+	}
+	fn->sym->func = fn;
 	NextToken();
-	skip("(");
-	skip(")");
-	skip("{");
-	Obj *start = CurrentLocal;
+
+	// Parameters are in a scope of their own around the body
+	FunctionLocals = 0;
+	FunctionLocalCount = 0;
+	Obj *outer = enter_scope();
+	params(fn);
+
+	// A function with the same tokens as last compile keeps its code, the
+	// body is skipped without building any nodes
+	const Token *end = matching_brace(CurrentToken());
+	if (end) {
+		fn->token_count = end + 1 - start;
+		// Code differs between optimization levels and with tail calls, so
+		// both are part of the key
+		fn->hash = hash_tokens(start, end + 1) ^ OptimizationLevel ^ (u64)TailCalls << 8;
+		fn->cached = find_cached_function(fn->hash, fn->token_count);
+		if (fn->cached) {
+			leave_scope(outer);
+			SetCurrentToken(end + 1);
+			return fn;
+		}
+	}
+
+	skip(PUNCT_LBRACE);
 	fn->body = complex_expr();
-	fn->locals = start;
-	fn->local_count = CurrentLocal - start;
+	fn->locals = FunctionLocals;
+	fn->local_count = FunctionLocalCount;
+	leave_scope(outer);
 	return fn;
 }
 
+// Pointer types are interned on their base type, so every int* is the same Type
 Type *pointer_to(Type *base) {
-	Type *type = CurrentType++;
+	if (base->pointer)
+		return base->pointer;
+	Type *type = arena_push_struct(&TypeArena, Type);
 	type->kind = TYPE_PTR;
 	type->base = base;
+	base->pointer = type;
 	return type;
 }
 
-void add_type(Node *node) {
-	if (!node) return;
-	
-	add_type(node->lhs);
-	add_type(node->rhs);
-	// add_type(node->_for.init);
-	// add_type(node->_for.condition);
-	// add_type(node->_for.increment);
-	// add_type(node->_for.then);
+void add_type(NodeId id) {
+	Node *node = N(id);
+	if (node->type) return;
 
 	switch (node->kind) {
 		case ND_ADD:
 		case ND_SUB:
 		case ND_MUL:
 		case ND_DIV:
+		case ND_MOD:
+		case ND_SHL:
+		case ND_SHR:
+		case ND_BITAND:
+		case ND_BITOR:
+		case ND_BITXOR:
 		case ND_NEG:
 		case ND_ASSIGN:
-			node->type = node->lhs->type;
+		case ND_MAX:
+		case ND_MIN:
+			node->type = N(node->lhs)->type;
 			return;
 		case ND_EQ:
 		case ND_NE:
@@ -576,17 +839,31 @@ void add_type(Node *node) {
 		case ND_GE:
 		case ND_LT:
 		case ND_LE:
-		case ND_VAR:
+			// Lanewise on vectors, all ones where it holds
+			node->type = is_vector(node->lhs) ? &TypeV128 : &TypeInt;
+			return;
+		case ND_SPLAT:
+			node->type = &TypeV128;
+			return;
+		case ND_LOGAND:
+		case ND_LOGOR:
 		case ND_NUM:
 		case ND_FUNCCALL:
+		case ND_LANE:
+		case ND_MULHI:
 			node->type = &TypeInt;
 			return;
-		case ND_ADDR:
-			node->type = pointer_to(node->lhs->type);
+		case ND_VAR:
+			node->type = node->var->type;
+			return;
+		case ND_ADDR: {
+			Type *base = N(node->lhs)->type;
+			node->type = pointer_to(base ? base : &TypeInt);
 			return;
+		}
 		case ND_DEREF:
-			if (node->lhs->type->kind == TYPE_PTR)
-				node->type = node->lhs->type->base;
+			if (is_ptr(node->lhs))
+				node->type = N(node->lhs)->type->base;
 			else
 				node->type = &TypeInt;
 			return;
@@ -614,181 +891,693 @@ static char *NodeKind_str[] = {
 	"ND_IF",
 	"ND_FOR",
 	"ND_ADDR",
-	"ND_DEREF"
+	"ND_DEREF",
+	"ND_FUNCCALL",
+	"ND_FOR_CLAUSES",
+	"ND_MOD",
+	"ND_SHL",
+	"ND_SHR",
+	"ND_BITAND",
+	"ND_BITOR",
+	"ND_BITXOR",
+	"ND_LOGAND",
+	"ND_LOGOR",
+	"ND_COND",
+	"ND_SWITCH",
+	"ND_CASE",
+	"ND_BREAK",
+	"ND_SPLAT",
+	"ND_LANE",
+	"ND_MAX",
+	"ND_MIN",
+	"ND_MULHI",
 };
 
-static void _print_tree(Node *node) {
+static void _print_tree(NodeId id) {
+	const Node *node = N(id);
 	print(NodeKind_str[node->kind]);
 	if (node->lhs) print_tree(node->lhs);
 	if (node->rhs) print_tree(node->rhs);
+	switch (node->kind) {
+		case ND_IF:
+		case ND_COND:
+			if (node->els) print_tree(node->els);
+			break;
+		case ND_FOR:
+			print_tree(node->clauses);
+			break;
+	}
 }
 
-void print_tree(Node *node) {
+void print_tree(NodeId node) {
 	while (node) {
 		_print_tree(node);
-		node = node->next;
+		node = N(node)->next;
 	}
 }
 
-static unsigned int total_byte_length;
-static unsigned int n_byte_length;
-static unsigned char *c = 0;
+bool TailCalls = true;
+
+static Arena OutputArena = {"output"};
+static ByteBuffer Code = {&OutputArena};
+#define emit(byte) emit_byte(&Code, byte)
+
+// Start of the function body being generated, relocations are relative to it
+static unsigned int BodyStart;
 
 static Function *current_fn;
+static unsigned int FrameLocal; // of current_fn, when it has a frame
+static bool error_codegen;
+
+// Call sites in the body being generated, kept with its cached code
+static CallReloc *Relocs;
+static unsigned int RelocCount;
+static unsigned int RelocCapacity;
+
+static unsigned int count_args(NodeId call) {
+	unsigned int count = 0;
+	for (NodeId arg = N(call)->lhs; arg; arg = N(arg)->next)
+		count += 1;
+	return count;
+}
+
+// Reports calls to undefined functions and calls with the wrong number of
+// arguments, returns the callee if there is one
+static Function *check_call(NodeId call) {
+	const Node *node = N(call);
+	Function *fn = node->sym->func;
+	if (!fn) {
+		error_tok(NodesCold[call].tok, "undefined function '%s'", node->sym->name);
+		error_codegen = true;
+	} else if (count_args(call) != fn->param_count) {
+		error_tok(NodesCold[call].tok, "'%s' takes %u arguments, not %u", node->sym->name, fn->param_count, count_args(call));
+		error_codegen = true;
+	}
+	return fn;
+}
+
+static void add_reloc(unsigned int offset, NodeId call) {
+	if (RelocCount == RelocCapacity) {
+		RelocCapacity = RelocCapacity ? RelocCapacity * 2 : 16;
+		CallReloc *relocs = arena_push_array(&RelocArena, CallReloc, RelocCapacity);
+		if (RelocCount)
+			memcpy(relocs, Relocs, RelocCount * sizeof(CallReloc));
+		Relocs = relocs;
+	}
+	const Symbol *callee = N(call)->sym;
+	Relocs[RelocCount++] = (CallReloc){offset, callee->name, callee->len, count_args(call)};
+}
+
+static void _gen_expr(NodeId id, int *depth);
+
+// Signed comparisons, indexed from ND_EQ
+static const u8 CompareOps[] = {OP_I32_EQ, OP_I32_NE, OP_I32_LT_S, OP_I32_LE_S, OP_I32_GT_S, OP_I32_GE_S};
+
+static bool is_compare(NodeKind kind) {
+	return kind >= ND_EQ && kind <= ND_GE;
+}
+
+// !(a op b) is a (inverted op) b
+static NodeKind invert_compare(NodeKind kind) {
+	switch (kind) {
+		case ND_EQ: return ND_NE;
+		case ND_NE: return ND_EQ;
+		case ND_LT: return ND_GE;
+		case ND_LE: return ND_GT;
+		case ND_GT: return ND_LE;
+		case ND_GE: return ND_LT;
+	}
+	return kind;
+}
+
+static bool is_zero(NodeId id) {
+	return N(id)->kind == ND_NUM && N(id)->val == 0;
+}
+
+// Conditions only have to be zero or non-zero, so they are generated
+// without normalizing to 0 or 1. negate inverts the test, with the
+// opposite comparison where there is one and i32.eqz otherwise
+static void gen_cond(NodeId id, bool negate) {
+	const Node *node = N(id);
+	int depth = 0;
+	if (is_compare(node->kind)) {
+		NodeKind kind = negate ? invert_compare(node->kind) : node->kind;
+		// x == 0 and x != 0 test x directly
+		if ((kind == ND_EQ || kind == ND_NE) && (is_zero(node->lhs) || is_zero(node->rhs))) {
+			gen_cond(is_zero(node->rhs) ? node->lhs : node->rhs, kind == ND_EQ);
+			return;
+		}
+		_gen_expr(node->lhs, &depth);
+		_gen_expr(node->rhs, &depth);
+		emit(CompareOps[kind - ND_EQ]);
+		return;
+	}
+	if (node->kind == ND_LOGAND || node->kind == ND_LOGOR) {
+		// !(a && b) is !a || !b and !(a || b) is !a && !b
+		bool is_and = (node->kind == ND_LOGAND) != negate;
+		gen_cond(node->lhs, negate);
+		emit(OP_IF);
+		emit(VAL_I32);
+		if (is_and) {
+			gen_cond(node->rhs, negate);
+			emit(OP_ELSE);
+			emit(OP_I32_CONST);
+			emit(0);
+		} else {
+			emit(OP_I32_CONST);
+			emit(1);
+			emit(OP_ELSE);
+			gen_cond(node->rhs, negate);
+		}
+		emit(OP_END);
+		return;
+	}
+	_gen_expr(id, &depth);
+	if (negate)
+		emit(OP_I32_EQZ);
+}
+
+// Value of a condition as 0 or 1
+static void gen_bool(NodeId id) {
+	NodeKind kind = N(id)->kind;
+	if (is_compare(kind) || kind == ND_LOGAND || kind == ND_LOGOR) {
+		int depth = 0;
+		_gen_expr(id, &depth);
+		return;
+	}
+	gen_cond(id, true);
+	emit(OP_I32_EQZ);
+}
+
+unsigned int count_nodes(NodeId id, unsigned int limit) {
+	if (!id) return 0;
+	const Node *node = N(id);
+	unsigned int count = 1;
+	switch (node->kind) {
+		case ND_NUM:
+		case ND_VAR:
+			return 1;
+		case ND_FUNCCALL:
+			for (NodeId n = node->lhs; n && count < limit; n = N(n)->next)
+				count += count_nodes(n, limit - count);
+			return count;
+		case ND_COND:
+			count += count_nodes(node->els, limit - count);
+			break;
+	}
+	if (count < limit) count += count_nodes(node->lhs, limit - count);
+	if (count < limit) count += count_nodes(node->rhs, limit - count);
+	return count;
+}
+
+// Evaluating both arms of a select is only fine when they cannot have any
+// effect and cost about as much as the branch would
+static bool is_select_operand(NodeId id) {
+	NodeKind kind = N(id)->kind;
+	return kind == ND_NUM || kind == ND_VAR;
+}
+
+u8 vector_opcode(NodeKind kind) {
+	switch (kind) {
+		case ND_ADD: return SIMD_I32X4_ADD;
+		case ND_SUB: return SIMD_I32X4_SUB;
+		case ND_MUL: return SIMD_I32X4_MUL;
+		case ND_NEG: return SIMD_I32X4_NEG;
+		case ND_SHL: return SIMD_I32X4_SHL;
+		case ND_SHR: return SIMD_I32X4_SHR_S;
+		case ND_BITAND: return SIMD_V128_AND;
+		case ND_BITOR: return SIMD_V128_OR;
+		case ND_BITXOR: return SIMD_V128_XOR;
+		case ND_EQ: return SIMD_I32X4_EQ;
+		case ND_NE: return SIMD_I32X4_NE;
+		case ND_LT: return SIMD_I32X4_LT_S;
+		case ND_LE: return SIMD_I32X4_LE_S;
+		case ND_GT: return SIMD_I32X4_GT_S;
+		case ND_GE: return SIMD_I32X4_GE_S;
+		case ND_MAX: return SIMD_I32X4_MAX_S;
+		case ND_MIN: return SIMD_I32X4_MIN_S;
+		case ND_SPLAT: return SIMD_I32X4_SPLAT;
+	}
+	return 0;
+}
+
+NodeId vector_address(NodeId address, int *offset) {
+	const Node *node = N(address);
+	*offset = 0;
+	if (node->kind != ND_ADD || N(node->rhs)->kind != ND_NUM || N(node->rhs)->val < 0)
+		return address;
+	*offset = N(node->rhs)->val;
+	return node->lhs;
+}
 
-static void _gen_expr(Node *node, int *depth) {
+// Lanewise operators on v128 values, which only the vectorizer makes. A
+// shift takes its count as an i32
+static void gen_vector(NodeId id, int *depth) {
+	const Node *node = N(id);
+	switch (node->kind) {
+		case ND_DEREF: {
+			int offset;
+			_gen_expr(vector_address(node->lhs, &offset), depth);
+			emit_simd(&Code, SIMD_V128_LOAD);
+			emit(2);
+			emit_uleb(&Code, offset);
+			return;
+		}
+		case ND_SPLAT:
+		case ND_NEG:
+			_gen_expr(node->lhs, depth);
+			emit_simd(&Code, vector_opcode(node->kind));
+			return;
+	}
+	_gen_expr(node->lhs, depth);
+	_gen_expr(node->rhs, depth);
+	emit_simd(&Code, vector_opcode(node->kind));
+	*depth -= 1;
+}
+
+// Switches. Every section gets a block, the first section's innermost, and
+// one more around them all is the block break leaves:
+//
+//   block           ; the end of the switch
+//     block         ; section 1
+//       block       ; section 0
+//         dispatch
+//       end
+//       section 0
+//     end
+//     section 1
+//   end
+//
+// From the dispatch, label i starts section i and the label after the
+// last section leaves the switch. How it finds the label depends on how
+// densely the case values fill their range: a br_table indexed by value
+// minus the smallest case, a few compares in a row, or a binary search on
+// value >= the middle case that splits the cases until one of the other
+// two fits. Dispatch takes O(1) or O(log n) compares instead of O(n)
+
+// Fewer cases are compared one after the other
+#define SWITCH_TABLE_MIN_CASES 4
+// Entries a table may have per case, the rest go to the default
+#define SWITCH_TABLE_MAX_SPREAD 3
+#define SWITCH_LINEAR_MAX_CASES 3
+
+typedef struct SwitchCase SwitchCase;
+struct SwitchCase {
+	int value;
+	unsigned int section;
+};
+
+static Arena SwitchArena = {"switch cases"};
+
+// Labels between the code being generated and the end of the innermost
+// switch. Loops cannot contain a break, so only ifs are counted
+static unsigned int BreakDepth;
+
+// Branches to the section of the case value matches among cases, sorted and
+// distinct, or else to default_label. extra is the number of blocks the
+// dispatch has opened around the code so far
+static void gen_dispatch(NodeId value, const SwitchCase *cases, unsigned int count, unsigned int default_label, unsigned int extra) {
+	int depth = 0;
+	s64 first = cases[0].value;
+	u64 range = cases[count - 1].value - first + 1;
+	if (count >= SWITCH_TABLE_MIN_CASES && range <= (u64)count * SWITCH_TABLE_MAX_SPREAD) {
+		// A value below the first case wraps around to an index past the
+		// end of the table, which takes the default
+		_gen_expr(value, &depth);
+		if (first) {
+			emit(OP_I32_CONST);
+			emit_sleb(&Code, cases[0].value);
+			emit(OP_I32_SUB);
+		}
+		emit(OP_BRANCH_TABLE);
+		emit_uleb(&Code, range);
+		unsigned int next = 0;
+		for (u64 i = 0; i < range; ++i) {
+			if (first + (s64)i == cases[next].value)
+				emit_uleb(&Code, cases[next++].section + extra);
+			else
+				emit_uleb(&Code, default_label + extra);
+		}
+		emit_uleb(&Code, default_label + extra);
+		print("OP_BR_TABLE");
+		return;
+	}
+
+	if (count <= SWITCH_LINEAR_MAX_CASES) {
+		for (unsigned int i = 0; i < count; ++i) {
+			_gen_expr(value, &depth);
+			emit(OP_I32_CONST);
+			emit_sleb(&Code, cases[i].value);
+			emit(OP_I32_EQ);
+			emit(OP_BRANCH_IF);
+			emit_uleb(&Code, cases[i].section + extra);
+		}
+		emit(OP_BRANCH);
+		emit_uleb(&Code, default_label + extra);
+		return;
+	}
+
+	unsigned int half = count / 2;
+	emit(OP_BLOCK);
+	emit(0x40);
+	_gen_expr(value, &depth);
+	emit(OP_I32_CONST);
+	emit_sleb(&Code, cases[half].value);
+	emit(OP_I32_GE_S);
+	emit(OP_BRANCH_IF);
+	emit(0);
+	gen_dispatch(value, cases, half, default_label, extra + 1);
+	emit(OP_END);
+	gen_dispatch(value, cases + half, count - half, default_label, extra);
+}
+
+static void gen_switch(NodeId id) {
+	const Node *node = N(id);
+	unsigned int section_count = 0;
+	for (NodeId section = node->rhs; section; section = N(section)->rhs)
+		section_count += 1;
+	for (unsigned int i = 0; i <= section_count; ++i) {
+		emit(OP_BLOCK);
+		emit(0x40);
+	}
+
+	// Sorted by inserting each case in turn, switches are small
+	arena_reset(&SwitchArena);
+	SwitchCase *cases = arena_push_array(&SwitchArena, SwitchCase, section_count + 1);
+	unsigned int count = 0, index = 0, default_label = section_count;
+	for (NodeId section = node->rhs; section; section = N(section)->rhs, ++index) {
+		if (section == node->default_case) {
+			default_label = index;
+			continue;
+		}
+		int value = N(section)->val;
+		unsigned int i = count++;
+		for (; i && cases[i - 1].value > value; --i)
+			cases[i] = cases[i - 1];
+		if (i && cases[i - 1].value == value) {
+			error_tok(NodesCold[section].tok, "duplicate case value %d", value);
+			error_codegen = true;
+		}
+		cases[i] = (SwitchCase){value, index};
+	}
+	if (count) {
+		gen_dispatch(node->lhs, cases, count, default_label, 0);
+	} else {
+		emit(OP_BRANCH);
+		emit_uleb(&Code, default_label);
+	}
+
+	unsigned int break_depth = BreakDepth;
+	index = 0;
+	for (NodeId section = node->rhs; section; section = N(section)->rhs, ++index) {
+		emit(OP_END);
+		BreakDepth = section_count - 1 - index;
+		NodeId last = N(section)->lhs ? N(N(section)->lhs)->lhs : 0;
+		while (last && N(last)->next)
+			last = N(last)->next;
+		int depth = 0;
+		if (N(section)->lhs)
+			_gen_expr(N(section)->lhs, &depth);
+		// Blocks take no values, but nothing is left after a return
+		if (last && N(last)->kind == ND_RETURN)
+			continue;
+		for (; depth > 0; --depth)
+			emit(OP_DROP);
+	}
+	emit(OP_END);
+	BreakDepth = break_depth;
+}
+
+// opcode is OP_CALL or OP_RETURN_CALL
+static void gen_call(NodeId id, u8 opcode) {
+	Function *fn = check_call(id);
+	printf("%s - 0x%x\n", N(id)->sym->name, N(id)->lhs);
+	// The arguments are left on the stack, where the callee's parameters are
+	NodeId current = N(id)->lhs;
+	while (current) {
+		int depth = 0;
+		_gen_expr(current, &depth);
+		current = N(current)->next;
+	}
+	// Padded so a cached copy of this body can be patched in place
+	emit(opcode);
+	add_reloc(Code.length - BodyStart, id);
+	patch_slot(&Code, emit_slot(&Code), fn ? fn->index : 0);
+}
+
+static void _gen_expr(NodeId id, int *depth) {
+	Node *node = N(id);
+	if (is_vector(id) && node->kind != ND_VAR && node->kind != ND_ASSIGN) {
+		gen_vector(id, depth);
+		return;
+	}
 	switch (node->kind) {
 		case ND_BLOCK: {
 			int _depth = 0;
-			for (Node *n = node->body; n; n = n->next) {
+			for (NodeId n = node->lhs; n; n = N(n)->next) {
 				_gen_expr(n, &_depth);
-				if (n->next && _depth) {
+				if (N(n)->next && _depth) {
 					printf("OP_DROP - depth: %d", _depth);
-					c[n_byte_length++] = OP_DROP;
+					emit(OP_DROP);
 					--_depth;
 				}
 			}
-			*depth = _depth;
+			*depth += _depth;
 			return;
 		}
 		case ND_NUM: {
-			c[n_byte_length++] = OP_I32_CONST;
-			EncodeLEB128(c + n_byte_length, node->val, n_byte_length);
+			emit(OP_I32_CONST);
+			emit_sleb(&Code, node->val);
 			printf("OP_I32_CONST: %d\n", node->val);
 			*depth += 1;
 			return;
 		} break;
 		case ND_NEG: {
+			// 0 - x
+			emit(OP_I32_CONST);
+			emit(0);
+			printf("OP_I32_CONST: %d\n", 0);
 			_gen_expr(node->lhs, depth);
-			c[n_byte_length++] = OP_I32_CONST;
-			EncodeLEB128(c + n_byte_length, -1, n_byte_length);
-			printf("OP_I32_CONST: %d\n", -1);
-			c[n_byte_length++] = OP_I32_MUL;
-			print("OP_I32_MUL");
+			emit(OP_I32_SUB);
+			print("OP_I32_SUB");
 			return;
 		} break;
 		case ND_VAR: {
 			printf("Name: %s", node->var->name);
-			c[n_byte_length++] = OP_I32_CONST;
-			c[n_byte_length++] = 0;
-			printf("OP_I32_CONST: %d\n", 0);
-			c[n_byte_length++] = OP_I32_LOAD;
-			c[n_byte_length++] = 2;
-			EncodeLEB128(c + n_byte_length, node->var->offset, n_byte_length);
+			if (!node->var->escapes) {
+				emit(OP_GET_LOCAL);
+				emit_uleb(&Code, node->var->local_index);
+				*depth += 1;
+				return;
+			}
+			emit(OP_GET_LOCAL);
+			emit_uleb(&Code, FrameLocal);
+			emit(OP_I32_LOAD);
+			emit(2);
+			emit_uleb(&Code, node->var->offset);
 			printf("OP_I32_LOAD: %d", node->var->offset);
 			*depth += 1;
 			return;
 		} break;
 		case ND_ASSIGN: {
 			printf("OP_I32_CONST: %d\n", 0);
-			const Node *lhs = node->lhs;
-			if (lhs->kind == ND_VAR) {
-				c[n_byte_length++] = OP_I32_CONST;
-				c[n_byte_length++] = 0;
+			const Node *lhs = N(node->lhs);
+			if (lhs->kind == ND_VAR && !lhs->var->escapes) {
 				_gen_expr(node->rhs, depth);
-				c[n_byte_length++] = OP_I32_STORE;
-				c[n_byte_length++] = 2;
-				EncodeLEB128(c + n_byte_length, lhs->var->offset, n_byte_length);
+				emit(OP_SET_LOCAL);
+				emit_uleb(&Code, lhs->var->local_index);
+			} else if (lhs->kind == ND_VAR) {
+				emit(OP_GET_LOCAL);
+				emit_uleb(&Code, FrameLocal);
+				_gen_expr(node->rhs, depth);
+				emit(OP_I32_STORE);
+				emit(2);
+				emit_uleb(&Code, lhs->var->offset);
 				printf("OP_I32_STORE: %d", lhs->var->offset);
+			} else if (lhs->kind == ND_DEREF && is_vector(id)) {
+				int _depth = 0, offset;
+				_gen_expr(vector_address(lhs->lhs, &offset), &_depth);
+				_gen_expr(node->rhs, depth);
+				emit_simd(&Code, SIMD_V128_STORE);
+				emit(2);
+				emit_uleb(&Code, offset);
 			} else if (lhs->kind == ND_DEREF) {
 				int _depth = 0;
 				_gen_expr(lhs->lhs, &_depth);
 				_gen_expr(node->rhs, depth);
-				c[n_byte_length++] = OP_I32_STORE;
-				c[n_byte_length++] = 2;
-				c[n_byte_length++] = 0;
+				emit(OP_I32_STORE);
+				emit(2);
+				emit(0);
 			}
 			*depth -= 1;
 			return;
 		} break;
 		case ND_RETURN: {
+			if (TailCalls && !current_fn->stack_size && N(node->lhs)->kind == ND_FUNCCALL) {
+				gen_call(node->lhs, OP_RETURN_CALL);
+				*depth += 1;
+				return;
+			}
 			_gen_expr(node->lhs, depth);
+			if (current_fn->stack_size)
+				emit_epilogue(&Code, FrameLocal);
 			print("OP_RETURN");
-			c[n_byte_length++] = OP_RETURN;
+			emit(OP_RETURN);
 			return;
 		}
 		case ND_IF: {
-			int _depth = 0;
-			_gen_expr(node->_if.condition, &_depth);
-			c[n_byte_length++] = OP_I32_CONST;
-			c[n_byte_length++] = 0;
-			c[n_byte_length++] = OP_I32_NE;
-			c[n_byte_length++] = OP_IF;
-			c[n_byte_length++] = 0x40;
+			gen_cond(node->lhs, false);
+			emit(OP_IF);
+			emit(0x40);
 			print("OP_IF");
-			_depth = 0;
-			_gen_expr(node->_if.then, &_depth);
-			if (node->_if.els) {
+			BreakDepth += 1;
+			int _depth = 0;
+			_gen_expr(node->rhs, &_depth);
+			if (node->els) {
 				_depth = 0;
-				c[n_byte_length++] = OP_ELSE;
-				_gen_expr(node->_if.els, &_depth);
-			} c[n_byte_length++] = OP_END; return;
+				emit(OP_ELSE);
+				_gen_expr(node->els, &_depth);
+			}
+			BreakDepth -= 1;
+			emit(OP_END); return;
+		}
+		case ND_SWITCH:
+			gen_switch(id);
+			return;
+		case ND_BREAK:
+			emit(OP_BRANCH);
+			emit_uleb(&Code, BreakDepth);
+			return;
+		case ND_COND: {
+			int _depth = 0;
+			if (is_select_operand(node->rhs) && is_select_operand(node->els)) {
+				_gen_expr(node->rhs, &_depth);
+				_gen_expr(node->els, &_depth);
+				gen_cond(node->lhs, false);
+				emit(OP_SELECT);
+				*depth += 1;
+				return;
+			}
+			gen_cond(node->lhs, false);
+			emit(OP_IF);
+			emit(VAL_I32);
+			_gen_expr(node->rhs, &_depth);
+			emit(OP_ELSE);
+			_gen_expr(node->els, &_depth);
+			emit(OP_END);
+			*depth += 1;
+			return;
+		}
+		case ND_LOGAND:
+		case ND_LOGOR: {
+			// Short circuit, the result is normalized to 0 or 1
+			gen_cond(node->lhs, false);
+			emit(OP_IF);
+			emit(VAL_I32);
+			if (node->kind == ND_LOGAND) {
+				gen_bool(node->rhs);
+				emit(OP_ELSE);
+				emit(OP_I32_CONST);
+				emit(0);
+			} else {
+				emit(OP_I32_CONST);
+				emit(1);
+				emit(OP_ELSE);
+				gen_bool(node->rhs);
+			}
+			emit(OP_END);
+			*depth += 1;
+			return;
 		}
 		case ND_FOR: {
+			const Node *clauses = N(node->clauses);
 			int _depth = 0;
-			if (node->_for.init)
-				_gen_expr(node->_for.init, &_depth);
-			if (node->_for.condition) {
-				c[n_byte_length++] = OP_BLOCK;
-				c[n_byte_length++] = 0x40;
+			if (clauses->lhs)
+				_gen_expr(clauses->lhs, &_depth);
+			if (node->lhs && count_nodes(node->lhs, LOOP_ROTATE_MAX_NODES) >= LOOP_ROTATE_MAX_NODES) {
+				// A large condition is only emitted once, at the top
+				emit(OP_BLOCK);
+				emit(0x40);
+				emit(OP_LOOP);
+				emit(0x40);
+				gen_cond(node->lhs, true);
+				emit(OP_BRANCH_IF);
+				emit(1);
 				_depth = 0;
-				_gen_expr(node->_for.condition, &_depth);
-				c[n_byte_length++] = OP_I32_CONST;
-				c[n_byte_length++] = 0;
-				c[n_byte_length++] = OP_I32_EQ;
-				c[n_byte_length++] = OP_BRANCH_IF;
-				c[n_byte_length++] = 0;
+				if (node->rhs)
+					_gen_expr(node->rhs, &_depth);
+				if (clauses->rhs)
+					_gen_expr(clauses->rhs, &_depth);
+				emit(OP_BRANCH);
+				emit(0);
+				emit(OP_END);
+				emit(OP_END);
+				return;
+			}
+			// Rotated: a guard and the condition again at the bottom, so an
+			// iteration only takes one branch
+			if (node->lhs) {
+				emit(OP_BLOCK);
+				emit(0x40);
+				gen_cond(node->lhs, true);
+				emit(OP_BRANCH_IF);
+				emit(0);
 			}
-			c[n_byte_length++] = OP_LOOP;
-			c[n_byte_length++] = 0x40;
+			emit(OP_LOOP);
+			emit(0x40);
 			_depth = 0;
-			if (node->_for.then)
-				_gen_expr(node->_for.then, &_depth);
-			if (node->_for.increment)
-				_gen_expr(node->_for.increment, &_depth);
-			if (node->_for.condition) {
-				_depth = 0;
-				_gen_expr(node->_for.condition, &_depth);
-				c[n_byte_length++] = OP_I32_CONST;
-				c[n_byte_length++] = 0;
-				c[n_byte_length++] = OP_I32_NE;
-				c[n_byte_length++] = OP_BRANCH_IF;
-				c[n_byte_length++] = 0;
-				c[n_byte_length++] = OP_END;
+			if (node->rhs)
+				_gen_expr(node->rhs, &_depth);
+			if (clauses->rhs)
+				_gen_expr(clauses->rhs, &_depth);
+			if (node->lhs) {
+				gen_cond(node->lhs, false);
+				emit(OP_BRANCH_IF);
+				emit(0);
+				emit(OP_END);
 			} else {
-				c[n_byte_length++] = OP_BRANCH;
-				c[n_byte_length++] = 0;
+				emit(OP_BRANCH);
+				emit(0);
 			}
-			c[n_byte_length++] = OP_END;
+			emit(OP_END);
 			return;
 		}
 		case ND_DEREF: {
 			_gen_expr(node->lhs, depth);
-			c[n_byte_length++] = OP_I32_LOAD;
-			c[n_byte_length++] = 2;
-			c[n_byte_length++] = 0;
+			emit(OP_I32_LOAD);
+			emit(2);
+			emit(0);
+			return;
+		}
+		case ND_LANE: {
+			_gen_expr(node->lhs, depth);
+			emit_simd(&Code, SIMD_I32X4_EXTRACT_LANE);
+			emit(node->val);
+			return;
+		}
+		case ND_MULHI: {
+			_gen_expr(node->lhs, depth);
+			emit(OP_I64_EXTEND_I32_S);
+			_gen_expr(node->rhs, depth);
+			emit(OP_I64_EXTEND_I32_S);
+			emit_high_product(&Code);
+			*depth -= 1;
 			return;
 		}
 		case ND_ADDR: {
-			c[n_byte_length++] = OP_I32_CONST;
-			EncodeLEB128(c + n_byte_length, node->lhs->var->offset, n_byte_length);
+			emit(OP_GET_LOCAL);
+			emit_uleb(&Code, FrameLocal);
+			int offset = N(node->lhs)->var->offset;
+			if (offset) {
+				emit(OP_I32_CONST);
+				emit_sleb(&Code, offset);
+				emit(OP_I32_ADD);
+			}
 			*depth += 1;
 			return;
 		}
 		case ND_FUNCCALL: {
-			printf("%s - 0x%x\n", node->_func.funcname, (unsigned int)node->_func.args);
-			Node *current = node->_func.args;
-			while (current) {
-				int _depth = 0;
-				_gen_expr(current, &_depth);
-				current = current->next;
-			}
-			c[n_byte_length++] = OP_CALL;
-			for (int i = 0; i < FunctionCount; ++i) {
-				if (!strncmp(node->_func.funcname, Functions[i].name, -1)) {
-					c[n_byte_length++] = i;
-				}
-			}
+			gen_call(id, OP_CALL);
 			*depth += 1;
 			return;
 		}
@@ -799,167 +1588,400 @@ static void _gen_expr(Node *node, int *depth) {
 
 	switch (node->kind) {
 		case ND_ADD: {
-			c[n_byte_length++] = OP_I32_ADD;
+			emit(OP_I32_ADD);
 			print("OP_I32_ADD");
 			*depth -= 1;
 		} break;
 		case ND_SUB: {
-			c[n_byte_length++] = OP_I32_SUB;
+			emit(OP_I32_SUB);
 			print("OP_I32_SUB");
 			*depth -= 1;
 		} break;
 		case ND_MUL: {
-			c[n_byte_length++] = OP_I32_MUL;
+			emit(OP_I32_MUL);
 			print("OP_I32_MUL");
 			*depth -= 1;
 		} break;
 		case ND_DIV: {
-			c[n_byte_length++] = OP_I32_DIV_U;
+			emit(is_unsigned(node->lhs) ? OP_I32_DIV_U : OP_I32_DIV_S);
 			print("OP_I32_DIV");
 			*depth -= 1;
 		} break;
+		case ND_MOD: {
+			emit(is_unsigned(node->lhs) ? OP_I32_REM_U : OP_I32_REM_S);
+			print("OP_I32_REM");
+			*depth -= 1;
+		} break;
+		case ND_SHL: {
+			emit(OP_I32_SHL);
+			print("OP_I32_SHL");
+			*depth -= 1;
+		} break;
+		case ND_SHR: {
+			emit(is_unsigned(node->lhs) ? OP_I32_SHR_U : OP_I32_SHR_S);
+			print("OP_I32_SHR");
+			*depth -= 1;
+		} break;
+		case ND_BITAND: {
+			emit(OP_I32_AND);
+			print("OP_I32_AND");
+			*depth -= 1;
+		} break;
+		case ND_BITOR: {
+			emit(OP_I32_OR);
+			print("OP_I32_OR");
+			*depth -= 1;
+		} break;
+		case ND_BITXOR: {
+			emit(OP_I32_XOR);
+			print("OP_I32_XOR");
+			*depth -= 1;
+		} break;
 		case ND_EQ: {
-			c[n_byte_length++] = OP_I32_EQ;
+			emit(OP_I32_EQ);
 			print("OP_I32_EQ");
 			*depth -= 1;
 		} break;
 		case ND_NE: {
-			c[n_byte_length++] = OP_I32_NE;
+			emit(OP_I32_NE);
 			print("OP_I32_NE");
 			*depth -= 1;
 		} break;
 		case ND_LT: {
-			c[n_byte_length++] = OP_I32_LT_S;
+			emit(OP_I32_LT_S);
 			print("OP_I32_LT");
 			*depth -= 1;
 		} break;
 		case ND_LE: {
-			c[n_byte_length++] = OP_I32_LE_S;
+			emit(OP_I32_LE_S);
 			print("OP_I32_LE");
 			*depth -= 1;
 		} break;
 		case ND_GT: {
-			c[n_byte_length++] = OP_I32_GT_S;
+			emit(OP_I32_GT_S);
 			print("OP_I32_GT");
 			*depth -= 1;
 		} break;
 		case ND_GE: {
-			c[n_byte_length++] = OP_I32_GE_S;
+			emit(OP_I32_GE_S);
 			print("OP_I32_GE");
 			*depth -= 1;
 		} break;
 	}
 }
 
+// Locals whose address is never taken become WASM locals, after the
+// parameters and with the v128 ones last, only the escaping ones get a slot
+// in the function's frame. Locals are listed newest first and get the
+// highest slots, so the first declared is at the lowest address
 static void assign_lvar_offsets(Function *prog) {
-	int offset = 0;
-	for (int i = 0; i < prog->local_count; ++i) {
-		Obj *var = prog->locals + i;
-		offset += 4;
-		var->offset = 128 - offset;
-	}
-	prog->stack_size += align_to(offset, 16);
-}
-
-static unsigned long WASM_header(unsigned char *c) {
-	c[0] = 0;
-	c[1] = 'a';
-	c[2] = 's';
-	c[3] = 'm';
-	c[4] = 1;
-	c[5] = 0;
-	c[6] = 0;
-	c[7] = 0;
-	return 8;
-}
-
-unsigned int gen_expr(unsigned char *output_code) {
-	c = output_code;
-	CurrentType = Types;
-
-	c += WASM_header(c);
-
-	c[0] = SECTION_TYPE;
-	c[1] = 0x05;
-	c[2] = 0x01;
-	c[3] = 0x60;
-	c[4] = 0;
-	c[5] = 1;
-	c[6] = VAL_I32;
-	c += 7;
-
-	c[0] = SECTION_FUNC;
-	c[1] = 0x1 + FunctionCount;
-	c[2] = FunctionCount;
-	c += 3;
-	memset(c, 0, FunctionCount);
-	c += FunctionCount;
-
-	c[0] = SECTION_MEMORY;
-	c[1] = 0x3;
-	c[2] = 0x1;
-	c[3] = 0x0;
-	c[4] = 0x1;
-	c += 5;
-
-	c[0] = SECTION_EXPORT;
-	c[1] = 0x08;
-	c[2] = 0x01;
-	c[3] = 4;
-	c[4] = 'm';
-	c[5] = 'a';
-	c[6] = 'i';
-	c[7] = 'n';
-	c[8] = EXPORT_FUNC;
-	c[9] = 0;
-	c += 9;
-	n_byte_length = 0;
-	unsigned int f = 0;
-	for (; f < FunctionCount; ++f) {
-		if (!strncmp(Functions[f].name, "main", 4)) {
-			EncodeLEB128(c, f, n_byte_length);
-			break;
+	int size = 0;
+	unsigned int local_index = prog->param_count;
+	for (Obj *var = prog->locals; var; var = var->next) {
+		if (!var->escapes) {
+			if (!var->is_param && var->type != &TypeV128)
+				var->local_index = local_index++;
+			continue;
 		}
+		size += 4;
 	}
-	if (f == FunctionCount && *c == 0) {
-		print("Could not find main function");
-		return 0;
+	prog->wasm_local_count = local_index;
+	prog->stack_size = align_to(size, 16);
+
+	prog->vector_local_count = 0;
+	for (Obj *var = prog->locals; var; var = var->next) {
+		if (var->type == &TypeV128)
+			var->local_index = local_index + prog->vector_local_count++;
 	}
-	c += n_byte_length;
 
-	c[0] = SECTION_CODE;
-	// TODO: Allow Variable Length Byte Length
-	unsigned char *CodeSectionLength = c + 1;
-	c[2] = FunctionCount;
-	c += 3;
+	int offset = size;
+	for (Obj *var = prog->locals; var; var = var->next) {
+		if (!var->escapes) continue;
+		offset -= 4;
+		var->offset = offset;
+	}
+}
+
+void emit_local_declarations(ByteBuffer *code, unsigned int i32_count, unsigned int v128_count, bool frame) {
+	// Without v128 locals the frame base is one more i32
+	if (!v128_count) {
+		i32_count += frame;
+		frame = false;
+	}
+	emit_uleb(code, (i32_count != 0) + (v128_count != 0) + frame);
+	if (i32_count) {
+		emit_uleb(code, i32_count);
+		emit_byte(code, VAL_I32);
+	}
+	if (v128_count) {
+		emit_uleb(code, v128_count);
+		emit_byte(code, VAL_V128);
+	}
+	if (frame) {
+		emit_uleb(code, 1);
+		emit_byte(code, VAL_I32);
+	}
+}
+
+void emit_high_product(ByteBuffer *code) {
+	emit_byte(code, OP_I64_MUL);
+	emit_byte(code, OP_I64_CONST);
+	emit_sleb(code, 32);
+	emit_byte(code, OP_I64_SHR_S);
+	emit_byte(code, OP_I32_WRAP_I64);
+}
+
+void emit_prologue(ByteBuffer *code, const Function *fn, unsigned int frame_local) {
+	emit_byte(code, OP_GET_GLOBAL);
+	emit_uleb(code, 0);
+	emit_byte(code, OP_TEE_LOCAL);
+	emit_uleb(code, frame_local);
+	emit_byte(code, OP_I32_CONST);
+	emit_sleb(code, fn->stack_size);
+	emit_byte(code, OP_I32_ADD);
+	emit_byte(code, OP_SET_GLOBAL);
+	emit_uleb(code, 0);
+
+	// if (stack pointer > memory.size * 64KiB) unreachable
+	emit_byte(code, OP_GET_GLOBAL);
+	emit_uleb(code, 0);
+	emit_byte(code, OP_MEMORY_SIZE);
+	emit_byte(code, 0);
+	emit_byte(code, OP_I32_CONST);
+	emit_sleb(code, 16);
+	emit_byte(code, OP_I32_SHL);
+	emit_byte(code, OP_I32_GT_U);
+	emit_byte(code, OP_IF);
+	emit_byte(code, 0x40);
+	emit_byte(code, OP_UNREACHABLE);
+	emit_byte(code, OP_END);
+
+	// Parameters whose address is taken move to their slot
+	for (const Obj *var = fn->locals; var; var = var->next) {
+		if (!var->is_param || !var->escapes) continue;
+		emit_byte(code, OP_GET_LOCAL);
+		emit_uleb(code, frame_local);
+		emit_byte(code, OP_GET_LOCAL);
+		emit_uleb(code, var->local_index);
+		emit_byte(code, OP_I32_STORE);
+		emit_byte(code, 2);
+		emit_uleb(code, var->offset);
+	}
+}
+
+void emit_epilogue(ByteBuffer *code, unsigned int frame_local) {
+	emit_byte(code, OP_GET_LOCAL);
+	emit_uleb(code, frame_local);
+	emit_byte(code, OP_SET_GLOBAL);
+	emit_uleb(code, 0);
+}
+
+// Copies a cached body to the output and points its calls at the callees'
+// current indices
+static void link_cached_function(const CachedFunction *cached) {
+	emit_bytes(&Code, cached->code, cached->code_len);
+	for (unsigned int i = 0; i < cached->reloc_count; ++i) {
+		const CallReloc *reloc = cached->relocs + i;
+		Symbol *callee = find_symbol(reloc->callee, reloc->callee_len);
+		if (!callee || !callee->func) {
+			printf("undefined function '%s'", reloc->callee);
+			error_codegen = true;
+			continue;
+		}
+		if (callee->func->param_count != reloc->arg_count) {
+			printf("'%s' takes %u arguments, not %u", reloc->callee, callee->func->param_count, reloc->arg_count);
+			error_codegen = true;
+		}
+		patch_slot(&Code, BodyStart + reloc->offset, callee->func->index);
+	}
+}
 
-	for (int i = 0; i < FunctionCount; ++i) {
-		Function *f = Functions + i;
-		n_byte_length = 0;
-		c += 2;
+// A call emit_ir wrote, offset is that of its padded callee index
+static void add_ir_call(unsigned int offset, NodeId call) {
+	Function *fn = check_call(call);
+	add_reloc(offset - BodyStart, call);
+	patch_slot(&Code, offset, fn ? fn->index : 0);
+}
+
+static void gen_function(Function *f) {
+	unsigned int size = emit_slot(&Code);
+	BodyStart = Code.length;
 
+	if (f->cached) {
+		const CachedFunction *cached = f->cached;
+		link_cached_function(cached);
+		cache_function(cached->hash, cached->token_count, cached->code, cached->code_len, cached->relocs, cached->reloc_count);
+	} else {
+		RelocCount = 0;
+		current_fn = f;
 		assign_lvar_offsets(f);
+		unsigned int code_start;
+		IrFunction *ir = 0;
+		if (OptimizationLevel >= OPT_O2) {
+			f64 start = _now();
+			ir = build_ir(f);
+			if (ir) {
+				optimize_ir(ir);
+				code_start = emit_ir(ir, &Code, add_ir_call);
+			}
+			end_pass(PASS_IR, start);
+		}
+		if (!ir) {
+			// Generated straight from the tree, the frame base goes after the locals
+			FrameLocal = f->wasm_local_count + f->vector_local_count;
+			emit_local_declarations(&Code, f->wasm_local_count - f->param_count, f->vector_local_count, f->stack_size != 0);
+			code_start = Code.length;
+			if (f->stack_size)
+				emit_prologue(&Code, f, FrameLocal);
+
+			int depth = 0;
+			_gen_expr(f->body, &depth);
+			printf("depth: %d", depth);
+			if (depth == 0) {
+				// The end of the body returns what is left on the stack
+				emit(OP_I32_CONST);
+				emit(0);
+				print("Adding 0 as default result");
+				printf("OP_I32_CONST: %d\n", 0);
+			}
+			if (f->stack_size)
+				emit_epilogue(&Code, FrameLocal);
+		}
 
-		int depth = 0;
-		_gen_expr(f->body, &depth);
-		printf("depth: %d", depth);
-		if (depth == 0) {
-			c[n_byte_length++] = OP_I32_CONST;
-			c[n_byte_length++] = 0;
-			c[n_byte_length++] = OP_RETURN;
-			print("Adding 0 as default result");
-			printf("OP_I32_CONST: %d\n", 0);
+		emit(OP_END);
+		if (OptimizationLevel >= OPT_O1) {
+			f64 start = _now();
+			peephole(&Code, BodyStart, code_start, Relocs, RelocCount);
+			end_pass(PASS_PEEPHOLE, start);
 		}
+		if (f->token_count)
+			cache_function(f->hash, f->token_count, Code.data + BodyStart, Code.length - BodyStart, Relocs, RelocCount);
+	}
+
+	end_section(&Code, size);
+}
 
-		c[n_byte_length++] = OP_END;
-		c -= 2;
+static Arena SignatureArena = {"signatures"};
 
-		c[0] = 1 + n_byte_length;
-		c[1] = 0x0;
-		c += 2 + n_byte_length;
+typedef struct Signature Signature;
+struct Signature {
+	unsigned int hash;
+	unsigned int offset, length; // of its encoding in the type section, 0 length for a free slot
+	unsigned int index;
+};
+
+static bool same_bytes(const unsigned char *a, const unsigned char *b, unsigned int length) {
+	for (unsigned int i = 0; i < length; ++i) {
+		if (a[i] != b[i]) return false;
 	}
+	return true;
+}
 
-	*CodeSectionLength = c - CodeSectionLength - 1;
+// Encodes every function's type into types, a type shared by several
+// functions is written once and they all get its index. Returns the number
+// of types
+static unsigned int encode_signatures(ByteBuffer *types) {
+	unsigned int capacity = 16;
+	while (capacity < FunctionCount * 2)
+		capacity *= 2;
+	Signature *table = arena_push_array(&SignatureArena, Signature, capacity);
+	memset(table, 0, capacity * sizeof(Signature));
+
+	unsigned int count = 0;
+	for (Function *f = Functions; f; f = f->next) {
+		// ints and pointers are both i32
+		unsigned int start = types->length;
+		emit_byte(types, 0x60);
+		emit_uleb(types, f->param_count);
+		for (unsigned int i = 0; i < f->param_count; ++i)
+			emit_byte(types, VAL_I32);
+		emit_uleb(types, 1);
+		emit_byte(types, VAL_I32);
+		unsigned int length = types->length - start;
+
+		// FNV-1a
+		unsigned int hash = 2166136261u;
+		for (unsigned int i = start; i < types->length; ++i) {
+			hash ^= types->data[i];
+			hash *= 16777619u;
+		}
+
+		unsigned int slot = hash & (capacity - 1);
+		for (; table[slot].length; slot = (slot + 1) & (capacity - 1)) {
+			const Signature *sig = table + slot;
+			if (sig->hash == hash && sig->length == length && same_bytes(types->data + sig->offset, types->data + start, length))
+				break;
+		}
+		if (table[slot].length)
+			types->length = start;
+		else
+			table[slot] = (Signature){hash, start, length, count++};
+		f->type_index = table[slot].index;
+	}
+	return count;
+}
+
+unsigned int gen_expr(unsigned char **output_code) {
+	buffer_reset(&Code);
+	error_codegen = false;
+
+	Symbol *main_sym = find_symbol("main", 4);
+	if (!main_sym || !main_sym->func) {
+		print("Could not find main function");
+		return 0;
+	}
 
-	return c - output_code;
+	static const unsigned char header[] = {0, 'a', 's', 'm', 1, 0, 0, 0};
+	emit_bytes(&Code, header, sizeof(header));
+
+	ByteBuffer types = {&SignatureArena};
+	buffer_reset(&types);
+	unsigned int type_count = encode_signatures(&types);
+	unsigned int section = begin_section(&Code, SECTION_TYPE);
+	emit_uleb(&Code, type_count);
+	emit_bytes(&Code, types.data, types.length);
+	end_section(&Code, section);
+
+	section = begin_section(&Code, SECTION_FUNC);
+	emit_uleb(&Code, FunctionCount);
+	for (Function *f = Functions; f; f = f->next)
+		emit_uleb(&Code, f->type_index);
+	end_section(&Code, section);
+
+	section = begin_section(&Code, SECTION_MEMORY);
+	emit_uleb(&Code, 1);
+	emit(0x0); // no maximum
+	emit_uleb(&Code, 1);
+	end_section(&Code, section);
+
+	// The shadow stack pointer, see emit_prologue
+	section = begin_section(&Code, SECTION_GLOBAL);
+	emit_uleb(&Code, 1);
+	emit(VAL_I32);
+	emit(1); // mutable
+	emit(OP_I32_CONST);
+	emit_sleb(&Code, STACK_BASE);
+	emit(OP_END);
+	end_section(&Code, section);
+
+	section = begin_section(&Code, SECTION_EXPORT);
+	emit_uleb(&Code, 1);
+	emit_uleb(&Code, 4);
+	emit_bytes(&Code, "main", 4);
+	emit(EXPORT_FUNC);
+	emit_uleb(&Code, main_sym->func->index);
+	end_section(&Code, section);
+
+	arena_reset(&RelocArena);
+	RelocCapacity = 0;
+	begin_cache_generation();
+	section = begin_section(&Code, SECTION_CODE);
+	emit_uleb(&Code, FunctionCount);
+	for (Function *f = Functions; f; f = f->next)
+		gen_function(f);
+	end_section(&Code, section);
+	end_cache_generation();
+
+	*output_code = Code.data;
+	return error_codegen ? 0 : Code.length;
 }
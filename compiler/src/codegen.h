@@ -1,6 +1,8 @@
 #pragma once
 #include "tokenize.h"
 #include "defines.h"
+#include "cache.h"
+#include "wasm_writer.h"
 
 typedef enum {
 	ND_ADD,
@@ -24,75 +26,178 @@ typedef enum {
 	ND_FOR,
 	ND_ADDR,
 	ND_DEREF,
-	ND_FUNCCALL
+	ND_FUNCCALL,
+	ND_FOR_CLAUSES,
+	ND_MOD,
+	ND_SHL,
+	ND_SHR,
+	ND_BITAND,
+	ND_BITOR,
+	ND_BITXOR,
+	ND_LOGAND,
+	ND_LOGOR,
+	ND_COND,
+	ND_SWITCH,
+	ND_CASE, // a section of a switch, from one label to the next
+	ND_BREAK, // out of the innermost switch
+	// Made by the vectorizer, see vectorize.c
+	ND_SPLAT, // an int in all four lanes
+	ND_LANE, // one lane of a v128, in val
+	ND_MAX, // lanewise
+	ND_MIN,
+	// Made by the arithmetic lowering, see optimize.c
+	ND_MULHI, // high 32 bits of the signed 64-bit product
 } NodeKind;
 
 typedef enum {
 	TYPE_INT = 1,
 	TYPE_PTR,
 	TYPE_FUNC,
+	TYPE_V128, // four ints, only made by the vectorizer
 } TypeKind;
 
 typedef struct Node Node;
+typedef struct NodeCold NodeCold;
 typedef struct Obj Obj;
 typedef struct Function Function;
 typedef struct Type Type;
 
+// Nodes live in one contiguous pool and refer to each other by index, 0 is
+// the null node. The pool may be reallocated while parsing, so only hold a
+// Node pointer across calls that cannot create nodes
+typedef unsigned int NodeId;
+
+// Hot node data, everything type checking and code generation touches
 struct Node {
-	NodeKind kind;
-	Node *next;
-	Node *lhs;
-	Node *rhs;
-	Node *body;
-	Token *tok;
+	u8 kind; // NodeKind
 	Type *type;
+	NodeId lhs; // ND_BLOCK: first statement, ND_IF/ND_FOR: condition, ND_FUNCCALL: first argument, ND_SWITCH: value, ND_CASE: its ND_BLOCK
+	NodeId rhs; // ND_IF/ND_COND: then, ND_FOR: body, ND_SWITCH: first ND_CASE, ND_CASE: the next one
+	NodeId next;
 
-	// complex statements
 	union {
-		struct _if { // ND_IF
-			Node *condition;
-			Node *then;
-			Node *els;
-		} _if;
-		struct _for { // ND_FOR
-			Node *init;
-			Node *condition;
-			Node *increment;
-			Node *then;
-		} _for;
-		struct _func { // ND_FUNCCALL
-			char *funcname;
-			Node *args;
-		} _func;
+		NodeId els; // ND_IF, ND_COND
+		NodeId clauses; // ND_FOR, an ND_FOR_CLAUSES node with init in lhs and increment in rhs
+		NodeId default_case; // ND_SWITCH, the ND_CASE starting at default:, 0 without one
+		Symbol *sym; // ND_FUNCCALL
 		Obj *var; // ND_VAR
-		int val; // ND_NUM
+		int val; // ND_NUM, ND_CASE
 	};
 };
 
+// Cold node data, only needed for diagnostics
+struct NodeCold {
+	Token *tok;
+};
+
+extern Node *Nodes;
+extern NodeCold *NodesCold;
+#define N(id) (Nodes + (id))
+
 struct Obj {
+	Obj *next; // previously declared local of the same function
+	Obj *shadowed; // outer local hidden by this one
+	Symbol *sym;
 	char *name;
-	int offset;
+	Type *type;
+	int offset; // from the base of the function's frame, only for escaping locals
+	unsigned int local_index; // WASM local, for everything else. Parameters are the first ones
+	int scope_depth;
+	bool escapes; // its address is taken, so it has to live in memory
+	bool is_param; // arrives in local_index, and is copied to its slot when it escapes
+	unsigned int loop_mark; // last loop seen assigning it, see optimize.c
 };
 
 struct Function {
-	Node *body;
+	Function *next;
+	unsigned int index;
+	NodeId body;
 	char *name;
-	Obj *locals;
+	Symbol *sym;
+	Obj *locals; // the parameters are the oldest ones
 	unsigned int local_count;
-	int stack_size;
+	unsigned int param_count;
+	unsigned int wasm_local_count; // i32 locals, parameters included
+	unsigned int vector_local_count; // v128 locals, numbered after the i32 ones
+	unsigned int type_index; // of its signature in the type section
+	int stack_size; // of its frame on the shadow stack, 0 when nothing escapes
+
+	u64 hash; // of the function's tokens, for the code cache
+	unsigned int token_count; // 0 when the function cannot be cached
+	CachedFunction *cached; // body reused from the last compile, not parsed
+
+	u8 inline_state; // see callgraph.c
+	NodeId inline_value; // the whole body when it is small enough to inline
+	bool reachable; // from main
 };
 
+// Every function in source order, index is the position in this list
+extern Function *Functions;
+extern unsigned int FunctionCount;
+
 struct Type {
 	TypeKind kind;
+	Type *pointer; // interned pointer to this type
 	union {
 		Type *base; // pointer
 		Type *return_type; // function type
-		Token *name; // declaration
 	};
 };
 
-unsigned int gen_expr(unsigned char *c);
+extern Type TypeV128;
+#define is_vector(id) (N(id)->type == &TypeV128)
+// Pointers are the only unsigned values: dividing and shifting them right
+// uses the unsigned instructions
+#define is_unsigned(id) (N(id)->type && N(id)->type->kind == TYPE_PTR)
+
+// Node constructors, also used by the passes that rewrite the tree
+NodeId new_node(NodeKind kind);
+NodeId new_unary(NodeKind kind, NodeId expr);
+NodeId new_binary(NodeKind kind, NodeId lhs, NodeId rhs);
+NodeId new_num(int val);
+NodeId new_variable(Obj *var);
+Obj *new_temp_lvar(Function *fn, Type *type);
+
+// Loops with conditions this large are not rotated, the second copy of the
+// condition would cost more than the extra branch per iteration
+#define LOOP_ROTATE_MAX_NODES 12
+
+// Counts the nodes of an expression, stopping at limit
+unsigned int count_nodes(NodeId id, unsigned int limit);
+
+// Shadow stack. Escaping locals live in a frame on a stack in linear memory
+// that grows up from STACK_BASE, global 0 points past the top frame. A
+// function with a frame keeps its base in frame_local; the prologue pushes
+// the frame and traps when it would not fit in memory, and the epilogue pops
+// it before every return
+#define STACK_BASE 16
+void emit_prologue(ByteBuffer *code, const Function *fn, unsigned int frame_local);
+void emit_epilogue(ByteBuffer *code, unsigned int frame_local);
+
+// Locals after the parameters are the i32 ones, the v128 ones and the frame
+// base, when there is a frame
+void emit_local_declarations(ByteBuffer *code, unsigned int i32_count, unsigned int v128_count, bool frame);
+
+// ND_MULHI, with both operands on the stack extended to i64 as they were
+// pushed: multiplies them and leaves the high 32 bits
+void emit_high_product(ByteBuffer *code);
+
+// The SimdOpCode of a lanewise operator on v128 operands
+u8 vector_opcode(NodeKind kind);
+// v128 loads and stores take a constant added to their address as the
+// memarg offset, the vectorizer's addresses are often pointer + constant.
+// Returns the rest of the address
+NodeId vector_address(NodeId address, int *offset);
+
+// Returns of a call, return f(x), become return_call, which reuses the
+// caller's native stack frame. Off for engines without the tail call
+// proposal. A function with a shadow stack frame keeps call and return, its
+// frame has to outlive the callee
+extern bool TailCalls;
+
+// Returns the module's length and points code at it, 0 on failure
+unsigned int gen_expr(unsigned char **code);
 Function *ParseTokens();
-void print_tree(Node *node);
+void print_tree(NodeId node);
 
-void add_type(Node *node);
+void add_type(NodeId node);
@@ -0,0 +1,935 @@
+#include "ir.h"
+#include "standard_functions.h"
+#include "arena.h"
+
+static Arena IrArena = {"ir"};
+
+static IrFunction *Ir;
+static IrBlockId Current;
+static IrRegion *Sequence; // the sequence new regions are appended to
+static IrRegion *SequenceTail;
+static bool Unsupported;
+
+// Arrays of the IR grow by copying, so only hold these pointers across calls
+// that cannot create instructions or blocks
+#define I(v) (Ir->insts + (v))
+#define B(b) (Ir->blocks + (b))
+
+// Doubles an array, the old copy stays in the arena until the next reset
+static void *grow_array(void *data, unsigned int *capacity, unsigned int size) {
+	unsigned int grown_capacity = *capacity ? *capacity * 2 : 8;
+	void *grown = arena_push(&IrArena, grown_capacity * size);
+	if (*capacity)
+		memcpy(grown, data, *capacity * size);
+	*capacity = grown_capacity;
+	return grown;
+}
+
+#define push_value(array, count, capacity, value) { \
+	if ((count) == (capacity)) \
+		(array) = grow_array((array), &(capacity), sizeof(*(array))); \
+	(array)[(count)++] = (value); \
+}
+
+static IrValue resolve(IrValue value) {
+	IrValue root = value;
+	while (I(root)->replaced_by)
+		root = I(root)->replaced_by;
+	while (I(value)->replaced_by) {
+		IrValue next = I(value)->replaced_by;
+		I(value)->replaced_by = root;
+		value = next;
+	}
+	return root;
+}
+
+static IrValue new_value(IrOp op, unsigned int operand_count) {
+	if (Ir->inst_count == Ir->inst_capacity)
+		Ir->insts = grow_array(Ir->insts, &Ir->inst_capacity, sizeof(IrInst));
+	IrValue value = Ir->inst_count++;
+	*I(value) = (IrInst){op};
+	I(value)->block = Current;
+	I(value)->operand_count = operand_count;
+	if (operand_count)
+		I(value)->operands = arena_push_array(&IrArena, IrValue, operand_count);
+	return value;
+}
+
+// Appends an instruction to the current block
+static IrValue new_inst(IrOp op, unsigned int operand_count) {
+	IrValue value = new_value(op, operand_count);
+	IrBlock *block = B(Current);
+	push_value(block->insts, block->inst_count, block->inst_capacity, value);
+	return value;
+}
+
+// Constants are emitted where they are used, they belong to no block
+static IrValue new_const(int val) {
+	IrValue value = new_value(IR_CONST, 0);
+	I(value)->imm = val;
+	return value;
+}
+
+// Locals start out as 0, in every lane for a v128 one
+static IrValue new_zero(bool vector) {
+	IrValue value = new_const(0);
+	I(value)->vector = vector;
+	return value;
+}
+
+static IrValue new_binary_inst(u8 opcode, IrValue lhs, IrValue rhs) {
+	IrValue value = new_inst(IR_BINARY, 2);
+	I(value)->opcode = opcode;
+	I(value)->operands[0] = lhs;
+	I(value)->operands[1] = rhs;
+	return value;
+}
+
+static IrValue new_phi(IrBlockId block) {
+	IrValue value = new_value(IR_PHI, 0);
+	I(value)->block = block;
+	push_value(B(block)->phis, B(block)->phi_count, B(block)->phi_capacity, value);
+	return value;
+}
+
+static IrBlockId new_block() {
+	if (Ir->block_count == Ir->block_capacity)
+		Ir->blocks = grow_array(Ir->blocks, &Ir->block_capacity, sizeof(IrBlock));
+	IrBlockId block = Ir->block_count++;
+	*B(block) = (IrBlock){};
+	if (Ir->var_count)
+		B(block)->defs = arena_push_array(&IrArena, IrValue, Ir->var_count);
+	return block;
+}
+
+// Code after a return is still built, in blocks nothing branches to
+static void add_edge(IrBlockId from, IrBlockId to) {
+	if (!B(from)->reachable) return;
+	push_value(B(to)->preds, B(to)->pred_count, B(to)->pred_capacity, from);
+	B(from)->succs[B(from)->succ_count++] = to;
+	B(to)->reachable = true;
+}
+
+static IrRegion *new_region(IrRegionKind kind) {
+	IrRegion *region = arena_push_struct(&IrArena, IrRegion);
+	region->kind = kind;
+	return region;
+}
+
+static void append_region(IrRegion *region) {
+	if (SequenceTail)
+		SequenceTail->next = region;
+	else
+		Sequence->first = region;
+	SequenceTail = region;
+}
+
+static void start_block(IrBlockId block) {
+	Current = block;
+	IrRegion *region = new_region(RG_BLOCK);
+	region->block = block;
+	append_region(region);
+}
+
+// Variables, following Braun et al. A block that may still get predecessors
+// answers reads with an incomplete phi, which gets its operands once the
+// block is sealed. A phi whose operands are all the same value, or itself,
+// is replaced by that value
+
+static IrValue read_variable(unsigned int var, IrBlockId block);
+
+// The tree numbers its v128 locals after the i32 ones
+static bool is_vector_var(unsigned int var) {
+	return var >= Ir->fn->wasm_local_count;
+}
+
+static IrValue try_remove_trivial_phi(IrValue phi) {
+	IrValue same = 0;
+	for (unsigned int i = 0; i < I(phi)->operand_count; ++i) {
+		IrValue operand = resolve(I(phi)->operands[i]);
+		if (operand == same || operand == phi) continue;
+		if (same) return phi;
+		same = operand;
+	}
+	// Unreachable, or only ever reads itself: locals start out as 0
+	if (!same)
+		same = new_zero(I(phi)->vector);
+	I(phi)->replaced_by = same;
+	return same;
+}
+
+static IrValue add_phi_operands(IrValue phi, unsigned int var) {
+	IrBlockId block = I(phi)->block;
+	unsigned int count = B(block)->pred_count;
+	IrValue *operands = arena_push_array(&IrArena, IrValue, count ? count : 1);
+	I(phi)->operands = operands;
+	for (unsigned int i = 0; i < count; ++i)
+		operands[i] = read_variable(var, B(block)->preds[i]);
+	I(phi)->operand_count = count;
+	return try_remove_trivial_phi(phi);
+}
+
+static IrValue read_variable(unsigned int var, IrBlockId block) {
+	IrValue value = B(block)->defs[var];
+	if (value) return resolve(value);
+
+	if (!B(block)->sealed) {
+		value = new_phi(block);
+		I(value)->imm = var;
+		I(value)->vector = is_vector_var(var);
+	} else if (B(block)->pred_count == 1) {
+		value = read_variable(var, B(block)->preds[0]);
+	} else if (B(block)->pred_count == 0) {
+		value = new_zero(is_vector_var(var));
+	} else {
+		value = new_phi(block);
+		I(value)->vector = is_vector_var(var);
+		// Set first, so a loop reading the variable back finds the phi
+		B(block)->defs[var] = value;
+		value = add_phi_operands(value, var);
+	}
+	B(block)->defs[var] = value;
+	return value;
+}
+
+static void write_variable(unsigned int var, IrBlockId block, IrValue value) {
+	B(block)->defs[var] = value;
+}
+
+static void seal_block(IrBlockId block) {
+	// Incomplete phis have no operands yet, filling them in can add more
+	for (unsigned int i = 0; i < B(block)->phi_count; ++i) {
+		IrValue phi = B(block)->phis[i];
+		if (!I(phi)->operands)
+			add_phi_operands(phi, I(phi)->imm);
+	}
+	B(block)->sealed = true;
+}
+
+// Building
+
+static IrValue lower(NodeId id, bool as_condition);
+
+static IrValue lower_value(NodeId id, bool as_condition) {
+	IrValue value = lower(id, as_condition);
+	if (!value) {
+		// A statement where the tree wants a value, like a = b = 1
+		Unsupported = true;
+		value = new_const(0);
+	}
+	return value;
+}
+
+static void set_branch(IrBlockId block, IrValue condition) {
+	B(block)->term = TERM_BRANCH;
+	B(block)->term_value = condition;
+}
+
+static bool is_boolean(NodeId id) {
+	NodeKind kind = N(id)->kind;
+	return (kind >= ND_EQ && kind <= ND_GE) || kind == ND_LOGAND || kind == ND_LOGOR;
+}
+
+// Branches on condition into then and els, which are lowered as values when
+// want_value says so: a missing arm is then the constant given for it,
+// as_condition is passed on to the arms and normalize turns a non-boolean
+// arm into 0 or 1. The value is a phi in the block after them
+static IrValue lower_if(IrValue condition, NodeId then, NodeId els, bool want_value, bool as_condition, bool normalize, int then_const, int els_const) {
+	IrBlockId head = Current;
+	set_branch(head, condition);
+	IrRegion *region = new_region(RG_IF);
+	region->block = head;
+	append_region(region);
+
+	IrBlockId ends[2];
+	IrValue values[2];
+	NodeId arms[2] = {then, els};
+	int consts[2] = {then_const, els_const};
+	IrRegion *sequences[2];
+	for (unsigned int i = 0; i < 2; ++i) {
+		IrBlockId block = new_block();
+		add_edge(head, block);
+		seal_block(block);
+
+		IrRegion *outer = Sequence, *outer_tail = SequenceTail;
+		sequences[i] = Sequence = new_region(RG_SEQUENCE);
+		SequenceTail = 0;
+		start_block(block);
+		if (!want_value) {
+			lower(arms[i], false);
+		} else if (!arms[i]) {
+			values[i] = new_const(consts[i]);
+		} else {
+			values[i] = lower_value(arms[i], as_condition);
+			if (normalize && !is_boolean(arms[i]))
+				values[i] = new_binary_inst(OP_I32_NE, values[i], new_const(0));
+		}
+		ends[i] = Current;
+		Sequence = outer;
+		SequenceTail = outer_tail;
+	}
+	region->then = sequences[0];
+	region->els = sequences[1];
+
+	IrBlockId join = new_block();
+	add_edge(ends[0], join);
+	add_edge(ends[1], join);
+	seal_block(join);
+	start_block(join);
+	if (!want_value) return 0;
+	unsigned int count = B(join)->pred_count;
+	if (!count) return new_const(0);
+
+	IrValue phi = new_phi(join);
+	IrValue *operands = arena_push_array(&IrArena, IrValue, count);
+	for (unsigned int i = 0; i < count; ++i)
+		operands[i] = B(join)->preds[i] == ends[0] ? values[0] : values[1];
+	I(phi)->operands = operands;
+	I(phi)->operand_count = count;
+	return try_remove_trivial_phi(phi);
+}
+
+// Both arms of a select are evaluated, so they have to be free
+static bool is_select_operand(NodeId id) {
+	NodeKind kind = N(id)->kind;
+	return kind == ND_NUM || (kind == ND_VAR && !N(id)->var->escapes);
+}
+
+static void lower_for(NodeId id) {
+	const Node *node = N(id);
+	const Node *clauses = N(node->clauses);
+	if (clauses->lhs)
+		lower(clauses->lhs, false);
+
+	if (node->lhs && count_nodes(node->lhs, LOOP_ROTATE_MAX_NODES) < LOOP_ROTATE_MAX_NODES) {
+		// Rotated: the guard branches around the loop, the latch back into it
+		IrValue condition = lower_value(node->lhs, true);
+		IrBlockId guard = Current;
+		set_branch(guard, condition);
+		IrRegion *region = new_region(RG_ROTATED_LOOP);
+		region->block = guard;
+		append_region(region);
+
+		IrBlockId body = new_block(), exit = new_block();
+		add_edge(guard, body);
+		add_edge(guard, exit);
+
+		IrRegion *outer = Sequence, *outer_tail = SequenceTail;
+		region->then = Sequence = new_region(RG_SEQUENCE);
+		SequenceTail = 0;
+		start_block(body);
+		lower(node->rhs, false);
+		lower(clauses->rhs, false);
+		condition = lower_value(node->lhs, true);
+		IrBlockId latch = Current;
+		Sequence = outer;
+		SequenceTail = outer_tail;
+
+		set_branch(latch, condition);
+		region->latch = latch;
+		add_edge(latch, body);
+		add_edge(latch, exit);
+		seal_block(body);
+		seal_block(exit);
+		start_block(exit);
+		return;
+	}
+
+	// The condition is only built once, in a header the latch jumps back to
+	IrBlockId pre = Current;
+	IrBlockId header = new_block();
+	add_edge(pre, header);
+	IrRegion *region = new_region(RG_LOOP);
+	append_region(region);
+
+	IrRegion *outer = Sequence, *outer_tail = SequenceTail;
+	region->header = Sequence = new_region(RG_SEQUENCE);
+	SequenceTail = 0;
+	start_block(header);
+	IrValue condition = node->lhs ? lower_value(node->lhs, true) : 0;
+	IrBlockId header_end = Current;
+	region->block = header_end;
+	if (condition)
+		set_branch(header_end, condition);
+
+	IrBlockId body = new_block();
+	add_edge(header_end, body);
+	seal_block(body);
+	IrBlockId exit = new_block();
+	if (condition)
+		add_edge(header_end, exit);
+
+	region->then = Sequence = new_region(RG_SEQUENCE);
+	SequenceTail = 0;
+	start_block(body);
+	lower(node->rhs, false);
+	lower(clauses->rhs, false);
+	region->latch = Current;
+	add_edge(Current, header);
+	seal_block(header);
+	Sequence = outer;
+	SequenceTail = outer_tail;
+
+	seal_block(exit);
+	start_block(exit);
+}
+
+// The signed instructions, see unsigned_opcode
+static const u8 BinaryOpcodes[] = {
+	[ND_ADD] = OP_I32_ADD,
+	[ND_SUB] = OP_I32_SUB,
+	[ND_MUL] = OP_I32_MUL,
+	[ND_DIV] = OP_I32_DIV_S,
+	[ND_MOD] = OP_I32_REM_S,
+	[ND_SHL] = OP_I32_SHL,
+	[ND_SHR] = OP_I32_SHR_S,
+	[ND_BITAND] = OP_I32_AND,
+	[ND_BITOR] = OP_I32_OR,
+	[ND_BITXOR] = OP_I32_XOR,
+	[ND_EQ] = OP_I32_EQ,
+	[ND_NE] = OP_I32_NE,
+	[ND_LT] = OP_I32_LT_S,
+	[ND_LE] = OP_I32_LE_S,
+	[ND_GT] = OP_I32_GT_S,
+	[ND_GE] = OP_I32_GE_S,
+	[ND_MULHI] = OP_I64_MUL, // the high half of the product, see emit_inst
+};
+
+// Dividing and shifting a pointer right use the unsigned instructions
+static u8 unsigned_opcode(u8 opcode) {
+	switch (opcode) {
+		case OP_I32_DIV_S: return OP_I32_DIV_U;
+		case OP_I32_REM_S: return OP_I32_REM_U;
+		case OP_I32_SHR_S: return OP_I32_SHR_U;
+	}
+	return opcode;
+}
+
+// Lanewise operators on v128 values, which only the vectorizer makes
+static IrValue lower_vector(NodeId id) {
+	const Node *node = N(id);
+	if (node->kind == ND_DEREF) {
+		int offset;
+		IrValue address = lower_value(vector_address(node->lhs, &offset), false);
+		IrValue load = new_inst(IR_LOAD, 1);
+		I(load)->operands[0] = address;
+		I(load)->imm = offset;
+		I(load)->vector = true;
+		return load;
+	}
+	IrValue lhs = lower_value(node->lhs, false);
+	IrValue rhs = node->rhs ? lower_value(node->rhs, false) : 0;
+	IrValue value = new_inst(IR_SIMD, rhs ? 2 : 1);
+	I(value)->opcode = vector_opcode(node->kind);
+	I(value)->operands[0] = lhs;
+	if (rhs)
+		I(value)->operands[1] = rhs;
+	I(value)->vector = true;
+	return value;
+}
+
+// Returns the value of an expression, 0 for statements. as_condition says
+// only zero or non-zero matters, so && and || skip normalizing to 0 or 1
+static IrValue lower(NodeId id, bool as_condition) {
+	if (!id) return 0;
+	const Node *node = N(id);
+	if (is_vector(id) && node->kind != ND_VAR && node->kind != ND_ASSIGN)
+		return lower_vector(id);
+	switch (node->kind) {
+		case ND_NUM:
+			return new_const(node->val);
+		case ND_VAR: {
+			const Obj *var = node->var;
+			if (!var->escapes)
+				return read_variable(var->local_index, Current);
+			IrValue load = new_inst(IR_LOAD, 1);
+			I(load)->operands[0] = Ir->frame;
+			I(load)->imm = var->offset;
+			return load;
+		}
+		case ND_ADDR:
+			return new_binary_inst(OP_I32_ADD, Ir->frame, new_const(N(node->lhs)->var->offset));
+		case ND_DEREF: {
+			IrValue address = lower_value(node->lhs, false);
+			IrValue load = new_inst(IR_LOAD, 1);
+			I(load)->operands[0] = address;
+			return load;
+		}
+		case ND_LANE: {
+			IrValue vector = lower_value(node->lhs, false);
+			IrValue lane = new_inst(IR_SIMD, 1);
+			I(lane)->opcode = SIMD_I32X4_EXTRACT_LANE;
+			I(lane)->operands[0] = vector;
+			I(lane)->imm = node->val;
+			return lane;
+		}
+		case ND_NEG: {
+			IrValue operand = lower_value(node->lhs, false);
+			return new_binary_inst(OP_I32_SUB, new_const(0), operand);
+		}
+		case ND_ASSIGN: {
+			const Node *lhs = N(node->lhs);
+			if (lhs->kind == ND_VAR && !lhs->var->escapes) {
+				unsigned int var = lhs->var->local_index;
+				IrValue value = lower_value(node->rhs, false);
+				write_variable(var, Current, value);
+				return 0;
+			}
+			int offset = lhs->kind == ND_VAR ? lhs->var->offset : 0;
+			IrValue address;
+			if (lhs->kind == ND_VAR)
+				address = Ir->frame;
+			else if (is_vector(id))
+				address = lower_value(vector_address(lhs->lhs, &offset), false);
+			else
+				address = lower_value(lhs->lhs, false);
+			IrValue value = lower_value(node->rhs, false);
+			IrValue store = new_inst(IR_STORE, 2);
+			I(store)->operands[0] = address;
+			I(store)->operands[1] = value;
+			I(store)->imm = offset;
+			I(store)->vector = is_vector(id);
+			return 0;
+		}
+		case ND_FUNCCALL: {
+			unsigned int count = 0;
+			for (NodeId arg = node->lhs; arg; arg = N(arg)->next)
+				count += 1;
+			IrValue *args = arena_push_array(&IrArena, IrValue, count ? count : 1);
+			count = 0;
+			for (NodeId arg = node->lhs; arg; arg = N(arg)->next)
+				args[count++] = lower_value(arg, false);
+			IrValue call = new_inst(IR_CALL, 0);
+			I(call)->operands = args;
+			I(call)->operand_count = count;
+			I(call)->imm = id;
+			return call;
+		}
+		case ND_RETURN: {
+			IrValue value = lower_value(node->lhs, false);
+			B(Current)->term = TERM_RETURN;
+			B(Current)->term_value = value;
+			IrBlockId block = new_block();
+			seal_block(block);
+			start_block(block);
+			return 0;
+		}
+		case ND_BLOCK: {
+			IrValue value = 0;
+			for (NodeId stmt = node->lhs; stmt; stmt = N(stmt)->next)
+				value = lower(stmt, false);
+			return value;
+		}
+		case ND_IF: {
+			IrValue condition = lower_value(node->lhs, true);
+			lower_if(condition, node->rhs, node->els, false, false, false, 0, 0);
+			return 0;
+		}
+		case ND_FOR:
+			lower_for(id);
+			return 0;
+		case ND_SWITCH:
+			// A br_table has no region yet, the tree generates the function
+			Unsupported = true;
+			return 0;
+		case ND_COND: {
+			IrValue condition = lower_value(node->lhs, true);
+			if (is_select_operand(node->rhs) && is_select_operand(node->els)) {
+				IrValue then = lower_value(node->rhs, false), els = lower_value(node->els, false);
+				IrValue select = new_inst(IR_SELECT, 3);
+				I(select)->operands[0] = then;
+				I(select)->operands[1] = els;
+				I(select)->operands[2] = condition;
+				return select;
+			}
+			return lower_if(condition, node->rhs, node->els, true, false, false, 0, 0);
+		}
+		case ND_LOGAND:
+		case ND_LOGOR: {
+			IrValue condition = lower_value(node->lhs, true);
+			// a && b is a ? b : 0, a || b is a ? 1 : b
+			if (node->kind == ND_LOGAND)
+				return lower_if(condition, node->rhs, 0, true, as_condition, !as_condition, 0, 0);
+			return lower_if(condition, 0, node->rhs, true, as_condition, !as_condition, 1, 0);
+		}
+	}
+
+	if (node->kind >= len(BinaryOpcodes) || !BinaryOpcodes[node->kind]) {
+		Unsupported = true;
+		return new_const(0);
+	}
+	u8 opcode = BinaryOpcodes[node->kind];
+	if (is_unsigned(node->lhs))
+		opcode = unsigned_opcode(opcode);
+	IrValue lhs = lower_value(node->lhs, false);
+	IrValue rhs = lower_value(node->rhs, false);
+	return new_binary_inst(opcode, lhs, rhs);
+}
+
+IrFunction *build_ir(Function *fn) {
+	arena_reset(&IrArena);
+	Ir = arena_push_struct(&IrArena, IrFunction);
+	Ir->fn = fn;
+	Ir->var_count = fn->wasm_local_count + fn->vector_local_count;
+	Unsupported = false;
+
+	// Value 0 is no value
+	Current = 0;
+	new_value(IR_CONST, 0);
+	// Like a constant, the frame base belongs to no block
+	if (fn->stack_size)
+		Ir->frame = new_value(IR_FRAME, 0);
+
+	Sequence = Ir->body = new_region(RG_SEQUENCE);
+	SequenceTail = 0;
+	IrBlockId entry = new_block();
+	B(entry)->reachable = true;
+	seal_block(entry);
+	start_block(entry);
+
+	// Parameters are defined on entry, the escaping ones are read from their
+	// slot once the prologue has copied them there
+	for (const Obj *var = fn->locals; var; var = var->next) {
+		if (!var->is_param || var->escapes) continue;
+		IrValue param = new_value(IR_PARAM, 0);
+		I(param)->imm = var->local_index;
+		write_variable(var->local_index, entry, param);
+	}
+
+	IrValue result = lower(fn->body, false);
+	if (!result)
+		result = new_const(0);
+	B(Current)->term = TERM_RETURN;
+	B(Current)->term_value = result;
+	Ir->exit = Current;
+	return Unsupported ? 0 : Ir;
+}
+
+// Optimization
+
+// Points every operand at the value that replaced it
+static void resolve_operands() {
+	for (IrValue v = 1; v < Ir->inst_count; ++v) {
+		IrInst *inst = I(v);
+		for (unsigned int i = 0; i < inst->operand_count; ++i)
+			inst->operands[i] = resolve(inst->operands[i]);
+	}
+	for (IrBlockId b = 0; b < Ir->block_count; ++b) {
+		if (B(b)->term_value)
+			B(b)->term_value = resolve(B(b)->term_value);
+	}
+}
+
+// Removing a phi can make the phis using it trivial
+static void remove_trivial_phis() {
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (IrValue v = 1; v < Ir->inst_count; ++v) {
+			if (I(v)->op != IR_PHI || I(v)->replaced_by) continue;
+			if (try_remove_trivial_phi(v) != v)
+				changed = true;
+		}
+	}
+	resolve_operands();
+}
+
+// Folds a binary instruction whose operands are constants, or that one
+// constant operand decides. Returns the value it is equal to, or 0
+static IrValue fold_binary(IrValue v) {
+	u8 opcode = I(v)->opcode;
+	IrValue lhs = I(v)->operands[0], rhs = I(v)->operands[1];
+	bool lhs_const = I(lhs)->op == IR_CONST, rhs_const = I(rhs)->op == IR_CONST;
+	int a = I(lhs)->imm, b = I(rhs)->imm;
+	if (lhs_const && rhs_const) {
+		unsigned int ua = a, ub = b;
+		switch (opcode) {
+			case OP_I32_ADD: return new_const(ua + ub);
+			case OP_I32_SUB: return new_const(ua - ub);
+			case OP_I32_MUL: return new_const(ua * ub);
+			case OP_I32_DIV_S: return b && !(a == (int)0x80000000 && b == -1) ? new_const(a / b) : 0;
+			case OP_I32_DIV_U: return b ? new_const(ua / ub) : 0;
+			case OP_I32_REM_S: return b && !(a == (int)0x80000000 && b == -1) ? new_const(a % b) : 0;
+			case OP_I32_REM_U: return b ? new_const(ua % ub) : 0;
+			case OP_I32_AND: return new_const(a & b);
+			case OP_I32_OR: return new_const(a | b);
+			case OP_I32_XOR: return new_const(a ^ b);
+			case OP_I32_SHL: return new_const(ua << (ub & 31));
+			case OP_I32_SHR_S: return new_const(a >> (b & 31));
+			case OP_I32_SHR_U: return new_const(ua >> (ub & 31));
+			case OP_I64_MUL: return new_const((long long)a * b >> 32);
+			case OP_I32_EQ: return new_const(a == b);
+			case OP_I32_NE: return new_const(a != b);
+			case OP_I32_LT_S: return new_const(a < b);
+			case OP_I32_LE_S: return new_const(a <= b);
+			case OP_I32_GT_S: return new_const(a > b);
+			case OP_I32_GE_S: return new_const(a >= b);
+		}
+		return 0;
+	}
+	if (rhs_const) {
+		switch (opcode) {
+			case OP_I32_ADD:
+			case OP_I32_SUB:
+			case OP_I32_OR:
+			case OP_I32_XOR:
+			case OP_I32_SHL:
+			case OP_I32_SHR_S:
+			case OP_I32_SHR_U:
+				return b ? 0 : lhs;
+			case OP_I32_MUL:
+				return b == 1 ? lhs : 0;
+		}
+	}
+	if (lhs_const) {
+		switch (opcode) {
+			case OP_I32_ADD:
+			case OP_I32_OR:
+			case OP_I32_XOR:
+				return a ? 0 : rhs;
+			case OP_I32_MUL:
+				return a == 1 ? rhs : 0;
+		}
+	}
+	return 0;
+}
+
+// Value numbering over the dominator tree, which the region tree gives for
+// free: a sequence's regions are dominated by the ones before them, and
+// everything nested in a region by what comes before the region. Each
+// sequence is a scope whose entries are taken out of the hash table again,
+// newest first, when it ends
+
+static IrValue *Table;
+static unsigned int TableMask;
+static unsigned int *Undo;
+static unsigned int UndoCount;
+
+static bool is_commutative(u8 opcode) {
+	switch (opcode) {
+		case OP_I32_ADD:
+		case OP_I32_MUL:
+		case OP_I32_AND:
+		case OP_I32_OR:
+		case OP_I32_XOR:
+		case OP_I32_EQ:
+		case OP_I32_NE:
+			return true;
+	}
+	return false;
+}
+
+// Constants are compared by value, every use of one gets a value of its own
+static unsigned int operand_key(IrValue v) {
+	return I(v)->op == IR_CONST ? (unsigned int)I(v)->imm * 0x9E3779B1u ^ 0x5BD1E995u : v;
+}
+
+static bool same_operand(IrValue v, IrValue w) {
+	return v == w || (I(v)->op == IR_CONST && I(w)->op == IR_CONST && I(v)->imm == I(w)->imm);
+}
+
+static unsigned int hash_value(IrValue v) {
+	const IrInst *inst = I(v);
+	unsigned int a = operand_key(inst->operands[0]), b = operand_key(inst->operands[1]);
+	if (is_commutative(inst->opcode) && a > b) {
+		unsigned int t = a; a = b; b = t;
+	}
+	return ((inst->opcode * 0x9E3779B1u) ^ a) * 0x85EBCA77u ^ b * 0xC2B2AE3Du;
+}
+
+static bool same_value(IrValue v, IrValue w) {
+	const IrInst *a = I(v), *b = I(w);
+	if (a->opcode != b->opcode) return false;
+	if (same_operand(a->operands[0], b->operands[0]) && same_operand(a->operands[1], b->operands[1])) return true;
+	return is_commutative(a->opcode) && same_operand(a->operands[0], b->operands[1]) && same_operand(a->operands[1], b->operands[0]);
+}
+
+// Returns the equal value already in the table, or adds v
+static IrValue number_value(IrValue v) {
+	unsigned int slot = hash_value(v) & TableMask;
+	while (Table[slot]) {
+		if (same_value(Table[slot], v))
+			return Table[slot];
+		slot = (slot + 1) & TableMask;
+	}
+	Table[slot] = v;
+	Undo[UndoCount++] = slot;
+	return v;
+}
+
+static void number_region(IrRegion *region);
+
+static void number_children(IrRegion *sequence) {
+	for (IrRegion *child = sequence->first; child; child = child->next)
+		number_region(child);
+}
+
+static void close_scope(unsigned int mark) {
+	while (UndoCount > mark)
+		Table[Undo[--UndoCount]] = 0;
+}
+
+static void number_block(IrBlockId block) {
+	for (unsigned int i = 0; i < B(block)->inst_count; ++i) {
+		IrValue v = B(block)->insts[i];
+		for (unsigned int j = 0; j < I(v)->operand_count; ++j)
+			I(v)->operands[j] = resolve(I(v)->operands[j]);
+
+		IrValue same = 0;
+		if (I(v)->op == IR_SELECT) {
+			// A constant condition picks one side
+			IrValue condition = I(v)->operands[2];
+			if (I(condition)->op == IR_CONST)
+				same = I(v)->operands[I(condition)->imm ? 0 : 1];
+		} else if (I(v)->op == IR_BINARY) {
+			same = fold_binary(v);
+			if (!same)
+				same = number_value(v);
+		}
+		if (same && same != v)
+			I(v)->replaced_by = same;
+	}
+}
+
+static void number_region(IrRegion *region) {
+	unsigned int mark = UndoCount;
+	switch (region->kind) {
+		case RG_SEQUENCE:
+			number_children(region);
+			close_scope(mark);
+			break;
+		case RG_BLOCK:
+			number_block(region->block);
+			break;
+		case RG_IF:
+			number_region(region->then);
+			number_region(region->els);
+			break;
+		case RG_LOOP:
+			// The header dominates the body
+			number_children(region->header);
+			number_region(region->then);
+			close_scope(mark);
+			break;
+		case RG_ROTATED_LOOP:
+			number_region(region->then);
+			break;
+	}
+}
+
+static void number_values() {
+	unsigned int capacity = 16;
+	while (capacity < Ir->inst_count * 2)
+		capacity *= 2;
+	Table = arena_push_array(&IrArena, IrValue, capacity);
+	TableMask = capacity - 1;
+	Undo = arena_push_array(&IrArena, unsigned int, Ir->inst_count);
+	UndoCount = 0;
+	number_region(Ir->body);
+	resolve_operands();
+}
+
+// Blocks nothing branches to any more are emptied, and phis lose the
+// operands of the predecessors that are gone
+static void remove_unreachable_blocks() {
+	IrBlockId *work = arena_push_array(&IrArena, IrBlockId, Ir->block_count);
+	unsigned int count = 0;
+	for (IrBlockId b = 0; b < Ir->block_count; ++b)
+		B(b)->reachable = false;
+	B(0)->reachable = true;
+	work[count++] = 0;
+	while (count) {
+		const IrBlock *block = B(work[--count]);
+		for (unsigned int s = 0; s < block->succ_count; ++s) {
+			IrBlock *succ = B(block->succs[s]);
+			if (succ->reachable) continue;
+			succ->reachable = true;
+			work[count++] = block->succs[s];
+		}
+	}
+
+	for (IrBlockId b = 0; b < Ir->block_count; ++b) {
+		IrBlock *block = B(b);
+		if (!block->reachable) {
+			block->inst_count = block->phi_count = block->pred_count = block->succ_count = 0;
+			block->term_value = 0;
+			continue;
+		}
+		unsigned int kept = 0;
+		for (unsigned int i = 0; i < block->pred_count; ++i) {
+			const IrBlock *pred = B(block->preds[i]);
+			bool edge = false;
+			for (unsigned int s = 0; s < pred->succ_count; ++s)
+				edge |= pred->succs[s] == b;
+			if (!pred->reachable || !edge) continue;
+			for (unsigned int j = 0; j < block->phi_count; ++j)
+				I(block->phis[j])->operands[kept] = I(block->phis[j])->operands[i];
+			block->preds[kept++] = block->preds[i];
+		}
+		block->pred_count = kept;
+		for (unsigned int j = 0; j < block->phi_count; ++j)
+			I(block->phis[j])->operand_count = kept;
+	}
+}
+
+// A branch on a constant only ever takes one edge, the other one is removed
+// along with what only it reached. Returns whether any branch was folded
+static bool fold_branches() {
+	bool folded = false;
+	for (IrBlockId b = 0; b < Ir->block_count; ++b) {
+		IrBlock *block = B(b);
+		if (block->term != TERM_BRANCH || block->succ_count != 2 || I(block->term_value)->op != IR_CONST) continue;
+		block->succs[0] = block->succs[I(block->term_value)->imm ? 0 : 1];
+		block->succ_count = 1;
+		folded = true;
+	}
+	if (folded)
+		remove_unreachable_blocks();
+	return folded;
+}
+
+// Marks what stores, calls and terminators need, the rest is dead
+static void eliminate_dead_code() {
+	IrValue *work = arena_push_array(&IrArena, IrValue, Ir->inst_count);
+	unsigned int count = 0;
+	for (IrBlockId b = 0; b < Ir->block_count; ++b) {
+		const IrBlock *block = B(b);
+		for (unsigned int i = 0; i < block->inst_count; ++i) {
+			IrValue v = block->insts[i];
+			if (I(v)->replaced_by || (I(v)->op != IR_STORE && I(v)->op != IR_CALL)) continue;
+			I(v)->live = true;
+			work[count++] = v;
+		}
+		IrValue v = block->term_value;
+		if (v && !I(v)->live) {
+			I(v)->live = true;
+			work[count++] = v;
+		}
+	}
+	while (count) {
+		const IrInst *inst = I(work[--count]);
+		for (unsigned int i = 0; i < inst->operand_count; ++i) {
+			IrValue operand = inst->operands[i];
+			if (I(operand)->live) continue;
+			I(operand)->live = true;
+			work[count++] = operand;
+		}
+	}
+}
+
+void optimize_ir(IrFunction *ir) {
+	Ir = ir;
+	// Code after a return was built in blocks nothing reaches
+	remove_unreachable_blocks();
+	remove_trivial_phis();
+	number_values();
+	// Removing an edge can leave a phi one operand, which can make another
+	// condition constant
+	while (fold_branches()) {
+		remove_trivial_phis();
+		number_values();
+	}
+	// Phis whose operands turned out equal
+	remove_trivial_phis();
+	eliminate_dead_code();
+}
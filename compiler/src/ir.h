@@ -0,0 +1,134 @@
+#pragma once
+#include "codegen.h"
+#include "wasm_writer.h"
+
+// SSA form of one function, between the tree and the WASM it becomes.
+//
+// Instructions are numbered values in one array, basic blocks list the
+// instructions they run in order. WASM locals become SSA values when the IR
+// is built (the on-the-fly construction of Braun et al., "Simple and
+// Efficient Construction of Static Single Assignment Form"), escaping
+// locals stay loads and stores in the function's frame. Every instruction,
+// block and array of the IR lives in one arena that is reset per function.
+//
+// Control flow only comes from the tree's if, for, ?:, && and || (a
+// function with a switch is generated from the tree), so next
+// to the CFG the IR keeps the region tree the blocks were built from, and
+// the emitter writes structured WASM from it without having to recover the
+// structure from the graph.
+
+typedef unsigned int IrValue; // index into IrFunction.insts, 0 is no value
+typedef unsigned int IrBlockId; // index into IrFunction.blocks
+
+typedef enum {
+	IR_CONST, // imm, in every lane of a vector constant
+	IR_FRAME, // base address of the function's frame on the shadow stack
+	IR_PARAM, // imm: parameter index, which is also its WASM local
+	IR_PHI, // one operand per predecessor, in the block's predecessor order
+	IR_BINARY, // opcode applied to two operands
+	IR_SELECT, // operands: value if true, value if false, condition
+	IR_LOAD, // operand: address, imm: memarg offset
+	IR_STORE, // operands: address, value, imm: memarg offset
+	IR_CALL, // operands: arguments, imm: the ND_FUNCCALL node
+	IR_SIMD, // opcode: the SimdOpCode applied to the operands, imm: lane for extract_lane
+} IrOp;
+
+typedef enum {
+	TERM_NONE, // falls through to its only successor, if any
+	TERM_BRANCH, // to succs[0] when value is non-zero, else to succs[1]
+	TERM_RETURN,
+} IrTerminator;
+
+typedef struct IrInst IrInst;
+typedef struct IrBlock IrBlock;
+typedef struct IrRegion IrRegion;
+typedef struct IrFunction IrFunction;
+
+struct IrInst {
+	u8 op; // IrOp
+	u8 opcode; // IR_BINARY: the WASM instruction, IR_SIMD: the one after the prefix
+	bool vector; // a v128 value, or for IR_STORE one being stored
+	bool live;
+	bool inlined; // emitted where its only user is, instead of in a local
+	IrBlockId block;
+	int imm;
+	IrValue *operands;
+	unsigned int operand_count;
+	IrValue replaced_by; // set when value numbering or phi removal made it redundant
+	unsigned int use_count;
+	unsigned int position; // in emission order
+	unsigned int user_position; // of the only user, when use_count is 1
+	bool user_in_block; // the only user is in the same block: an instruction, its terminator or its copies
+	bool user_on_edge; // the only user is a copy made on one edge out of its block, see ir_emit.c
+	bool impure; // has, or inlines something with, effects that fix its place
+	unsigned int local; // WASM local, for values that are not inlined
+};
+
+struct IrBlock {
+	IrValue *insts;
+	unsigned int inst_count;
+	unsigned int inst_capacity;
+	IrBlockId *preds;
+	unsigned int pred_count;
+	unsigned int pred_capacity;
+	IrBlockId succs[2];
+	unsigned int succ_count;
+	IrValue *phis;
+	unsigned int phi_count;
+	unsigned int phi_capacity;
+	IrValue *defs; // current value of each WASM local at the end of the block so far
+	bool sealed; // every predecessor is known
+	bool reachable;
+
+	u8 term; // IrTerminator
+	IrValue term_value;
+	unsigned int end_position; // of the terminator, after the instructions
+};
+
+typedef enum {
+	RG_SEQUENCE, // children run in order
+	RG_BLOCK,
+	RG_IF, // then/els after the terminator of block
+	RG_LOOP, // header runs first and leaves through block's terminator, then body, then back
+	RG_ROTATED_LOOP, // guarded by block's terminator, body ends with latch's terminator
+} IrRegionKind;
+
+struct IrRegion {
+	u8 kind; // IrRegionKind
+	IrRegion *next; // in the enclosing sequence
+	IrRegion *first; // RG_SEQUENCE
+	IrBlockId block; // RG_BLOCK, or the block whose terminator the construct branches on
+	IrBlockId latch; // RG_LOOP/RG_ROTATED_LOOP: the block that jumps back
+	IrRegion *header; // RG_LOOP
+	IrRegion *then; // RG_IF, RG_LOOP/RG_ROTATED_LOOP: the body
+	IrRegion *els; // RG_IF
+};
+
+struct IrFunction {
+	Function *fn;
+	IrInst *insts;
+	unsigned int inst_count;
+	unsigned int inst_capacity;
+	IrBlock *blocks;
+	unsigned int block_count;
+	unsigned int block_capacity;
+	IrRegion *body;
+	IrBlockId exit; // the block that ends with the function's result
+	IrValue frame; // the IR_FRAME, when the function has escaping locals
+	unsigned int var_count; // WASM locals of the tree, the v128 ones last
+	unsigned int local_count; // i32 WASM locals after emission, without parameters and frame base
+	unsigned int vector_local_count; // v128 WASM locals after emission
+};
+
+// Returns 0 when the function uses something the IR cannot express yet, the
+// caller then generates it from the tree
+IrFunction *build_ir(Function *fn);
+
+// Value numbering, phi removal and dead code elimination
+void optimize_ir(IrFunction *ir);
+
+// Writes the local declarations and the code of the body, up to but not
+// including its OP_END, and returns where the code starts. Every call is
+// reported to add_call with the offset of its padded index in code, which it
+// has to patch
+unsigned int emit_ir(IrFunction *ir, ByteBuffer *code, void (*add_call)(unsigned int offset, NodeId call));
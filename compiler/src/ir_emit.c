@@ -0,0 +1,745 @@
+#include "ir.h"
+#include "standard_functions.h"
+#include "arena.h"
+
+// Structured WASM from the region tree. Values live on the operand stack
+// where possible: one used once, by an instruction or terminator later in
+// the same block, is emitted right where it is used, as long as that does
+// not move it across anything its effects have to stay ordered with.
+// Everything else, phis included, gets a local of its own. A phi's local is
+// set by copies at the end of each predecessor. A rotated loop's latch makes
+// the copies for each of its successors on that edge only, the exit can
+// still read the phis of the last iteration.
+
+static Arena IrEmitArena = {"ir emit"};
+
+static IrFunction *Ir;
+static ByteBuffer *Out;
+static void (*AddCall)(unsigned int offset, NodeId call);
+static unsigned int Position;
+static unsigned int Nesting; // of blocks, loops and ifs around what is being emitted
+static unsigned int ReturnEnd; // offset after the last return outside of any of them
+static unsigned int TailCallEnd; // same for the last return_call
+static unsigned int FrameLocal; // holds the frame base, when the function has a frame
+static bool *EdgeCopies; // per block, set for the latches whose copies are made on each edge
+
+#define I(v) (Ir->insts + (v))
+#define B(b) (Ir->blocks + (b))
+
+// Instructions that may trap or touch memory, the order between them is kept
+static bool has_effects(const IrInst *inst) {
+	switch (inst->op) {
+		case IR_LOAD:
+		case IR_STORE:
+		case IR_CALL:
+			return true;
+		case IR_BINARY:
+			return inst->opcode == OP_I32_DIV_S || inst->opcode == OP_I32_DIV_U
+				|| inst->opcode == OP_I32_REM_S || inst->opcode == OP_I32_REM_U;
+	}
+	return false;
+}
+
+// Constants, the frame base and parameters are emitted at each use and
+// need no local of their own
+static bool is_leaf(const IrInst *inst) {
+	return inst->op == IR_CONST || inst->op == IR_FRAME || inst->op == IR_PARAM;
+}
+
+static bool is_emitted(const IrInst *inst) {
+	return inst->live && !inst->replaced_by && !is_leaf(inst) && inst->op != IR_PHI;
+}
+
+static void number_region(IrRegion *region) {
+	for (; region; region = region->next) {
+		switch (region->kind) {
+			case RG_SEQUENCE:
+				number_region(region->first);
+				break;
+			case RG_BLOCK: {
+				IrBlock *block = B(region->block);
+				for (unsigned int i = 0; i < block->inst_count; ++i) {
+					if (is_emitted(I(block->insts[i])))
+						I(block->insts[i])->position = ++Position;
+				}
+				block->end_position = ++Position;
+			} break;
+			case RG_IF:
+				number_region(region->then);
+				number_region(region->els);
+				break;
+			case RG_LOOP:
+				number_region(region->header);
+				number_region(region->then);
+				break;
+			case RG_ROTATED_LOOP:
+				number_region(region->then);
+				EdgeCopies[region->latch] = B(region->latch)->succ_count == 2;
+				break;
+		}
+	}
+}
+
+static void add_use(IrValue v, unsigned int position, IrBlockId block, bool on_edge) {
+	IrInst *inst = I(v);
+	if (is_leaf(inst)) return;
+	inst->use_count += 1;
+	inst->user_position = position;
+	inst->user_in_block = inst->op != IR_PHI && inst->block == block;
+	inst->user_on_edge = on_edge;
+}
+
+static void count_uses() {
+	for (IrValue v = 1; v < Ir->inst_count; ++v) {
+		const IrInst *inst = I(v);
+		if (!inst->live || inst->replaced_by) continue;
+		if (inst->op != IR_PHI) {
+			for (unsigned int i = 0; i < inst->operand_count; ++i)
+				add_use(inst->operands[i], inst->position, inst->block, false);
+			continue;
+		}
+		// Phi operands are read by the copies at the end of each predecessor
+		const IrBlock *block = B(inst->block);
+		for (unsigned int i = 0; i < inst->operand_count; ++i) {
+			if (inst->operands[i] != v)
+				add_use(inst->operands[i], B(block->preds[i])->end_position, block->preds[i], EdgeCopies[block->preds[i]]);
+		}
+	}
+	for (IrBlockId b = 0; b < Ir->block_count; ++b) {
+		if (B(b)->term_value)
+			add_use(B(b)->term_value, B(b)->end_position, b, false);
+	}
+}
+
+// Inlining moves a value to its user, past everything between them. That
+// is fine unless both it, or what it inlines, and something in between
+// have effects. A copy made on one edge would skip the effects on the other
+static void choose_inlined() {
+	unsigned int *effects_before = arena_push_array(&IrEmitArena, unsigned int, Position + 2);
+	IrValue *at = arena_push_array(&IrEmitArena, IrValue, Position + 1);
+	for (IrValue v = 1; v < Ir->inst_count; ++v) {
+		if (is_emitted(I(v)))
+			at[I(v)->position] = v;
+	}
+	for (unsigned int p = 1; p <= Position; ++p)
+		effects_before[p + 1] = effects_before[p] + (at[p] && has_effects(I(at[p])));
+
+	for (unsigned int p = 1; p <= Position; ++p) {
+		if (!at[p]) continue;
+		IrInst *inst = I(at[p]);
+		inst->impure = has_effects(inst);
+		for (unsigned int i = 0; i < inst->operand_count; ++i) {
+			const IrInst *operand = I(inst->operands[i]);
+			if (operand->inlined && operand->impure)
+				inst->impure = true;
+		}
+		if (inst->use_count != 1 || !inst->user_in_block) continue;
+		inst->inlined = !inst->impure || (!inst->user_on_edge && effects_before[inst->user_position] == effects_before[p + 1]);
+	}
+}
+
+// Locals. Every value that is not inlined needs one, a phi's is set by the
+// copies at the end of each predecessor. Values that are never live at the
+// same time share a local, and a phi goes in the same local as its operands
+// where it can, which turns their copies into nothing. Liveness is solved
+// per block by iterating to a fixpoint, then each block is walked backwards
+// from what is live at its end to find the values that overlap.
+
+// Above this many values the interference matrix gets too large, every value
+// keeps a local of its own
+#define IR_COALESCE_MAX_VALUES 2048
+
+typedef struct IrCopy IrCopy;
+struct IrCopy {
+	IrValue phi;
+	IrValue source;
+};
+
+static IrCopy **Copies; // per block, for its successors' phis, the first successor's first
+static unsigned int *CopyCounts;
+static unsigned int *BackCopyCounts; // per latch with EdgeCopies, how many are for the loop
+static IrValue *Values; // that need a local, inst->local indexes this while allocating
+static unsigned int ValueCount;
+static unsigned int Words; // of a set of values
+static unsigned int *LiveIn; // per block
+static unsigned int *EdgeLive; // after the copies of a latch's second edge
+static unsigned int *Interference; // a row of Words per value
+static unsigned int *Parent; // value a phi was merged with
+
+#define SET(set, i) ((set)[(i) / 32] |= 1u << (i) % 32)
+#define CLEAR(set, i) ((set)[(i) / 32] &= ~(1u << (i) % 32))
+#define HAS(set, i) ((set)[(i) / 32] >> (i) % 32 & 1)
+
+static bool needs_local(const IrInst *inst) {
+	return is_emitted(inst) ? !inst->inlined && inst->use_count : inst->op == IR_PHI && inst->live && !inst->replaced_by;
+}
+
+static void collect_copies() {
+	Copies = arena_push_array(&IrEmitArena, IrCopy *, Ir->block_count);
+	CopyCounts = arena_push_array(&IrEmitArena, unsigned int, Ir->block_count);
+	BackCopyCounts = arena_push_array(&IrEmitArena, unsigned int, Ir->block_count);
+	for (IrBlockId b = 0; b < Ir->block_count; ++b) {
+		const IrBlock *block = B(b);
+		unsigned int count = 0;
+		for (unsigned int s = 0; s < block->succ_count; ++s)
+			count += B(block->succs[s])->phi_count;
+		if (!count) continue;
+		Copies[b] = arena_push_array(&IrEmitArena, IrCopy, count);
+		for (unsigned int s = 0; s < block->succ_count; ++s) {
+			const IrBlock *succ = B(block->succs[s]);
+			unsigned int pred = 0;
+			while (succ->preds[pred] != b)
+				++pred;
+			for (unsigned int i = 0; i < succ->phi_count; ++i) {
+				IrValue phi = succ->phis[i];
+				if (!needs_local(I(phi)) || I(phi)->operands[pred] == phi) continue;
+				Copies[b][CopyCounts[b]++] = (IrCopy){phi, I(phi)->operands[pred]};
+			}
+			if (s == 0)
+				BackCopyCounts[b] = CopyCounts[b];
+		}
+	}
+}
+
+static void add_reads(IrValue v, unsigned int *live) {
+	const IrInst *inst = I(v);
+	if (is_leaf(inst)) return;
+	if (!inst->inlined) {
+		SET(live, inst->local);
+		return;
+	}
+	for (unsigned int i = 0; i < inst->operand_count; ++i)
+		add_reads(inst->operands[i], live);
+}
+
+static void interfere(unsigned int a, unsigned int b) {
+	SET(Interference + a * Words, b);
+	SET(Interference + b * Words, a);
+}
+
+static bool same_source(IrValue a, IrValue b) {
+	return a == b || (I(a)->op == IR_CONST && I(b)->op == IR_CONST && I(a)->imm == I(b)->imm);
+}
+
+// A phi set by a copy does not overlap with the value it is copied from, or
+// with another phi given the same value by the same copies
+static bool holds_copy_of(const IrCopy *copies, unsigned int count, unsigned int i, unsigned int value) {
+	bool source_redefined = false;
+	for (unsigned int j = 0; j < count; ++j) {
+		if (j != i && I(copies[j].phi)->local == value && same_source(copies[j].source, copies[i].source))
+			return true;
+		if (copies[j].phi == copies[i].source)
+			source_redefined = true;
+	}
+	const IrInst *source = I(copies[i].source);
+	return !source_redefined && !is_leaf(source) && !source->inlined && source->local == value;
+}
+
+// Walks a set of copies made at once backwards from live, the values live
+// after them. With build set, records every phi set while another value is
+// live
+static void scan_copies(const IrCopy *copies, unsigned int count, unsigned int *live, bool build) {
+	for (unsigned int i = 0; i < count && build; ++i) {
+		unsigned int phi = I(copies[i].phi)->local;
+		for (unsigned int w = 0; w < Words; ++w) {
+			for (unsigned int bits = live[w]; bits; bits &= bits - 1) {
+				unsigned int value = w * 32 + __builtin_ctz(bits);
+				if (value != phi && !holds_copy_of(copies, count, i, value))
+					interfere(phi, value);
+			}
+		}
+		// All of them are set at once, whether live afterwards or not
+		for (unsigned int j = 0; j < i; ++j) {
+			if (!same_source(copies[i].source, copies[j].source))
+				interfere(phi, I(copies[j].phi)->local);
+		}
+	}
+	for (unsigned int i = 0; i < count; ++i)
+		CLEAR(live, I(copies[i].phi)->local);
+	for (unsigned int i = 0; i < count; ++i)
+		add_reads(copies[i].source, live);
+}
+
+static void live_in(IrBlockId succ, unsigned int *live) {
+	memcpy(live, LiveIn + succ * Words, Words * sizeof(unsigned int));
+}
+
+// Walks the block backwards from the values live at its end, and leaves the
+// values live at its start in live. With build set, records every value
+// defined while another one is live
+static void scan_block(IrBlockId b, unsigned int *live, bool build) {
+	const IrBlock *block = B(b);
+	const IrCopy *copies = Copies[b];
+	unsigned int count = CopyCounts[b];
+	if (EdgeCopies[b]) {
+		// Each edge makes its own copies, before the branch either can follow
+		unsigned int back = BackCopyCounts[b];
+		live_in(block->succs[0], live);
+		scan_copies(copies, back, live, build);
+		live_in(block->succs[1], EdgeLive);
+		scan_copies(copies + back, count - back, EdgeLive, build);
+		for (unsigned int w = 0; w < Words; ++w)
+			live[w] |= EdgeLive[w];
+	} else {
+		memset(live, 0, Words * sizeof(unsigned int));
+		for (unsigned int s = 0; s < block->succ_count; ++s) {
+			const unsigned int *in = LiveIn + block->succs[s] * Words;
+			for (unsigned int w = 0; w < Words; ++w)
+				live[w] |= in[w];
+		}
+		scan_copies(copies, count, live, build);
+	}
+
+	if (block->term_value)
+		add_reads(block->term_value, live);
+	for (unsigned int i = block->inst_count; i-- > 0;) {
+		const IrInst *inst = I(block->insts[i]);
+		if (!is_emitted(inst) || inst->inlined) continue;
+		if (inst->use_count) {
+			for (unsigned int w = 0; w < Words && build; ++w) {
+				for (unsigned int bits = live[w]; bits; bits &= bits - 1) {
+					unsigned int value = w * 32 + __builtin_ctz(bits);
+					if (value != inst->local)
+						interfere(inst->local, value);
+				}
+			}
+			CLEAR(live, inst->local);
+		}
+		for (unsigned int j = 0; j < inst->operand_count; ++j)
+			add_reads(inst->operands[j], live);
+	}
+}
+
+static void build_interference() {
+	LiveIn = arena_push_array(&IrEmitArena, unsigned int, Ir->block_count * Words);
+	unsigned int *live = arena_push_array(&IrEmitArena, unsigned int, Words);
+	EdgeLive = arena_push_array(&IrEmitArena, unsigned int, Words);
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (IrBlockId b = Ir->block_count; b-- > 0;) {
+			scan_block(b, live, false);
+			unsigned int *in = LiveIn + b * Words;
+			for (unsigned int w = 0; w < Words; ++w) {
+				changed |= in[w] != live[w];
+				in[w] = live[w];
+			}
+		}
+	}
+
+	Interference = arena_push_array(&IrEmitArena, unsigned int, ValueCount * Words);
+	for (IrBlockId b = 0; b < Ir->block_count; ++b) {
+		scan_block(b, live, true);
+	}
+}
+
+static unsigned int find(unsigned int value) {
+	while (Parent[value] != value)
+		value = Parent[value] = Parent[Parent[value]];
+	return value;
+}
+
+// Puts a phi and the value copied into it in one local, unless they overlap.
+// A merged group's row holds what any of its values overlaps with
+static void coalesce(unsigned int a, unsigned int b) {
+	a = find(a);
+	b = find(b);
+	if (a == b || HAS(Interference + a * Words, b)) return;
+	Parent[b] = a;
+	unsigned int *row_a = Interference + a * Words;
+	const unsigned int *row_b = Interference + b * Words;
+	for (unsigned int w = 0; w < Words; ++w) {
+		row_a[w] |= row_b[w];
+		for (unsigned int bits = row_b[w]; bits; bits &= bits - 1)
+			SET(Interference + (w * 32 + __builtin_ctz(bits)) * Words, a);
+	}
+}
+
+static void allocate_locals() {
+	ValueCount = 0;
+	for (IrValue v = 1; v < Ir->inst_count; ++v) {
+		if (needs_local(I(v)))
+			ValueCount += 1;
+	}
+	Values = arena_push_array(&IrEmitArena, IrValue, ValueCount);
+	ValueCount = 0;
+	for (IrValue v = 1; v < Ir->inst_count; ++v) {
+		if (!needs_local(I(v))) continue;
+		I(v)->local = ValueCount;
+		Values[ValueCount++] = v;
+	}
+	collect_copies();
+
+	if (ValueCount > IR_COALESCE_MAX_VALUES) {
+		Ir->local_count = Ir->vector_local_count = 0;
+		for (unsigned int i = 0; i < ValueCount; ++i) {
+			IrInst *inst = I(Values[i]);
+			inst->local = inst->vector ? Ir->vector_local_count++ : Ir->local_count++;
+		}
+		return;
+	}
+
+	Words = (ValueCount + 31) / 32;
+	build_interference();
+	Parent = arena_push_array(&IrEmitArena, unsigned int, ValueCount);
+	for (unsigned int i = 0; i < ValueCount; ++i)
+		Parent[i] = i;
+	for (IrBlockId b = 0; b < Ir->block_count; ++b) {
+		for (unsigned int i = 0; i < CopyCounts[b]; ++i) {
+			const IrInst *source = I(Copies[b][i].source);
+			if (!is_leaf(source) && !source->inlined)
+				coalesce(I(Copies[b][i].phi)->local, source->local);
+		}
+	}
+
+	// Each group takes the lowest local of its type none of the groups it
+	// overlaps with has. i32 and v128 locals are numbered separately
+	unsigned int *locals = arena_push_array(&IrEmitArena, unsigned int, ValueCount);
+	unsigned int *taken = arena_push_array(&IrEmitArena, unsigned int, ValueCount + 1);
+	Ir->local_count = Ir->vector_local_count = 0;
+	for (unsigned int i = 0; i < ValueCount; ++i) {
+		if (find(i) != i) continue;
+		bool vector = I(Values[i])->vector;
+		const unsigned int *row = Interference + i * Words;
+		for (unsigned int w = 0; w < Words; ++w) {
+			for (unsigned int bits = row[w]; bits; bits &= bits - 1) {
+				unsigned int other = w * 32 + __builtin_ctz(bits);
+				if (other < i && Parent[other] == other && I(Values[other])->vector == vector)
+					taken[locals[other]] = i + 1;
+			}
+		}
+		unsigned int local = 0;
+		while (taken[local] == i + 1)
+			++local;
+		locals[i] = local;
+		unsigned int *count = vector ? &Ir->vector_local_count : &Ir->local_count;
+		if (local == *count)
+			*count += 1;
+	}
+	for (unsigned int i = 0; i < ValueCount; ++i)
+		I(Values[i])->local = locals[find(i)];
+}
+
+static void emit_inst(IrValue v);
+
+static void emit_value(IrValue v) {
+	const IrInst *inst = I(v);
+	if (inst->op == IR_CONST) {
+		emit_byte(Out, OP_I32_CONST);
+		emit_sleb(Out, inst->imm);
+		if (inst->vector)
+			emit_simd(Out, SIMD_I32X4_SPLAT);
+	} else if (inst->op == IR_FRAME) {
+		emit_byte(Out, OP_GET_LOCAL);
+		emit_uleb(Out, FrameLocal);
+	} else if (inst->op == IR_PARAM) {
+		emit_byte(Out, OP_GET_LOCAL);
+		emit_uleb(Out, inst->imm);
+	} else if (inst->inlined) {
+		emit_inst(v);
+	} else {
+		emit_byte(Out, OP_GET_LOCAL);
+		emit_uleb(Out, inst->local);
+	}
+}
+
+static void emit_inst(IrValue v) {
+	const IrInst *inst = I(v);
+	// i64.mul stands for ND_MULHI, whose operands are multiplied as i64
+	bool high_product = inst->op == IR_BINARY && inst->opcode == OP_I64_MUL;
+	for (unsigned int i = 0; i < inst->operand_count; ++i) {
+		emit_value(inst->operands[i]);
+		if (high_product)
+			emit_byte(Out, OP_I64_EXTEND_I32_S);
+	}
+	switch (inst->op) {
+		case IR_BINARY:
+			if (high_product)
+				emit_high_product(Out);
+			else
+				emit_byte(Out, inst->opcode);
+			break;
+		case IR_SELECT:
+			emit_byte(Out, OP_SELECT);
+			break;
+		case IR_LOAD:
+		case IR_STORE:
+			if (inst->vector)
+				emit_simd(Out, inst->op == IR_LOAD ? SIMD_V128_LOAD : SIMD_V128_STORE);
+			else
+				emit_byte(Out, inst->op == IR_LOAD ? OP_I32_LOAD : OP_I32_STORE);
+			emit_byte(Out, 2);
+			emit_uleb(Out, inst->imm);
+			break;
+		case IR_SIMD:
+			emit_simd(Out, inst->opcode);
+			if (inst->opcode == SIMD_I32X4_EXTRACT_LANE)
+				emit_byte(Out, inst->imm);
+			break;
+		case IR_CALL: {
+			emit_byte(Out, OP_CALL);
+			unsigned int slot = emit_slot(Out);
+			AddCall(slot, inst->imm);
+		} break;
+	}
+}
+
+// return f(x), the callee's result is the function's and its call replaces
+// this one's native frame
+static void emit_tail_call(IrValue v) {
+	const IrInst *inst = I(v);
+	for (unsigned int i = 0; i < inst->operand_count; ++i)
+		emit_value(inst->operands[i]);
+	emit_byte(Out, OP_RETURN_CALL);
+	AddCall(emit_slot(Out), inst->imm);
+}
+
+static bool is_tail_call(IrValue v) {
+	const IrInst *inst = I(v);
+	return TailCalls && !Ir->frame && inst->op == IR_CALL && inst->inlined;
+}
+
+// Drops the copies that have nothing to do, returns how many are left
+static unsigned int needed_copies(IrCopy *copies, unsigned int total) {
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < total; ++i) {
+		const IrInst *phi = I(copies[i].phi), *source = I(copies[i].source);
+		if (!is_leaf(source) && !source->inlined && source->local == phi->local) continue;
+		// Phis sharing a local get the same value here
+		bool done = false;
+		for (unsigned int j = 0; j < count; ++j)
+			done |= I(copies[j].phi)->local == phi->local;
+		if (!done)
+			copies[count++] = copies[i];
+	}
+	return count;
+}
+
+// All sources are read before any phi is written, since a phi can be the
+// source of another
+static void emit_copy_list(const IrCopy *copies, unsigned int count) {
+	for (unsigned int i = 0; i < count; ++i)
+		emit_value(copies[i].source);
+	for (unsigned int i = count; i-- > 0;) {
+		emit_byte(Out, OP_SET_LOCAL);
+		emit_uleb(Out, I(copies[i].phi)->local);
+	}
+}
+
+// Sets the phis of every successor
+static void emit_copies(IrBlockId id) {
+	emit_copy_list(Copies[id], needed_copies(Copies[id], CopyCounts[id]));
+}
+
+// The end of a latch that can leave its loop. It only sets the loop's phis
+// when it goes back, and the exit's when it leaves
+static void emit_latch(IrBlockId id) {
+	IrCopy *copies = Copies[id];
+	unsigned int back = BackCopyCounts[id], count = CopyCounts[id];
+	unsigned int back_needed = needed_copies(copies, back);
+	unsigned int exit_needed = needed_copies(copies + back, count - back);
+	emit_value(B(id)->term_value);
+	if (back_needed) {
+		emit_byte(Out, OP_IF);
+		emit_byte(Out, 0x40);
+		emit_copy_list(copies, back_needed);
+		emit_byte(Out, OP_BRANCH);
+		emit_byte(Out, 1);
+		emit_byte(Out, OP_END);
+	} else {
+		emit_byte(Out, OP_BRANCH_IF);
+		emit_byte(Out, 0);
+	}
+	emit_copy_list(copies + back, exit_needed);
+}
+
+// The end of a block that branches: the condition, inverted when negate is
+// set, and the copies for the successors' phis, which are made before the
+// branch is taken. A folded branch only needs the copies. Returns whether
+// the condition was emitted
+static bool emit_branch(IrBlockId id, bool negate) {
+	const IrBlock *block = B(id);
+	bool folded = block->succ_count == 1;
+	if (!folded) {
+		emit_value(block->term_value);
+		if (negate)
+			emit_byte(Out, OP_I32_EQZ);
+	}
+	emit_copies(id);
+	return !folded;
+}
+
+// Which way a folded branch goes
+static bool branch_taken(IrBlockId id) {
+	return I(B(id)->term_value)->imm != 0;
+}
+
+static void emit_region(IrRegion *region) {
+	for (; region; region = region->next) {
+		if (region->kind != RG_SEQUENCE && !B(region->block)->reachable) continue;
+		switch (region->kind) {
+			case RG_SEQUENCE:
+				emit_region(region->first);
+				break;
+			case RG_BLOCK: {
+				IrBlockId id = region->block;
+				const IrBlock *block = B(id);
+				for (unsigned int i = 0; i < block->inst_count; ++i) {
+					IrValue v = block->insts[i];
+					const IrInst *inst = I(v);
+					if (!is_emitted(inst) || inst->inlined) continue;
+					emit_inst(v);
+					if (inst->op == IR_STORE) continue;
+					if (inst->use_count) {
+						emit_byte(Out, OP_SET_LOCAL);
+						emit_uleb(Out, inst->local);
+					} else {
+						emit_byte(Out, OP_DROP);
+					}
+				}
+				if (block->term == TERM_NONE) {
+					emit_copies(id);
+				} else if (block->term == TERM_RETURN && is_tail_call(block->term_value)) {
+					emit_tail_call(block->term_value);
+					if (!Nesting)
+						TailCallEnd = Out->length;
+				} else if (block->term == TERM_RETURN) {
+					emit_value(block->term_value);
+					// The function's result is simply left on the stack
+					if (id != Ir->exit) {
+						if (Ir->frame)
+							emit_epilogue(Out, FrameLocal);
+						emit_byte(Out, OP_RETURN);
+						if (!Nesting)
+							ReturnEnd = Out->length;
+					}
+				}
+			} break;
+			case RG_IF: {
+				if (!emit_branch(region->block, false)) {
+					// Only one of the arms is still reachable
+					emit_region(region->then);
+					emit_region(region->els);
+					break;
+				}
+				Nesting += 1;
+				emit_byte(Out, OP_IF);
+				emit_byte(Out, 0x40);
+				emit_region(region->then);
+				unsigned int else_start = Out->length;
+				emit_byte(Out, OP_ELSE);
+				emit_region(region->els);
+				if (Out->length == else_start + 1)
+					Out->length = else_start;
+				emit_byte(Out, OP_END);
+				Nesting -= 1;
+			} break;
+			case RG_LOOP: {
+				IrBlockId header_end = region->block;
+				bool has_condition = B(header_end)->term == TERM_BRANCH;
+				if (has_condition && B(header_end)->succ_count == 1 && !branch_taken(header_end)) {
+					// Never true, the header runs once
+					emit_region(region->header);
+					emit_branch(header_end, true);
+					break;
+				}
+				bool exits = has_condition && B(header_end)->succ_count == 2;
+				Nesting += 1;
+				if (exits) {
+					emit_byte(Out, OP_BLOCK);
+					emit_byte(Out, 0x40);
+				}
+				emit_byte(Out, OP_LOOP);
+				emit_byte(Out, 0x40);
+				emit_region(region->header);
+				if (has_condition && emit_branch(header_end, true)) {
+					emit_byte(Out, OP_BRANCH_IF);
+					emit_byte(Out, 1);
+				}
+				emit_region(region->then);
+				if (B(region->latch)->reachable) {
+					emit_byte(Out, OP_BRANCH);
+					emit_byte(Out, 0);
+				}
+				emit_byte(Out, OP_END);
+				if (exits)
+					emit_byte(Out, OP_END);
+				Nesting -= 1;
+			} break;
+			case RG_ROTATED_LOOP: {
+				IrBlockId guard = region->block, latch = region->latch;
+				bool guarded = B(guard)->succ_count == 2;
+				if (!guarded && !branch_taken(guard)) {
+					// Never entered
+					emit_copies(guard);
+					break;
+				}
+				Nesting += 1;
+				if (guarded) {
+					emit_byte(Out, OP_BLOCK);
+					emit_byte(Out, 0x40);
+				}
+				if (emit_branch(guard, true)) {
+					emit_byte(Out, OP_BRANCH_IF);
+					emit_byte(Out, 0);
+				}
+				emit_byte(Out, OP_LOOP);
+				emit_byte(Out, 0x40);
+				emit_region(region->then);
+				if (EdgeCopies[latch]) {
+					emit_latch(latch);
+				} else if (B(latch)->reachable) {
+					if (emit_branch(latch, false)) {
+						emit_byte(Out, OP_BRANCH_IF);
+						emit_byte(Out, 0);
+					} else if (branch_taken(latch)) {
+						emit_byte(Out, OP_BRANCH);
+						emit_byte(Out, 0);
+					}
+				}
+				emit_byte(Out, OP_END);
+				if (guarded)
+					emit_byte(Out, OP_END);
+				Nesting -= 1;
+			} break;
+		}
+	}
+}
+
+unsigned int emit_ir(IrFunction *ir, ByteBuffer *code, void (*add_call)(unsigned int offset, NodeId call)) {
+	arena_reset(&IrEmitArena);
+	Ir = ir;
+	Out = code;
+	AddCall = add_call;
+	Position = 0;
+	EdgeCopies = arena_push_array(&IrEmitArena, bool, ir->block_count);
+
+	number_region(ir->body);
+	count_uses();
+	choose_inlined();
+	allocate_locals();
+	// Parameters are the first locals, then the allocated i32 and v128 ones
+	unsigned int param_count = ir->fn->param_count;
+	for (unsigned int i = 0; i < ValueCount; ++i) {
+		IrInst *inst = I(Values[i]);
+		inst->local += param_count + (inst->vector ? ir->local_count : 0);
+	}
+	FrameLocal = param_count + ir->local_count + ir->vector_local_count;
+	emit_local_declarations(code, ir->local_count, ir->vector_local_count, ir->frame != 0);
+	unsigned int start = code->length;
+	if (ir->frame)
+		emit_prologue(code, ir->fn, FrameLocal);
+	Nesting = ReturnEnd = TailCallEnd = 0;
+	emit_region(ir->body);
+	if (!B(ir->exit)->reachable) {
+		// Every path returned. When the last thing emitted is a return, its
+		// value can be the result instead, the epilogue before it stays
+		if (ReturnEnd == code->length)
+			code->length -= 1;
+		else if (TailCallEnd != code->length)
+			emit_byte(code, OP_UNREACHABLE);
+	} else if (ir->frame) {
+		emit_epilogue(code, FrameLocal);
+	}
+	return start;
+}
@@ -2,48 +2,180 @@
 #include "tokenize.h"
 #include "standard_functions.h"
 #include "codegen.h"
+#include "optimize.h"
+#include "callgraph.h"
+#include "peephole.h"
+#include "arena.h"
+#include "timing.h"
 
-static char compile_text[1024] = {0};
+#define COMPILE_TEXT_SIZE (64 * 1024)
 
-static unsigned char compiled_code[1024] = {0};
-static unsigned char *c = 0;
-unsigned int n_byte_length = 0;
+static char compile_text[COMPILE_TEXT_SIZE + SIMD_PADDING] = {0};
+static unsigned int compile_text_length = 0;
+static bool tokens_current = false;
+
+#define EDIT_TEXT_SIZE 4096
+
+static char edit_text[EDIT_TEXT_SIZE] = {0};
+
+static unsigned char *compiled_code = 0;
 
 __attribute__((export_name("get_mem_addr")))
 char *get_mem_addr() {
 	return compile_text;
 }
 
+__attribute__((export_name("get_mem_size")))
+unsigned int get_mem_size() {
+	return COMPILE_TEXT_SIZE;
+}
+
+__attribute__((export_name("get_edit_addr")))
+char *get_edit_addr() {
+	return edit_text;
+}
+
+__attribute__((export_name("get_edit_size")))
+unsigned int get_edit_size() {
+	return EDIT_TEXT_SIZE;
+}
+
 static unsigned int get_number(Token *tok) {
 	if (tok->kind != TK_NUM)
 		error_tok(tok, "expected a number");
 	return tok->val;
 }
 
+static unsigned int compile_tokens(f64 start) {
+	Function *prog = ParseTokens();
+	start = end_pass(PASS_PARSE, start);
+
+	if (!prog) return 0;
+
+	optimize(prog);
+	start = end_pass(PASS_OPTIMIZE, start);
+
+#if _DEBUG
+	print_tree(prog->body);
+#endif
+
+	if (CurrentToken()->kind != TK_EOF)
+		error_tok(CurrentToken(), "extra token");
+
+	unsigned int length = gen_expr(&compiled_code);
+	// gen_function times the IR and the peephole pass on their own
+	PassTimes[PASS_CODEGEN] = _now() - start - PassTimes[PASS_IR] - PassTimes[PASS_PEEPHOLE];
+
+#if _DEBUG
+	print_arena_stats();
+	print_peephole_stats();
+#endif
+
+	return length;
+}
+
+static f64 begin_compile(OptLevel opt_level) {
+	OptimizationLevel = opt_level > OPT_O2 ? OPT_O2 : opt_level;
+	reset_pass_times();
+	return _now();
+}
+
+// opt_level is an OptLevel: O0 while typing, O2 for code that is going to run
 __attribute__((export_name("compile")))
-extern unsigned int compile() {
+extern unsigned int compile(OptLevel opt_level) {
+	f64 start = begin_compile(opt_level);
 
 	char *ct = (char *)compile_text;
 
-	n_byte_length = 0;
+	compile_text_length = strlen(ct);
 
 	Token *t = tokenize(ct);
+	tokens_current = t != 0;
+	start = end_pass(PASS_TOKENIZE, start);
 	if (!t) return 0;
 
-	Function *prog = ParseTokens();
+	return compile_tokens(start);
+}
 
-	if (!prog) return 0;
+// Applies an edit from the editor without re-reading the whole source: the
+// inserted_len bytes in edit_text replace compile_text[offset, offset +
+// deleted_len) and only the tokens around the edit are lexed again. Returns
+// the code length like compile, or -1 when the edit cannot be applied and
+// the caller has to fall back to a full compile
+__attribute__((export_name("edit")))
+extern int edit(unsigned int offset, unsigned int deleted_len, unsigned int inserted_len, OptLevel opt_level) {
+	if (!tokens_current || inserted_len > EDIT_TEXT_SIZE) return -1;
+	if (offset > compile_text_length || deleted_len > compile_text_length - offset) return -1;
+	unsigned int length = compile_text_length - deleted_len + inserted_len;
+	if (length > COMPILE_TEXT_SIZE) return -1;
 
-#if _DEBUG
-	print_tree(prog->body);
-#endif
+	char *ct = (char *)compile_text;
+	memmove(ct + offset + inserted_len, ct + offset + deleted_len, compile_text_length - offset - deleted_len + 1);
+	memcpy(ct + offset, edit_text, inserted_len);
+	compile_text_length = length;
 
-	if (CurrentToken()->kind != TK_EOF)
-		error_tok(CurrentToken(), "extra token");
+	f64 start = begin_compile(opt_level);
+	Token *t = retokenize(ct, offset, deleted_len, inserted_len);
+	tokens_current = t != 0;
+	start = end_pass(PASS_TOKENIZE, start);
+	if (!t) return 0;
+
+	return compile_tokens(start);
+}
+
+__attribute__((export_name("set_inline_budget")))
+extern void set_inline_budget(unsigned int nodes) {
+	InlineBudget = nodes;
+}
+
+// Off for engines that reject return_call
+__attribute__((export_name("set_tail_calls")))
+extern void set_tail_calls(bool enabled) {
+	TailCalls = enabled;
+}
+
+__attribute__((export_name("get_pass_times")))
+f64 *get_pass_times() {
+	return PassTimes;
+}
 
-	memset(c, 0, sizeof(compiled_code));
+__attribute__((export_name("get_pass_count")))
+unsigned int get_pass_count() {
+	return PASS_COUNT;
+}
+
+__attribute__((export_name("tokenize_benchmark")))
+extern unsigned int tokenize_benchmark(unsigned int iterations, bool simd) {
+	SetTokenizerSIMD(simd);
+	for (unsigned int i = 0; i < iterations; ++i)
+		tokenize(compile_text);
+	SetTokenizerSIMD(true);
+	return iterations;
+}
+
+// Types and deletes a space at offset, re-lexing only around it
+__attribute__((export_name("edit_benchmark")))
+extern unsigned int edit_benchmark(unsigned int iterations, unsigned int offset) {
+	char *ct = (char *)compile_text;
+	unsigned int length = strlen(ct);
+	if (offset > length || !tokenize(ct)) return 0;
+	for (unsigned int i = 0; i < iterations; ++i) {
+		memmove(ct + offset + 1, ct + offset, length - offset + 1);
+		ct[offset] = ' ';
+		retokenize(ct, offset, 0, 1);
+		memmove(ct + offset, ct + offset + 1, length - offset + 1);
+		retokenize(ct, offset, 1, 0);
+	}
+	return iterations;
+}
 
-	return gen_expr(compiled_code);
+__attribute__((export_name("parse_benchmark")))
+extern unsigned int parse_benchmark(unsigned int iterations) {
+	if (!tokenize(compile_text)) return 0;
+	for (unsigned int i = 0; i < iterations; ++i) {
+		if (!ParseTokens()) return 0;
+	}
+	return iterations;
 }
 
 __attribute__((export_name("get_compiled_code")))
@@ -0,0 +1,958 @@
+#include "optimize.h"
+#include "callgraph.h"
+#include "standard_functions.h"
+#include "vectorize.h"
+
+OptLevel OptimizationLevel = OPT_O2;
+
+// Constant folding and algebraic simplification. Folded values follow the
+// instructions codegen picks for each node (ND_DIV is i32.div_s on ints,
+// shifts use the low 5 bits of the count), so folding never changes a
+// result. Control flow is left alone, only the expressions inside it are
+// folded.
+
+static NodeId fold(NodeId id);
+
+#define is_num(id) (N(id)->kind == ND_NUM)
+#define num_is(id, v) (is_num(id) && N(id)->val == (v))
+
+static bool has_side_effects(NodeId id) {
+	if (!id) return false;
+	const Node *node = N(id);
+	switch (node->kind) {
+		case ND_ASSIGN:
+		case ND_FUNCCALL:
+		case ND_BREAK:
+			return true;
+		case ND_NUM:
+		case ND_VAR:
+			return false;
+		case ND_COND:
+			if (has_side_effects(node->els)) return true;
+			break;
+	}
+	return has_side_effects(node->lhs) || has_side_effects(node->rhs);
+}
+
+static NodeId make_num(NodeId id, int val) {
+	Node *node = N(id);
+	node->kind = ND_NUM;
+	node->val = val;
+	node->lhs = node->rhs = 0;
+	return id;
+}
+
+// Folds both operands being constants, returns false when the operation
+// would trap at runtime and has to be kept
+static bool fold_binary(NodeKind kind, int a, int b, int *result) {
+	unsigned int ua = a, ub = b;
+	switch (kind) {
+		case ND_ADD: *result = ua + ub; return true;
+		case ND_SUB: *result = ua - ub; return true;
+		case ND_MUL: *result = ua * ub; return true;
+		case ND_DIV:
+			if (!b || (a == (int)0x80000000 && b == -1)) return false;
+			*result = a / b;
+			return true;
+		case ND_MOD:
+			if (!b || (a == (int)0x80000000 && b == -1)) return false;
+			*result = a % b;
+			return true;
+		case ND_SHL: *result = ua << (ub & 31); return true;
+		case ND_SHR: *result = a >> (ub & 31); return true;
+		case ND_BITAND: *result = a & b; return true;
+		case ND_BITOR: *result = a | b; return true;
+		case ND_BITXOR: *result = a ^ b; return true;
+		case ND_EQ: *result = a == b; return true;
+		case ND_NE: *result = a != b; return true;
+		case ND_LT: *result = a < b; return true;
+		case ND_LE: *result = a <= b; return true;
+		case ND_GT: *result = a > b; return true;
+		case ND_GE: *result = a >= b; return true;
+		case ND_LOGAND: *result = a && b; return true;
+		case ND_LOGOR: *result = a || b; return true;
+	}
+	return false;
+}
+
+// Identities with one constant operand, returns the node to use instead
+static NodeId simplify_binary(NodeId id) {
+	Node *node = N(id);
+	NodeId lhs = node->lhs, rhs = node->rhs;
+	switch (node->kind) {
+		case ND_ADD:
+			if (num_is(rhs, 0)) return lhs;
+			if (num_is(lhs, 0)) return rhs;
+			// fallthrough
+		case ND_SUB: {
+			if (num_is(rhs, 0)) return lhs;
+			// (x +- c1) +- c2 is x + (+-c1 +- c2), mostly scaled pointer offsets
+			Node *inner = N(lhs);
+			if (is_num(rhs) && (inner->kind == ND_ADD || inner->kind == ND_SUB) && is_num(inner->rhs)) {
+				unsigned int c1 = N(inner->rhs)->val, c2 = N(rhs)->val;
+				unsigned int c = (inner->kind == ND_ADD ? c1 : -c1) + (node->kind == ND_ADD ? c2 : -c2);
+				node->kind = ND_ADD;
+				node->lhs = inner->lhs;
+				make_num(rhs, c);
+				return num_is(rhs, 0) ? node->lhs : id;
+			}
+			return id;
+		}
+		case ND_MUL:
+			if (num_is(rhs, 1)) return lhs;
+			if (num_is(lhs, 1)) return rhs;
+			if (num_is(rhs, 0) && !has_side_effects(lhs)) return rhs;
+			if (num_is(lhs, 0) && !has_side_effects(rhs)) return lhs;
+			return id;
+		case ND_DIV:
+			return num_is(rhs, 1) ? lhs : id;
+		case ND_BITOR:
+		case ND_BITXOR:
+			if (num_is(rhs, 0)) return lhs;
+			if (num_is(lhs, 0)) return rhs;
+			return id;
+		case ND_BITAND:
+			if (num_is(rhs, 0) && !has_side_effects(lhs)) return rhs;
+			if (num_is(lhs, 0) && !has_side_effects(rhs)) return lhs;
+			return id;
+		case ND_SHL:
+		case ND_SHR:
+			return num_is(rhs, 0) ? lhs : id;
+		case ND_LOGAND:
+		case ND_LOGOR: {
+			if (!is_num(lhs)) return id;
+			// 0 && x and 1 || x never evaluate x
+			bool value = N(lhs)->val != 0;
+			if (value == (node->kind == ND_LOGOR))
+				return make_num(id, value);
+			// Otherwise the result is x != 0, reusing the constant as the 0
+			node->kind = ND_NE;
+			node->lhs = rhs;
+			node->rhs = make_num(lhs, 0);
+			return id;
+		}
+	}
+	return id;
+}
+
+static NodeId fold_list(NodeId head) {
+	NodeId first = 0, tail = 0;
+	for (NodeId id = head; id;) {
+		NodeId next = N(id)->next;
+		NodeId folded = fold(id);
+		N(folded)->next = 0;
+		if (tail)
+			N(tail)->next = folded;
+		else
+			first = folded;
+		tail = folded;
+		id = next;
+	}
+	return first;
+}
+
+static NodeId fold(NodeId id) {
+	if (!id) return 0;
+	Node *node = N(id);
+	switch (node->kind) {
+		case ND_NUM:
+		case ND_VAR:
+			return id;
+		case ND_BLOCK:
+			node->lhs = fold_list(node->lhs);
+			return id;
+		case ND_FUNCCALL:
+			node->lhs = fold_list(node->lhs);
+			return id;
+		case ND_IF:
+			node->lhs = fold(node->lhs);
+			node->rhs = fold(node->rhs);
+			node->els = fold(node->els);
+			return id;
+		case ND_FOR: {
+			node->lhs = fold(node->lhs);
+			node->rhs = fold(node->rhs);
+			Node *clauses = N(node->clauses);
+			clauses->lhs = fold(clauses->lhs);
+			clauses->rhs = fold(clauses->rhs);
+			return id;
+		}
+		case ND_COND:
+			node->lhs = fold(node->lhs);
+			node->rhs = fold(node->rhs);
+			node->els = fold(node->els);
+			if (is_num(node->lhs))
+				return N(node->lhs)->val ? node->rhs : node->els;
+			return id;
+		case ND_NEG: {
+			NodeId operand = fold(node->lhs);
+			if (is_num(operand))
+				return make_num(operand, -(unsigned int)N(operand)->val);
+			if (N(operand)->kind == ND_NEG)
+				return N(operand)->lhs;
+			node->lhs = operand;
+			return id;
+		}
+		case ND_RETURN:
+		case ND_ADDR:
+		case ND_DEREF:
+			node->lhs = fold(node->lhs);
+			return id;
+		case ND_ASSIGN:
+		case ND_SWITCH:
+		case ND_CASE:
+			node->lhs = fold(node->lhs);
+			node->rhs = fold(node->rhs);
+			return id;
+		case ND_BREAK:
+			return id;
+	}
+
+	// Binary operators
+	node->lhs = fold(node->lhs);
+	node->rhs = fold(node->rhs);
+	int result;
+	if (is_num(node->lhs) && is_num(node->rhs) && fold_binary(node->kind, N(node->lhs)->val, N(node->rhs)->val, &result))
+		return make_num(id, result);
+	return simplify_binary(id);
+}
+
+// Dead code. Statements after one that never completes are dropped, and so
+// are statements without effects whose value is not the function's result.
+// if and for on constant conditions keep only the part that runs.
+
+// Whether the statement after id never runs. break only leaves a switch,
+// so a for without a condition can only be left by returning, and the rest
+// of a section after a break is dead
+static bool never_completes(NodeId id) {
+	if (!id) return false;
+	const Node *node = N(id);
+	switch (node->kind) {
+		case ND_RETURN:
+		case ND_BREAK:
+			return true;
+		case ND_BLOCK:
+			for (NodeId stmt = node->lhs; stmt; stmt = N(stmt)->next) {
+				if (never_completes(stmt)) return true;
+			}
+			return false;
+		case ND_IF:
+			return node->els && never_completes(node->rhs) && never_completes(node->els);
+		case ND_FOR:
+			return !node->lhs;
+	}
+	return false;
+}
+
+// Whether id leaves a value, which the last statement of a function returns
+static bool yields_value(NodeId id) {
+	if (!id) return false;
+	switch (N(id)->kind) {
+		case ND_ASSIGN:
+		case ND_RETURN:
+		case ND_IF:
+		case ND_FOR:
+		case ND_SWITCH:
+		case ND_BREAK:
+			return false;
+		case ND_BLOCK: {
+			NodeId last = N(id)->lhs;
+			while (last && N(last)->next)
+				last = N(last)->next;
+			return yields_value(last);
+		}
+	}
+	return true;
+}
+
+static NodeId remove_dead_code(NodeId id, bool is_result);
+
+static NodeId remove_dead_statements(NodeId head, bool is_result) {
+	NodeId first = 0, tail = 0;
+	for (NodeId id = head; id;) {
+		NodeId next = N(id)->next;
+		NodeId stmt = remove_dead_code(id, is_result && !next);
+		if (stmt) {
+			N(stmt)->next = 0;
+			if (tail)
+				N(tail)->next = stmt;
+			else
+				first = stmt;
+			tail = stmt;
+			if (never_completes(stmt)) break;
+		}
+		id = next;
+	}
+	return first;
+}
+
+// The function's result must stay a statement without a value: one that
+// leaves a value would become the result, and dropping it would make the
+// statement before it the last
+static NodeId replace_statement(NodeId id, NodeId replacement, bool is_result) {
+	return is_result && (!replacement || yields_value(replacement)) ? id : replacement;
+}
+
+// Returns the statement to keep in id's place, 0 to drop it. is_result is
+// set for the last statement of the function
+static NodeId remove_dead_code(NodeId id, bool is_result) {
+	Node *node = N(id);
+	switch (node->kind) {
+		case ND_BLOCK:
+			node->lhs = remove_dead_statements(node->lhs, is_result);
+			return node->lhs || is_result ? id : 0;
+		case ND_IF: {
+			if (node->els)
+				node->els = remove_dead_code(node->els, false);
+			// An else needs a then arm, even an empty one
+			NodeId then = node->rhs ? remove_dead_code(node->rhs, false) : 0;
+			if (then || !node->els)
+				node->rhs = then;
+			if (is_num(node->lhs))
+				return replace_statement(id, N(node->lhs)->val ? node->rhs : node->els, is_result);
+			if (!node->rhs && !node->els && !has_side_effects(node->lhs))
+				return replace_statement(id, 0, is_result);
+			return id;
+		}
+		case ND_FOR: {
+			if (node->rhs)
+				node->rhs = remove_dead_code(node->rhs, false);
+			if (!node->lhs || !is_num(node->lhs))
+				return id;
+			// for (;1;) loops until it returns, for (init; 0;) only runs init
+			if (N(node->lhs)->val) {
+				node->lhs = 0;
+				return id;
+			}
+			return replace_statement(id, N(node->clauses)->lhs, is_result);
+		}
+		case ND_SWITCH:
+			for (NodeId section = node->rhs; section; section = N(section)->rhs) {
+				if (N(section)->lhs)
+					N(section)->lhs = remove_dead_code(N(section)->lhs, false);
+			}
+			return id;
+		case ND_RETURN:
+		case ND_ASSIGN:
+		case ND_FUNCCALL:
+		case ND_BREAK:
+			return id;
+	}
+	return is_result || has_side_effects(id) ? id : 0;
+}
+
+// Loop optimizations. Each ND_FOR, innermost first, is vectorized when it
+// can be, see vectorize.c. Then the loop, and the vector loop made from it,
+// get a preheader: a block appended to its init clause that runs once after
+// the init, and a latch appended to its increment. Only WASM locals are tracked, escaping
+// variables can change behind any store or call. A variable is invariant
+// when nothing in the condition, body or increment assigns it
+//
+// - Pure expressions over invariants that cannot trap are computed in the
+//   preheader into a temporary
+// - For an induction variable i, only changed by i = i +- c in the
+//   increment, p + i * k with an invariant p becomes a temporary pointer
+//   set in the preheader and advanced by c * k in the latch
+
+typedef struct Reduction Reduction;
+struct Reduction {
+	Obj *base;
+	u8 kind; // ND_ADD or ND_SUB
+	int scale;
+	Obj *pointer;
+};
+
+#define MAX_REDUCTIONS 8
+
+static Function *CurrentFunction;
+static unsigned int LoopMark;
+static NodeId Preheader, PreheaderTail;
+static NodeId Latch, LatchTail;
+static Obj *Induction;
+static int InductionStep;
+static Reduction Reductions[MAX_REDUCTIONS];
+static unsigned int ReductionCount;
+
+static void append_statement(NodeId *head, NodeId *tail, NodeId node) {
+	if (*tail)
+		N(*tail)->next = node;
+	else
+		*head = node;
+	*tail = node;
+}
+
+// fn may create nodes, which can move the pool, so the slot is only looked
+// up again after the call
+#define REWRITE_CHILD(id, child) { NodeId rewritten = rewrite_tree(N(id)->child, fn); N(id)->child = rewritten; }
+
+NodeId rewrite_tree(NodeId id, NodeId (*fn)(NodeId)) {
+	if (!id) return 0;
+	switch (N(id)->kind) {
+		case ND_NUM:
+		case ND_VAR:
+			break;
+		case ND_BLOCK:
+		case ND_FUNCCALL: {
+			NodeId first = 0, tail = 0;
+			for (NodeId n = N(id)->lhs; n;) {
+				NodeId next = N(n)->next;
+				NodeId rewritten = rewrite_tree(n, fn);
+				N(rewritten)->next = 0;
+				append_statement(&first, &tail, rewritten);
+				n = next;
+			}
+			N(id)->lhs = first;
+			break;
+		}
+		case ND_FOR: {
+			NodeId clauses = N(id)->clauses;
+			REWRITE_CHILD(clauses, lhs);
+			REWRITE_CHILD(clauses, rhs);
+			REWRITE_CHILD(id, lhs);
+			REWRITE_CHILD(id, rhs);
+			break;
+		}
+		case ND_IF:
+		case ND_COND:
+			REWRITE_CHILD(id, els);
+			// fallthrough
+		default:
+			REWRITE_CHILD(id, lhs);
+			REWRITE_CHILD(id, rhs);
+			break;
+	}
+	return fn(id);
+}
+
+static NodeId mark_assigned(NodeId id) {
+	const Node *node = N(id);
+	if (node->kind == ND_ASSIGN && N(node->lhs)->kind == ND_VAR)
+		N(node->lhs)->var->loop_mark = LoopMark;
+	return id;
+}
+
+static bool is_invariant_var(const Obj *var) {
+	return !var->escapes && var->loop_mark != LoopMark;
+}
+
+// i = i + c or i = i - c
+static void find_induction(NodeId increment) {
+	Induction = 0;
+	if (!increment) return;
+	const Node *node = N(increment);
+	if (node->kind != ND_ASSIGN || N(node->lhs)->kind != ND_VAR) return;
+	Obj *var = N(node->lhs)->var;
+	const Node *step = N(node->rhs);
+	if ((step->kind != ND_ADD && step->kind != ND_SUB) || !is_num(step->rhs)) return;
+	if (N(step->lhs)->kind != ND_VAR || N(step->lhs)->var != var || !is_invariant_var(var)) return;
+	Induction = var;
+	InductionStep = step->kind == ND_ADD ? N(step->rhs)->val : -(unsigned int)N(step->rhs)->val;
+}
+
+// p + i * k and p - i * k, the way new_add and new_sub scale pointer offsets
+static NodeId reduce_strength(NodeId id) {
+	const Node *node = N(id);
+	if (node->kind != ND_ADD && node->kind != ND_SUB) return id;
+	const Node *base = N(node->lhs), *offset = N(node->rhs);
+	if (base->kind != ND_VAR || !is_invariant_var(base->var)) return id;
+	if (offset->kind != ND_MUL || !is_num(offset->rhs)) return id;
+	if (N(offset->lhs)->kind != ND_VAR || N(offset->lhs)->var != Induction) return id;
+
+	Obj *base_var = base->var;
+	u8 kind = node->kind;
+	int scale = N(offset->rhs)->val;
+	for (unsigned int i = 0; i < ReductionCount; ++i) {
+		const Reduction *r = Reductions + i;
+		if (r->base == base_var && r->kind == kind && r->scale == scale)
+			return new_variable(r->pointer);
+	}
+	if (ReductionCount == MAX_REDUCTIONS) return id;
+
+	Obj *pointer = new_temp_lvar(CurrentFunction, node->type);
+	pointer->loop_mark = LoopMark;
+	Reductions[ReductionCount++] = (Reduction){base_var, kind, scale, pointer};
+
+	// The expression itself becomes the pointer's initial value
+	N(id)->next = 0;
+	append_statement(&Preheader, &PreheaderTail, new_binary(ND_ASSIGN, new_variable(pointer), id));
+	unsigned int advance = (unsigned int)InductionStep * scale;
+	NodeId next = new_binary(ND_ADD, new_variable(pointer), new_num(kind == ND_ADD ? advance : -advance));
+	append_statement(&Latch, &LatchTail, new_binary(ND_ASSIGN, new_variable(pointer), next));
+	return new_variable(pointer);
+}
+
+// Replaces an invariant expression by a temporary computed in the preheader.
+// Leaves are as cheap as the temporary would be
+static NodeId hoist_operand(NodeId id, bool invariant) {
+	if (!id || !invariant) return id;
+	NodeKind kind = N(id)->kind;
+	if (kind == ND_NUM || kind == ND_VAR || kind == ND_ADDR) return id;
+
+	NodeId next = N(id)->next;
+	N(id)->next = 0;
+	Obj *tmp = new_temp_lvar(CurrentFunction, N(id)->type);
+	append_statement(&Preheader, &PreheaderTail, new_binary(ND_ASSIGN, new_variable(tmp), id));
+	NodeId var = new_variable(tmp);
+	N(var)->next = next;
+	return var;
+}
+
+static bool hoist(NodeId id);
+
+#define HOIST_CHILD(id, child) { NodeId hoisted = N(id)->child; hoisted = hoist_operand(hoisted, hoist(hoisted)); N(id)->child = hoisted; }
+
+// Division is the only operator that can trap, so it only moves with a
+// divisor known not to. INT_MIN / -1 overflows
+static bool can_trap(NodeId id) {
+	const Node *node = N(id);
+	if (node->kind != ND_DIV && node->kind != ND_MOD) return false;
+	return !is_num(node->rhs) || num_is(node->rhs, 0) || num_is(node->rhs, -1);
+}
+
+// Returns whether id is invariant. The invariant children of a node that is
+// not are hoisted, so only the largest invariant expressions move
+static bool hoist(NodeId id) {
+	if (!id) return true;
+	switch (N(id)->kind) {
+		case ND_NUM:
+		case ND_ADDR:
+			return true;
+		case ND_VAR:
+			return is_invariant_var(N(id)->var);
+		case ND_BLOCK:
+		case ND_FUNCCALL: {
+			NodeId prev = 0;
+			for (NodeId n = N(id)->lhs; n; n = N(n)->next) {
+				n = hoist_operand(n, hoist(n));
+				if (prev)
+					N(prev)->next = n;
+				else
+					N(id)->lhs = n;
+				prev = n;
+			}
+			return false;
+		}
+		case ND_FOR: {
+			NodeId clauses = N(id)->clauses;
+			HOIST_CHILD(clauses, lhs);
+			HOIST_CHILD(clauses, rhs);
+			HOIST_CHILD(id, lhs);
+			HOIST_CHILD(id, rhs);
+			return false;
+		}
+		case ND_IF:
+			HOIST_CHILD(id, lhs);
+			HOIST_CHILD(id, rhs);
+			HOIST_CHILD(id, els);
+			return false;
+		case ND_SWITCH:
+			// The value is a local or a constant already
+			for (NodeId section = N(id)->rhs; section; section = N(section)->rhs)
+				HOIST_CHILD(section, lhs);
+			return false;
+		case ND_BREAK:
+			return false;
+		case ND_ASSIGN:
+			if (N(N(id)->lhs)->kind != ND_VAR)
+				hoist(N(id)->lhs);
+			HOIST_CHILD(id, rhs);
+			return false;
+		case ND_RETURN:
+		case ND_DEREF:
+			HOIST_CHILD(id, lhs);
+			return false;
+		case ND_NEG:
+			return hoist(N(id)->lhs);
+		case ND_COND: {
+			NodeId lhs = N(id)->lhs, rhs = N(id)->rhs, els = N(id)->els;
+			bool cond_invariant = hoist(lhs), then_invariant = hoist(rhs), els_invariant = hoist(els);
+			if (cond_invariant && then_invariant && els_invariant) return true;
+			lhs = hoist_operand(lhs, cond_invariant);
+			rhs = hoist_operand(rhs, then_invariant);
+			els = hoist_operand(els, els_invariant);
+			N(id)->lhs = lhs;
+			N(id)->rhs = rhs;
+			N(id)->els = els;
+			return false;
+		}
+	}
+
+	// Binary operators
+	NodeId lhs = N(id)->lhs, rhs = N(id)->rhs;
+	bool lhs_invariant = hoist(lhs), rhs_invariant = hoist(rhs);
+	if (lhs_invariant && rhs_invariant && !can_trap(id)) return true;
+	lhs = hoist_operand(lhs, lhs_invariant);
+	rhs = hoist_operand(rhs, rhs_invariant);
+	N(id)->lhs = lhs;
+	N(id)->rhs = rhs;
+	return false;
+}
+
+// Runs block after node, wrapping both in an ND_BLOCK
+static NodeId append_block(NodeId node, NodeId block) {
+	if (!block) return node;
+	if (node) {
+		N(node)->next = block;
+		block = node;
+	}
+	NodeId wrapper = new_node(ND_BLOCK);
+	N(wrapper)->lhs = block;
+	return wrapper;
+}
+
+// Hoisting and strength reduction for one loop
+static void transform_loop(NodeId id) {
+	NodeId clauses = N(id)->clauses;
+
+	LoopMark += 1;
+	rewrite_tree(N(id)->lhs, mark_assigned);
+	rewrite_tree(N(id)->rhs, mark_assigned);
+	find_induction(N(clauses)->rhs);
+	rewrite_tree(N(clauses)->rhs, mark_assigned);
+
+	Preheader = PreheaderTail = Latch = LatchTail = 0;
+	ReductionCount = 0;
+	if (Induction) {
+		NodeId (*fn)(NodeId) = reduce_strength;
+		REWRITE_CHILD(id, lhs);
+		REWRITE_CHILD(id, rhs);
+	}
+	HOIST_CHILD(id, lhs);
+	HOIST_CHILD(id, rhs);
+	HOIST_CHILD(clauses, rhs);
+
+	NodeId init = append_block(N(clauses)->lhs, Preheader);
+	NodeId increment = append_block(N(clauses)->rhs, Latch);
+	N(clauses)->lhs = init;
+	N(clauses)->rhs = increment;
+}
+
+static NodeId optimize_loop(NodeId id) {
+	if (N(id)->kind != ND_FOR) return id;
+	NodeId vector_loop;
+	NodeId result = vectorize_loop(CurrentFunction, id, &vector_loop);
+	if (vector_loop)
+		transform_loop(vector_loop);
+	transform_loop(id);
+	return result;
+}
+
+// Tail recursion. A function whose every path ends in a return, and whose
+// locals all stay in WASM locals, runs its body in a for (;;). A final
+// return f(...) calling itself then sets the parameters to the arguments and
+// goes around again instead of calling. Locals start at 0 in every call, so
+// each iteration clears them too.
+
+static Obj *TailLocals; // locals before the pass added its temporaries
+
+static bool list_returns(NodeId stmt);
+
+// Whether every path through the statement id ends in a return
+static bool returns(NodeId id) {
+	if (!id) return false;
+	switch (N(id)->kind) {
+		case ND_RETURN:
+			return true;
+		case ND_IF:
+			return returns(N(id)->rhs) && returns(N(id)->els);
+		case ND_BLOCK:
+			return list_returns(N(id)->lhs);
+	}
+	return false;
+}
+
+// The same for the statements from stmt on. After an if without else whose
+// then arm returns, only the statements that follow it run
+static bool list_returns(NodeId stmt) {
+	for (; stmt; stmt = N(stmt)->next) {
+		const Node *node = N(stmt);
+		if (!node->next) return returns(stmt);
+		if (node->kind == ND_IF && !node->els && returns(node->rhs))
+			return list_returns(node->next);
+	}
+	return false;
+}
+
+// Gives each such if the rest of its block as its else, so that the final
+// returns are at the ends of the arms. Only for id that returns
+static void move_returns_last(NodeId id) {
+	switch (N(id)->kind) {
+		case ND_IF:
+			move_returns_last(N(id)->rhs);
+			move_returns_last(N(id)->els);
+			break;
+		case ND_BLOCK:
+			for (NodeId stmt = N(id)->lhs; stmt; stmt = N(stmt)->next) {
+				const Node *node = N(stmt);
+				if (node->next && (node->kind != ND_IF || node->els || !returns(node->rhs))) continue;
+				if (node->next) {
+					NodeId rest = new_node(ND_BLOCK);
+					N(rest)->lhs = N(stmt)->next;
+					N(stmt)->els = rest;
+					N(stmt)->next = 0;
+				}
+				move_returns_last(stmt);
+				return;
+			}
+			break;
+	}
+}
+
+static bool is_self_call(NodeId id) {
+	if (N(id)->kind != ND_FUNCCALL || N(id)->sym->func != CurrentFunction) return false;
+	unsigned int count = 0;
+	for (NodeId arg = N(id)->lhs; arg; arg = N(arg)->next)
+		count += 1;
+	return count == CurrentFunction->param_count;
+}
+
+// The arguments go into temporaries first, since they can read the
+// parameters they replace. A parameter passed on as itself is left alone
+static NodeId loop_again(NodeId call) {
+	NodeId first = 0, tail = 0, sets = 0, sets_tail = 0;
+	unsigned int index = 0;
+	for (NodeId arg = N(call)->lhs; arg; ++index) {
+		NodeId next = N(arg)->next;
+		N(arg)->next = 0;
+		Obj *param = 0;
+		for (Obj *var = TailLocals; var; var = var->next) {
+			if (var->is_param && var->local_index == index)
+				param = var;
+		}
+		if (N(arg)->kind != ND_VAR || N(arg)->var != param) {
+			Obj *tmp = new_temp_lvar(CurrentFunction, N(arg)->type);
+			append_statement(&first, &tail, new_binary(ND_ASSIGN, new_variable(tmp), arg));
+			append_statement(&sets, &sets_tail, new_binary(ND_ASSIGN, new_variable(param), new_variable(tmp)));
+		}
+		arg = next;
+	}
+	for (Obj *var = TailLocals; var; var = var->next) {
+		if (!var->is_param)
+			append_statement(&sets, &sets_tail, new_binary(ND_ASSIGN, new_variable(var), new_num(0)));
+	}
+	if (tail)
+		N(tail)->next = sets;
+	else
+		first = sets;
+	NodeId block = new_node(ND_BLOCK);
+	N(block)->lhs = first;
+	return block;
+}
+
+// Replaces the final returns below id, returns what takes id's place
+static NodeId replace_tail_calls(NodeId id) {
+	Node *node = N(id);
+	switch (node->kind) {
+		case ND_RETURN: {
+			if (!is_self_call(node->lhs)) return id;
+			NodeId next = node->next;
+			NodeId block = loop_again(node->lhs);
+			N(block)->next = next;
+			return block;
+		}
+		case ND_IF: {
+			NodeId then = replace_tail_calls(node->rhs);
+			N(id)->rhs = then;
+			NodeId els = replace_tail_calls(N(id)->els);
+			N(id)->els = els;
+			return id;
+		}
+		case ND_BLOCK: {
+			NodeId prev = 0, last = node->lhs;
+			for (; N(last)->next; last = N(last)->next)
+				prev = last;
+			NodeId replaced = replace_tail_calls(last);
+			if (prev)
+				N(prev)->next = replaced;
+			else
+				N(id)->lhs = replaced;
+			return id;
+		}
+	}
+	return id;
+}
+
+static bool has_tail_call(NodeId id) {
+	const Node *node = N(id);
+	switch (node->kind) {
+		case ND_RETURN:
+			return is_self_call(node->lhs);
+		case ND_IF:
+			return has_tail_call(node->rhs) || has_tail_call(node->els);
+		case ND_BLOCK: {
+			NodeId last = node->lhs;
+			while (N(last)->next)
+				last = N(last)->next;
+			return has_tail_call(last);
+		}
+	}
+	return false;
+}
+
+static NodeId eliminate_tail_recursion(NodeId body) {
+	for (Obj *var = CurrentFunction->locals; var; var = var->next) {
+		if (var->escapes) return body;
+	}
+	if (!returns(body)) return body;
+	move_returns_last(body);
+	if (!has_tail_call(body)) return body;
+	TailLocals = CurrentFunction->locals;
+	body = replace_tail_calls(body);
+	NodeId clauses = new_node(ND_FOR_CLAUSES);
+	NodeId loop = new_node(ND_FOR);
+	N(loop)->clauses = clauses;
+	N(loop)->rhs = body;
+	NodeId block = new_node(ND_BLOCK);
+	N(block)->lhs = loop;
+	return block;
+}
+
+// Arithmetic lowering, last because the loop passes look for the
+// multiplications it replaces. Multiplying by a power of two becomes a
+// shift. Signed division and remainder by a constant become shifts, or a
+// multiplication by a magic number for other divisors (Granlund and
+// Montgomery, "Division by Invariant Integers using Multiplication", as
+// given in Hacker's Delight 10-4). Division by 0 or -1 keeps its trap, and
+// pointers, which divide unsigned, are left alone.
+
+static bool is_power_of_two(unsigned int n) {
+	return n && !(n & (n - 1));
+}
+
+static int log2_of(unsigned int n) {
+	int k = 0;
+	while (n >>= 1)
+		++k;
+	return k;
+}
+
+// For d >= 3 and not a power of two, x / d is (x * multiplier) >> (32 +
+// shift), plus 1 for a negative x, with the multiplier taken as unsigned
+static void magic_number(unsigned int d, int *multiplier, int *shift) {
+	const unsigned int two31 = 0x80000000;
+	unsigned int anc = two31 - 1 - two31 % d; // |nc|
+	unsigned int q1 = two31 / anc, r1 = two31 - q1 * anc;
+	unsigned int q2 = two31 / d, r2 = two31 - q2 * d;
+	int p = 31;
+	unsigned int delta;
+	do {
+		p += 1;
+		q1 *= 2;
+		r1 *= 2;
+		if (r1 >= anc) {
+			q1 += 1;
+			r1 -= anc;
+		}
+		q2 *= 2;
+		r2 *= 2;
+		if (r2 >= d) {
+			q2 += 1;
+			r2 -= d;
+		}
+		delta = d - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+	*multiplier = q2 + 1;
+	*shift = p - 32;
+}
+
+// -1 for a negative x, else 0
+static NodeId sign_of(Obj *x) {
+	return new_binary(ND_SHR, new_variable(x), new_num(31));
+}
+
+// Adding 2^k - 1 to a negative x first makes the shift round towards 0
+static NodeId power_bias(Obj *x, int k) {
+	return new_binary(ND_BITAND, sign_of(x), new_num((1u << k) - 1));
+}
+
+static NodeId divide_by_magic(Obj *x, unsigned int d) {
+	int multiplier, shift;
+	magic_number(d, &multiplier, &shift);
+	NodeId q = new_binary(ND_MULHI, new_variable(x), new_num(multiplier));
+	// A multiplier of 2^31 or more wrapped around, the product is x * 2^32 short
+	if (multiplier < 0)
+		q = new_binary(ND_ADD, q, new_variable(x));
+	if (shift)
+		q = new_binary(ND_SHR, q, new_num(shift));
+	return new_binary(ND_SUB, q, sign_of(x));
+}
+
+// x / divisor or x % divisor, which both round towards 0
+static NodeId divide_by_constant(NodeKind kind, Obj *x, int divisor) {
+	unsigned int d = divisor < 0 ? -(unsigned int)divisor : divisor;
+	int k = log2_of(d);
+	if (kind == ND_DIV) {
+		NodeId q;
+		if (is_power_of_two(d))
+			q = new_binary(ND_SHR, new_binary(ND_ADD, new_variable(x), power_bias(x, k)), new_num(k));
+		else
+			q = divide_by_magic(x, d);
+		return divisor < 0 ? new_unary(ND_NEG, q) : q;
+	}
+	// The remainder takes the sign of x, the divisor's sign does not matter
+	NodeId multiple;
+	if (is_power_of_two(d))
+		multiple = new_binary(ND_BITAND, new_binary(ND_ADD, new_variable(x), power_bias(x, k)), new_num(-(1u << k)));
+	else
+		multiple = new_binary(ND_MUL, divide_by_magic(x, d), new_num(d));
+	return new_binary(ND_SUB, new_variable(x), multiple);
+}
+
+static NodeId lower_arithmetic(NodeId id) {
+	const Node *node = N(id);
+	NodeKind kind = node->kind;
+	if ((kind != ND_MUL && kind != ND_DIV && kind != ND_MOD) || is_vector(id) || is_unsigned(node->lhs))
+		return id;
+	NodeId lhs = node->lhs, rhs = node->rhs;
+
+	if (kind == ND_MUL) {
+		if (is_num(lhs)) {
+			NodeId num = lhs;
+			lhs = rhs;
+			rhs = num;
+		}
+		if (!is_num(rhs) || !is_power_of_two(N(rhs)->val)) return id;
+		make_num(rhs, log2_of(N(rhs)->val));
+		Node *shift = N(id);
+		shift->kind = ND_SHL;
+		shift->lhs = lhs;
+		shift->rhs = rhs;
+		return id;
+	}
+
+	if (!is_num(rhs)) return id;
+	int divisor = N(rhs)->val;
+	if (!divisor || (kind == ND_DIV && divisor == -1)) return id;
+	// x is read more than once, so anything but a local goes into a temporary
+	if (N(lhs)->kind == ND_VAR && !N(lhs)->var->escapes)
+		return divide_by_constant(kind, N(lhs)->var, divisor);
+	Type *type = node->type;
+	Obj *tmp = new_temp_lvar(CurrentFunction, 0);
+	NodeId copy = new_binary(ND_ASSIGN, new_variable(tmp), lhs);
+	NodeId result = divide_by_constant(kind, tmp, divisor);
+	N(copy)->next = result;
+	NodeId block = new_node(ND_BLOCK);
+	N(block)->lhs = copy;
+	N(block)->type = type;
+	return block;
+}
+
+void optimize(Function *prog) {
+	if (OptimizationLevel == OPT_O0) return;
+	if (OptimizationLevel >= OPT_O2)
+		inline_functions(prog);
+	for (Function *fn = prog; fn; fn = fn->next) {
+		if (!fn->body) continue;
+		CurrentFunction = fn;
+		fn->body = fold(fn->body);
+		// The body is a block, which is kept even when it ends up empty
+		remove_dead_code(fn->body, true);
+		if (OptimizationLevel >= OPT_O2) {
+			fn->body = eliminate_tail_recursion(fn->body);
+			fn->body = rewrite_tree(fn->body, optimize_loop);
+		}
+		fn->body = rewrite_tree(fn->body, lower_arithmetic);
+	}
+	if (OptimizationLevel >= OPT_O2)
+		remove_unreachable_functions();
+}
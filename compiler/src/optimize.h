@@ -0,0 +1,19 @@
+#pragma once
+#include "codegen.h"
+
+// How much work a compile puts into the code it emits
+typedef enum {
+	OPT_O0, // straight from the tree, for compiling on every keystroke
+	OPT_O1, // adds constant folding, dead code removal, arithmetic lowering and the peephole pass
+	OPT_O2, // every pass: inlining, loop optimizations and the SSA IR
+} OptLevel;
+
+extern OptLevel OptimizationLevel;
+
+// Rewrites the parsed functions in place between ParseTokens and gen_expr.
+// Functions reused from the code cache have no nodes and are skipped
+void optimize(Function *prog);
+
+// Calls fn on every node below id and then on id, children first. The node
+// fn returns takes id's place
+NodeId rewrite_tree(NodeId id, NodeId (*fn)(NodeId));
@@ -0,0 +1,391 @@
+#include "peephole.h"
+#include "standard_functions.h"
+#include "arena.h"
+
+// Instructions are decoded one at a time onto an output stack. After each
+// push every rule whose opcodes match the top of the stack gets a chance to
+// rewrite that window in place, and the rules run again on the result, so
+// one rewrite can enable the next (x = a; x; becomes a tee, then a set once
+// the drop is seen).
+
+typedef struct Insn Insn;
+struct Insn {
+	u8 op;
+	u8 simd; // OP_SIMD: the SimdOpCode after the prefix
+	int imm; // const value, local or global index, branch depth, block type, callee index, memory index, lane or memarg alignment
+	unsigned int offset; // memarg offset, OP_BRANCH_TABLE: where its labels start in the input
+};
+
+// Matches any opcode in a rule's pattern
+#define OP_ANY 0xFF
+#define PEEPHOLE_WINDOW 5
+#define NO_MATCH 0xFF
+
+typedef struct PeepholeRule PeepholeRule;
+struct PeepholeRule {
+	const char *name;
+	u8 ops[PEEPHOLE_WINDOW];
+	u8 length;
+	// Checks the immediates and rewrites the window, returns the number of
+	// instructions left in it (at most length) or NO_MATCH
+	u8 (*rewrite)(Insn *window);
+	unsigned int hits;
+};
+
+static Arena PeepholeArena = {"peephole"};
+
+// The code being decoded
+static const unsigned char *Input;
+
+static bool is_pure_value(const Insn *insn) {
+	return insn->op == OP_I32_CONST || insn->op == OP_GET_LOCAL;
+}
+
+static bool is_compare(u8 op) {
+	return op >= OP_I32_EQ && op <= OP_I32_GE_U;
+}
+
+// a op b == !(a inverted b)
+static u8 invert_compare(u8 op) {
+	switch (op) {
+		case OP_I32_EQ: return OP_I32_NE;
+		case OP_I32_NE: return OP_I32_EQ;
+		case OP_I32_LT_S: return OP_I32_GE_S;
+		case OP_I32_LT_U: return OP_I32_GE_U;
+		case OP_I32_GT_S: return OP_I32_LE_S;
+		case OP_I32_GT_U: return OP_I32_LE_U;
+		case OP_I32_LE_S: return OP_I32_GT_S;
+		case OP_I32_LE_U: return OP_I32_GT_U;
+		case OP_I32_GE_S: return OP_I32_LT_S;
+		case OP_I32_GE_U: return OP_I32_LT_U;
+	}
+	return op;
+}
+
+// local.set x; local.get x -> local.tee x
+static u8 set_get_to_tee(Insn *w) {
+	if (w[0].imm != w[1].imm) return NO_MATCH;
+	w[0].op = OP_TEE_LOCAL;
+	return 1;
+}
+
+// local.tee x; drop -> local.set x
+static u8 tee_drop_to_set(Insn *w) {
+	w[0].op = OP_SET_LOCAL;
+	return 1;
+}
+
+// A value nobody reads: i32.const or local.get followed by drop
+static u8 drop_pure(Insn *w) {
+	return is_pure_value(w) ? 0 : NO_MATCH;
+}
+
+// i32.const 0; i32.eq -> i32.eqz
+static u8 eq_zero_to_eqz(Insn *w) {
+	if (w[0].imm) return NO_MATCH;
+	w[0].op = OP_I32_EQZ;
+	return 1;
+}
+
+// if and br_if already test for non-zero: i32.const 0; i32.ne; br_if -> br_if
+static u8 drop_ne_zero(Insn *w) {
+	if (w[0].imm || (w[2].op != OP_IF && w[2].op != OP_BRANCH_IF)) return NO_MATCH;
+	w[0] = w[2];
+	return 1;
+}
+
+// i32.lt_s; i32.eqz -> i32.ge_s
+static u8 invert_eqz_compare(Insn *w) {
+	if (!is_compare(w[0].op)) return NO_MATCH;
+	w[0].op = invert_compare(w[0].op);
+	return 1;
+}
+
+// i32.eqz; i32.eqz; br_if -> br_if
+static u8 drop_double_eqz(Insn *w) {
+	if (w[2].op != OP_IF && w[2].op != OP_BRANCH_IF) return NO_MATCH;
+	w[0] = w[2];
+	return 1;
+}
+
+// i32.const c; i32.add; i32.load offset -> i32.load offset + c. Address
+// arithmetic wrapping around is undefined in C, so the non-wrapping memarg
+// add is fine for the non-negative constants codegen produces
+static u8 fold_add_into_load(Insn *w) {
+	if (w[0].imm < 0) return NO_MATCH;
+	w[0] = (Insn){OP_I32_LOAD, 0, w[2].imm, w[2].offset + w[0].imm};
+	return 1;
+}
+
+// A constant address goes into the memarg: i32.const c; i32.load offset ->
+// i32.const 0; i32.load offset + c
+static u8 fold_const_address(Insn *w) {
+	if (w[0].imm <= 0) return NO_MATCH;
+	w[1].offset += w[0].imm;
+	w[0].imm = 0;
+	return 2;
+}
+
+// Same for stores: i32.const c; x; i32.store offset -> i32.const 0; x; i32.store offset + c
+static u8 fold_const_store_address(Insn *w) {
+	if (w[0].imm <= 0 || !is_pure_value(w + 1)) return NO_MATCH;
+	w[2].offset += w[0].imm;
+	w[0].imm = 0;
+	return 3;
+}
+
+// Reading back what was just stored to the same constant address, or the
+// same local plus offset like a frame slot, reuses the stored value when it
+// is a constant or a local:
+// local.get f; x; i32.store o; local.get f; i32.load o -> local.get f; x; i32.store o; x
+static u8 forward_store_to_load(Insn *w) {
+	if (!is_pure_value(w) || w[3].op != w[0].op || w[3].imm != w[0].imm) return NO_MATCH;
+	if (!is_pure_value(w + 1) || w[2].offset != w[4].offset) return NO_MATCH;
+	w[3] = w[1];
+	return 4;
+}
+
+// x + 0, x - 0, x | 0, x ^ 0
+static u8 drop_zero_operand(Insn *w) {
+	return w[0].imm ? NO_MATCH : 0;
+}
+
+static PeepholeRule Rules[] = {
+	{"set-get to tee", {OP_SET_LOCAL, OP_GET_LOCAL}, 2, set_get_to_tee},
+	{"tee-drop to set", {OP_TEE_LOCAL, OP_DROP}, 2, tee_drop_to_set},
+	{"drop pure value", {OP_ANY, OP_DROP}, 2, drop_pure},
+	{"compare with zero", {OP_I32_CONST, OP_I32_EQ}, 2, eq_zero_to_eqz},
+	{"branch on != 0", {OP_I32_CONST, OP_I32_NE, OP_ANY}, 3, drop_ne_zero},
+	{"inverted compare", {OP_ANY, OP_I32_EQZ}, 2, invert_eqz_compare},
+	{"branch on double eqz", {OP_I32_EQZ, OP_I32_EQZ, OP_ANY}, 3, drop_double_eqz},
+	{"add into load offset", {OP_I32_CONST, OP_I32_ADD, OP_I32_LOAD}, 3, fold_add_into_load},
+	{"constant load address", {OP_I32_CONST, OP_I32_LOAD}, 2, fold_const_address},
+	{"constant store address", {OP_I32_CONST, OP_ANY, OP_I32_STORE}, 3, fold_const_store_address},
+	{"store to load", {OP_ANY, OP_ANY, OP_I32_STORE, OP_ANY, OP_I32_LOAD}, 5, forward_store_to_load},
+	{"add zero", {OP_I32_CONST, OP_I32_ADD}, 2, drop_zero_operand},
+	{"sub zero", {OP_I32_CONST, OP_I32_SUB}, 2, drop_zero_operand},
+	{"or zero", {OP_I32_CONST, OP_I32_OR}, 2, drop_zero_operand},
+	{"xor zero", {OP_I32_CONST, OP_I32_XOR}, 2, drop_zero_operand},
+};
+
+static unsigned int decode_uleb(const unsigned char **p) {
+	unsigned int value = 0, shift = 0;
+	u8 byte;
+	do {
+		byte = *(*p)++;
+		if (shift < 32)
+			value |= (unsigned int)(byte & 0x7F) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	return value;
+}
+
+static int decode_sleb(const unsigned char **p) {
+	unsigned int value = 0, shift = 0;
+	u8 byte;
+	do {
+		byte = *(*p)++;
+		if (shift < 32)
+			value |= (unsigned int)(byte & 0x7F) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+	if (shift < 32 && (byte & 0x40))
+		value |= ~0u << shift;
+	return value;
+}
+
+static bool decode_simd(const unsigned char **p, Insn *insn) {
+	unsigned int op = decode_uleb(p);
+	insn->simd = op;
+	switch (op) {
+		case SIMD_V128_LOAD:
+		case SIMD_V128_STORE:
+			insn->imm = decode_uleb(p);
+			insn->offset = decode_uleb(p);
+			return true;
+		case SIMD_I32X4_EXTRACT_LANE:
+			insn->imm = *(*p)++;
+			return true;
+		case SIMD_I32X4_SPLAT:
+		case SIMD_I32X4_EQ:
+		case SIMD_I32X4_NE:
+		case SIMD_I32X4_LT_S:
+		case SIMD_I32X4_GT_S:
+		case SIMD_I32X4_LE_S:
+		case SIMD_I32X4_GE_S:
+		case SIMD_V128_AND:
+		case SIMD_V128_OR:
+		case SIMD_V128_XOR:
+		case SIMD_I32X4_NEG:
+		case SIMD_I32X4_SHL:
+		case SIMD_I32X4_SHR_S:
+		case SIMD_I32X4_ADD:
+		case SIMD_I32X4_SUB:
+		case SIMD_I32X4_MUL:
+		case SIMD_I32X4_MIN_S:
+		case SIMD_I32X4_MAX_S:
+			return true;
+	}
+	return false;
+}
+
+// Returns false for opcodes codegen does not emit, the body is then left
+// as it is
+static bool decode(const unsigned char **p, Insn *insn) {
+	*insn = (Insn){*(*p)++};
+	switch (insn->op) {
+		case OP_SIMD:
+			return decode_simd(p, insn);
+		case OP_I32_CONST:
+		case OP_I64_CONST: // codegen's i64 constants fit in an int
+			insn->imm = decode_sleb(p);
+			return true;
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_TEE_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_BRANCH:
+		case OP_BRANCH_IF:
+		case OP_CALL:
+		case OP_RETURN_CALL:
+			insn->imm = decode_uleb(p);
+			return true;
+		case OP_I32_LOAD:
+		case OP_I32_STORE:
+			insn->imm = decode_uleb(p);
+			insn->offset = decode_uleb(p);
+			return true;
+		case OP_BRANCH_TABLE: {
+			// Nothing looks into the labels, imm is their length in bytes
+			insn->offset = *p - Input;
+			for (unsigned int count = decode_uleb(p) + 1; count; --count)
+				decode_uleb(p);
+			insn->imm = *p - Input - insn->offset;
+			return true;
+		}
+		case OP_BLOCK:
+		case OP_LOOP:
+		case OP_IF:
+		case OP_MEMORY_SIZE:
+			insn->imm = *(*p)++;
+			return true;
+		case OP_UNREACHABLE:
+		case OP_ELSE:
+		case OP_END:
+		case OP_RETURN:
+		case OP_DROP:
+		case OP_SELECT:
+		case OP_I32_EQZ:
+		case OP_I64_MUL:
+		case OP_I64_SHR_S:
+		case OP_I32_WRAP_I64:
+		case OP_I64_EXTEND_I32_S:
+			return true;
+	}
+	return is_compare(insn->op) || (insn->op >= OP_I32_ADD && insn->op <= OP_I32_SHR_U);
+}
+
+static void encode(ByteBuffer *out, const Insn *insn) {
+	if (insn->op == OP_SIMD) {
+		emit_simd(out, insn->simd);
+		if (insn->simd == SIMD_V128_LOAD || insn->simd == SIMD_V128_STORE) {
+			emit_uleb(out, insn->imm);
+			emit_uleb(out, insn->offset);
+		} else if (insn->simd == SIMD_I32X4_EXTRACT_LANE) {
+			emit_byte(out, insn->imm);
+		}
+		return;
+	}
+	emit_byte(out, insn->op);
+	switch (insn->op) {
+		case OP_I32_CONST:
+		case OP_I64_CONST:
+			emit_sleb(out, insn->imm);
+			break;
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_TEE_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_BRANCH:
+		case OP_BRANCH_IF:
+			emit_uleb(out, insn->imm);
+			break;
+		case OP_CALL:
+		case OP_RETURN_CALL:
+			patch_slot(out, emit_slot(out), insn->imm);
+			break;
+		case OP_BRANCH_TABLE:
+			emit_bytes(out, Input + insn->offset, insn->imm);
+			break;
+		case OP_I32_LOAD:
+		case OP_I32_STORE:
+			emit_uleb(out, insn->imm);
+			emit_uleb(out, insn->offset);
+			break;
+		case OP_BLOCK:
+		case OP_LOOP:
+		case OP_IF:
+		case OP_MEMORY_SIZE:
+			emit_byte(out, insn->imm);
+			break;
+	}
+}
+
+static bool matches(const PeepholeRule *rule, const Insn *window) {
+	for (unsigned int i = 0; i < rule->length; ++i) {
+		if (rule->ops[i] != OP_ANY && rule->ops[i] != window[i].op)
+			return false;
+	}
+	return true;
+}
+
+// Applies rules to the top of the stack until none matches
+static unsigned int reduce(Insn *stack, unsigned int count) {
+	for (unsigned int i = 0; i < len(Rules); ++i) {
+		PeepholeRule *rule = Rules + i;
+		if (rule->length > count) continue;
+		Insn *window = stack + count - rule->length;
+		if (!matches(rule, window)) continue;
+		u8 length = rule->rewrite(window);
+		if (length == NO_MATCH) continue;
+		++rule->hits;
+		count -= rule->length - length;
+		i = -1;
+	}
+	return count;
+}
+
+void peephole(ByteBuffer *buffer, unsigned int body_start, unsigned int start, CallReloc *relocs, unsigned int reloc_count) {
+	arena_reset(&PeepholeArena);
+	Input = buffer->data;
+	const unsigned char *p = buffer->data + start;
+	const unsigned char *end = buffer->data + buffer->length;
+
+	// Every instruction is at least a byte long
+	Insn *stack = arena_push_array(&PeepholeArena, Insn, end - p);
+	unsigned int count = 0;
+	while (p < end) {
+		if (!decode(&p, stack + count))
+			return;
+		count = reduce(stack, count + 1);
+	}
+
+	ByteBuffer out = {&PeepholeArena};
+	buffer_reserve(&out, buffer->length - start);
+	unsigned int reloc = 0;
+	for (unsigned int i = 0; i < count; ++i) {
+		if ((stack[i].op == OP_CALL || stack[i].op == OP_RETURN_CALL) && reloc < reloc_count)
+			relocs[reloc++].offset = start - body_start + out.length + 1;
+		encode(&out, stack + i);
+	}
+
+	buffer->length = start;
+	emit_bytes(buffer, out.data, out.length);
+}
+
+void print_peephole_stats() {
+	for (unsigned int i = 0; i < len(Rules); ++i)
+		printf("%s: %u hits", Rules[i].name, Rules[i].hits);
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include "defines.h"
+#include "wasm_writer.h"
+#include "cache.h"
+
+// Windowed peephole pass over a function body's instructions, run on the
+// bytes codegen emitted before the body is cached. Rewrites only ever
+// shrink the stream and calls are never removed, so the relocations keep
+// their order and only their offsets are updated.
+
+// Rewrites buffer[start, buffer->length) in place, relocation offsets are
+// relative to body_start
+void peephole(ByteBuffer *buffer, unsigned int body_start, unsigned int start, CallReloc *relocs, unsigned int reloc_count);
+
+void print_peephole_stats();
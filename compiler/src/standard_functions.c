@@ -35,8 +35,10 @@ bool startswith(const char * restrict p, const char * restrict q) {
 #pragma GCC diagnostic ignored "-Wimplicit-function-declaration"
 int vprintf(const char *fmt, va_list ap) {
 	static char buffer[512] = {0};
+	// Output is truncated, leaving room for the longest number conversion
+	const unsigned int limit = len(buffer) - 12;
 	unsigned int b = 0;
-	for (unsigned int f = 0; fmt[f] && f < len(buffer); ++f) {
+	for (unsigned int f = 0; fmt[f] && b < limit; ++f) {
 		if (fmt[f] != '%') {
 			buffer[b++] = fmt[f];
 		} else {
@@ -44,7 +46,7 @@ int vprintf(const char *fmt, va_list ap) {
 			switch (fmt[f]) {
 				case 's': {
 					const char *str = va_arg(ap, const char *);
-					while (*str) buffer[b++] = *str++;
+					while (*str && b < limit) buffer[b++] = *str++;
 				} break;
 				case 'c': {
 					const char c = va_arg(ap, int);
@@ -158,6 +160,14 @@ unsigned int str_lu(char *str, char **end) {
 	return num;
 }
 
+void EncodeLEB128Padded(unsigned char *dst, unsigned int value) {
+	for (unsigned int i = 0; i < LEB128_PADDED_SIZE - 1; ++i) {
+		dst[i] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	dst[LEB128_PADDED_SIZE - 1] = value & 0x7F;
+}
+
 void verror_at(char *loc, char *fmt, va_list ap) {
 	vprintf(fmt, ap);
 }
@@ -3,6 +3,7 @@
 // TODO: Assertion functions
 #define memset(str, c, n) __builtin_memset(str, c, n)
 #define memcpy(dst, src, n) __builtin_memcpy(dst, src, n)
+#define memmove(dst, src, n) __builtin_memmove(dst, src, n)
 unsigned int strlen(const char *str);
 int strncmp(const char *str1, const char *str2, unsigned int num);
 bool startswith(const char *p, const char *q);
@@ -34,3 +35,8 @@ void error_tok(const Token *token, char *fmt, ...);
 	byte &= 0x7F;\
 	*(src - 1) = byte;\
 }
+
+// Unsigned LEB128 padded to a fixed width, so the value can be patched later
+// without moving the bytes after it
+#define LEB128_PADDED_SIZE 5
+void EncodeLEB128Padded(unsigned char *dst, unsigned int value);
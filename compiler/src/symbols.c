@@ -0,0 +1,63 @@
+#include "symbols.h"
+#include "standard_functions.h"
+#include "arena.h"
+
+#define SYMBOL_BUCKETS 256
+
+static Symbol *Buckets[SYMBOL_BUCKETS] = {0};
+static Arena SymbolArena = {"symbols"};
+
+void ResetSymbols() {
+	memset(Buckets, 0, sizeof(Buckets));
+	arena_reset(&SymbolArena);
+}
+
+// Symbols outlive a parse when the token stream is patched instead of
+// rebuilt, so every parse starts by unbinding them
+void ClearSymbolBindings() {
+	for (unsigned int i = 0; i < SYMBOL_BUCKETS; ++i) {
+		for (Symbol *sym = Buckets[i]; sym; sym = sym->next) {
+			sym->var = 0;
+			sym->func = 0;
+		}
+	}
+}
+
+// FNV-1a
+static unsigned int hash_name(const char *name, unsigned int len) {
+	unsigned int hash = 2166136261u;
+	for (unsigned int i = 0; i < len; ++i) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static Symbol *lookup(const char *name, unsigned int len, unsigned int hash) {
+	for (Symbol *sym = Buckets[hash & (SYMBOL_BUCKETS - 1)]; sym; sym = sym->next) {
+		if (sym->hash == hash && sym->len == len && !strncmp(sym->name, name, len))
+			return sym;
+	}
+	return 0;
+}
+
+Symbol *find_symbol(const char *name, unsigned int len) {
+	return lookup(name, len, hash_name(name, len));
+}
+
+Symbol *intern(const char *name, unsigned int len) {
+	unsigned int hash = hash_name(name, len);
+	Symbol *sym = lookup(name, len, hash);
+	if (sym) return sym;
+
+	sym = arena_push_struct(&SymbolArena, Symbol);
+	sym->name = arena_push(&SymbolArena, len + 1);
+	memcpy(sym->name, name, len);
+	sym->len = len;
+	sym->hash = hash;
+
+	Symbol **bucket = Buckets + (hash & (SYMBOL_BUCKETS - 1));
+	sym->next = *bucket;
+	*bucket = sym;
+	return sym;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "defines.h"
+
+typedef struct Symbol Symbol;
+typedef struct Obj Obj;
+typedef struct Function Function;
+
+// Interned identifier, every occurrence of a name in the source shares one
+// Symbol so the parser resolves names with a pointer load instead of a search
+struct Symbol {
+	Symbol *next; // hash bucket chain
+	char *name;
+	unsigned int len;
+	unsigned int hash;
+
+	Obj *var; // innermost local in scope with this name
+	Function *func; // function with this name
+};
+
+void ResetSymbols();
+void ClearSymbolBindings();
+Symbol *intern(const char *name, unsigned int len);
+Symbol *find_symbol(const char *name, unsigned int len);
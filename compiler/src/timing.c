@@ -0,0 +1,14 @@
+#include "timing.h"
+
+f64 PassTimes[PASS_COUNT];
+
+void reset_pass_times() {
+	for (unsigned int i = 0; i < PASS_COUNT; ++i)
+		PassTimes[i] = 0;
+}
+
+f64 end_pass(Pass pass, f64 start) {
+	f64 now = _now();
+	PassTimes[pass] += now - start;
+	return now;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "defines.h"
+
+// Time each pass of the last compile took, in milliseconds. The host reads
+// PassTimes through get_pass_times, in the order of Pass.
+
+typedef enum {
+	PASS_TOKENIZE,
+	PASS_PARSE,
+	PASS_OPTIMIZE, // the tree passes, inlining included
+	PASS_CODEGEN, // from the tree, and everything around the bodies
+	PASS_IR, // building, optimizing and emitting the SSA IR
+	PASS_PEEPHOLE,
+	PASS_COUNT,
+} Pass;
+
+extern f64 PassTimes[PASS_COUNT];
+
+// Milliseconds on the host's clock, imported
+f64 _now();
+
+void reset_pass_times();
+
+// Adds the time since start to pass and returns the time now, the start of
+// whatever runs next
+f64 end_pass(Pass pass, f64 start);
@@ -1,9 +1,14 @@
 #include "tokenize.h"
 #include "defines.h"
 #include "standard_functions.h"
+#include "arena.h"
 
-static Token AllTokens[512] = {0};
-static Token *_CurrentToken = AllTokens;
+static Arena TokenArena = {"tokens"};
+static Arena EditArena = {"tokens (edit)"};
+static Token *AllTokens = 0;
+static unsigned int TokenCount = 0;
+static unsigned int TokenCapacity = 0;
+static Token *_CurrentToken = 0;
 
 const Token *CurrentToken() {
 	return _CurrentToken;
@@ -13,6 +18,10 @@ const Token *NextToken() {
 	return ++_CurrentToken;
 }
 
+void SetCurrentToken(const Token *tok) {
+	_CurrentToken = (Token *)tok;
+}
+
 void ResetCurrentToken() {
 	_CurrentToken = AllTokens;
 }
@@ -27,23 +36,173 @@ static void print_token_type(Token t) {
 	}
 }
 
-static int read_punct(char *p) {
-	if (startswith(p, "==") || startswith(p, "!=") || startswith(p, "<=") || startswith(p, ">=")) {
-		return 2;
+static const char *TokenSpelling[TOKEN_ID_COUNT] = {
+	[KW_RETURN] = "return",
+	[KW_IF] = "if",
+	[KW_ELSE] = "else",
+	[KW_FOR] = "for",
+	[KW_WHILE] = "while",
+	[KW_INT] = "int",
+	[KW_SWITCH] = "switch",
+	[KW_CASE] = "case",
+	[KW_DEFAULT] = "default",
+	[KW_BREAK] = "break",
+
+	[PUNCT_ADD] = "+",
+	[PUNCT_SUB] = "-",
+	[PUNCT_MUL] = "*",
+	[PUNCT_DIV] = "/",
+	[PUNCT_MOD] = "%",
+	[PUNCT_LPAREN] = "(",
+	[PUNCT_RPAREN] = ")",
+	[PUNCT_LBRACE] = "{",
+	[PUNCT_RBRACE] = "}",
+	[PUNCT_LT] = "<",
+	[PUNCT_GT] = ">",
+	[PUNCT_LE] = "<=",
+	[PUNCT_GE] = ">=",
+	[PUNCT_EQ] = "==",
+	[PUNCT_NE] = "!=",
+	[PUNCT_SHL] = "<<",
+	[PUNCT_SHR] = ">>",
+	[PUNCT_ASSIGN] = "=",
+	[PUNCT_AMP] = "&",
+	[PUNCT_PIPE] = "|",
+	[PUNCT_CARET] = "^",
+	[PUNCT_LOGAND] = "&&",
+	[PUNCT_LOGOR] = "||",
+	[PUNCT_QUESTION] = "?",
+	[PUNCT_COLON] = ":",
+	[PUNCT_COMMA] = ",",
+	[PUNCT_SEMICOLON] = ";",
+};
+
+const char *TokenId_str(TokenId id) {
+	return TokenSpelling[id] ? TokenSpelling[id] : "";
+}
+
+// Perfect hashes, the constants were searched offline so that every keyword
+// and two character punctuator gets its own slot (with a spare slot for
+// continue). A collision shows up as an initializer override warning on
+// the tables below
+#define KEYWORD_HASH(first, last, len) (((first) + (last) * 13 + (len)) & 15)
+#define PUNCT2_HASH(a, b) ((((a) * 6 + (b) * 9) >> 3) & 15)
+
+static const TokenId KeywordTable[16] = {
+	[KEYWORD_HASH('r', 'n', 6)] = KW_RETURN,
+	[KEYWORD_HASH('i', 'f', 2)] = KW_IF,
+	[KEYWORD_HASH('e', 'e', 4)] = KW_ELSE,
+	[KEYWORD_HASH('f', 'r', 3)] = KW_FOR,
+	[KEYWORD_HASH('w', 'e', 5)] = KW_WHILE,
+	[KEYWORD_HASH('i', 't', 3)] = KW_INT,
+	[KEYWORD_HASH('s', 'h', 6)] = KW_SWITCH,
+	[KEYWORD_HASH('c', 'e', 4)] = KW_CASE,
+	[KEYWORD_HASH('d', 't', 7)] = KW_DEFAULT,
+	[KEYWORD_HASH('b', 'k', 5)] = KW_BREAK,
+};
+
+static const TokenId Punct2Table[16] = {
+	[PUNCT2_HASH('=', '=')] = PUNCT_EQ,
+	[PUNCT2_HASH('!', '=')] = PUNCT_NE,
+	[PUNCT2_HASH('<', '=')] = PUNCT_LE,
+	[PUNCT2_HASH('>', '=')] = PUNCT_GE,
+	[PUNCT2_HASH('<', '<')] = PUNCT_SHL,
+	[PUNCT2_HASH('>', '>')] = PUNCT_SHR,
+	[PUNCT2_HASH('&', '&')] = PUNCT_LOGAND,
+	[PUNCT2_HASH('|', '|')] = PUNCT_LOGOR,
+};
+
+static const TokenId Punct1Table[128] = {
+	['+'] = PUNCT_ADD,
+	['-'] = PUNCT_SUB,
+	['*'] = PUNCT_MUL,
+	['/'] = PUNCT_DIV,
+	['%'] = PUNCT_MOD,
+	['('] = PUNCT_LPAREN,
+	[')'] = PUNCT_RPAREN,
+	['{'] = PUNCT_LBRACE,
+	['}'] = PUNCT_RBRACE,
+	['<'] = PUNCT_LT,
+	['>'] = PUNCT_GT,
+	['='] = PUNCT_ASSIGN,
+	['&'] = PUNCT_AMP,
+	['|'] = PUNCT_PIPE,
+	['^'] = PUNCT_CARET,
+	['?'] = PUNCT_QUESTION,
+	[':'] = PUNCT_COLON,
+	[','] = PUNCT_COMMA,
+	[';'] = PUNCT_SEMICOLON,
+};
+
+static TokenId keyword_id(const char *s, unsigned int length) {
+	TokenId id = KeywordTable[KEYWORD_HASH(s[0], s[length - 1], length)];
+	if (!id) return TOKEN_ID_NONE;
+	const char *kw = TokenSpelling[id];
+	for (unsigned int i = 0; i < length; ++i) {
+		if (kw[i] != s[i]) return TOKEN_ID_NONE;
 	}
-	return is_punct(*p);
+	return kw[length] ? TOKEN_ID_NONE : id;
 }
 
-static Token *new_token(TokenKind kind, char *start, unsigned int length) {
-	Token *tok = _CurrentToken;
-	_CurrentToken += 1;
-	tok->kind = kind;
-	tok->loc = start;
-	tok->len = length;
-#if _DEBUG
-	print_token_type(*tok);
-#endif
-	return tok;
+static TokenId read_punct(const char *p) {
+	unsigned char c0 = p[0], c1 = p[1];
+	TokenId id = Punct2Table[PUNCT2_HASH(c0, c1)];
+	if (id && TokenSpelling[id][0] == c0 && TokenSpelling[id][1] == c1)
+		return id;
+	return (c0 < 128) ? Punct1Table[c0] : TOKEN_ID_NONE;
+}
+
+static bool UseSIMD = true;
+
+void SetTokenizerSIMD(bool enabled) {
+	UseSIMD = enabled;
+}
+
+// The SIMD scanners below load 16 bytes at a time and may read up to 15 bytes
+// past the null terminator, callers must pad the source buffer by SIMD_PADDING
+
+static char *skip_whitespace_simd(char *p) {
+	const v128_t space = wasm_i8x16_splat(' ');
+	const v128_t tab = wasm_i8x16_splat('\t');
+	const v128_t newline = wasm_i8x16_splat('\n');
+	const v128_t carriage_return = wasm_i8x16_splat('\r');
+	for (;;) {
+		v128_t v = wasm_v128_load(p);
+		v128_t ws = wasm_v128_or(
+			wasm_v128_or(wasm_i8x16_eq(v, space), wasm_i8x16_eq(v, tab)),
+			wasm_v128_or(wasm_i8x16_eq(v, newline), wasm_i8x16_eq(v, carriage_return))
+		);
+		unsigned int mask = wasm_i8x16_bitmask(ws) ^ 0xFFFF;
+		if (mask) return p + __builtin_ctz(mask);
+		p += 16;
+	}
+}
+
+static v128_t digit_mask(v128_t v) {
+	return wasm_u8x16_lt(wasm_i8x16_sub(v, wasm_i8x16_splat('0')), wasm_i8x16_splat(10));
+}
+
+static char *digit_end_simd(char *p) {
+	for (;;) {
+		unsigned int mask = wasm_i8x16_bitmask(digit_mask(wasm_v128_load(p))) ^ 0xFFFF;
+		if (mask) return p + __builtin_ctz(mask);
+		p += 16;
+	}
+}
+
+static char *ident_end_simd(char *p) {
+	for (;;) {
+		v128_t v = wasm_v128_load(p);
+		v128_t lower = wasm_v128_or(v, wasm_i8x16_splat(0x20));
+		v128_t alpha = wasm_u8x16_lt(wasm_i8x16_sub(lower, wasm_i8x16_splat('a')), wasm_i8x16_splat(26));
+		v128_t ident = wasm_v128_or(
+			wasm_v128_or(alpha, digit_mask(v)),
+			wasm_i8x16_eq(v, wasm_i8x16_splat('_'))
+		);
+		unsigned int mask = wasm_i8x16_bitmask(ident) ^ 0xFFFF;
+		if (mask) return p + __builtin_ctz(mask);
+		p += 16;
+	}
 }
 
 static bool is_ident1(char c) {
@@ -54,52 +213,147 @@ static bool is_ident2(char c) {
 	return is_ident1(c) || (c >= '0' && c <= '9');
 }
 
-static bool is_keyword(const char *c, const unsigned int c_len) {
-	static const char *kw[] = {"return", "if", "else", "for", "while", "int"};
-	for (int i = 0; i < len(kw); ++i) {
-		if (!strncmp(c, kw[i], strlen(kw[i])))
-			return true;
+static char *skip_whitespace(char *p) {
+	if (!is_whitespace(*p)) return p;
+	if (UseSIMD) return skip_whitespace_simd(p + 1);
+	do {
+		++p;
+	} while (is_whitespace(*p));
+	return p;
+}
+
+// Lexes the token starting at p, which must not be whitespace. Returns the
+// position after the token, or 0 on an invalid token
+static char *lex_token(char *p, Token *tok) {
+	tok->id = TOKEN_ID_NONE;
+	tok->loc = p;
+
+	if (!*p) {
+		tok->kind = TK_EOF;
+		tok->len = 0;
+	} else if (is_digit(*p)) {
+		tok->kind = TK_NUM;
+		char *q = p;
+		if (UseSIMD) {
+			unsigned int val = 0;
+			for (char *end = digit_end_simd(p + 1); p != end; ++p)
+				val = val * 10 + (*p - '0');
+			tok->val = val;
+		} else {
+			tok->val = str_lu(p, &p);
+		}
+		tok->len = p - q;
+	} else if ((tok->id = read_punct(p))) {
+		tok->kind = TK_PUNCT;
+		tok->len = TokenSpelling[tok->id][1] ? 2 : 1;
+		p += tok->len;
+	} else if (is_ident1(*p)) {
+		char *start = p;
+		if (UseSIMD) {
+			p = ident_end_simd(p + 1);
+		} else {
+			do {
+				++p;
+			} while (is_ident2(*p));
+		}
+		tok->len = p - start;
+		tok->id = keyword_id(start, tok->len);
+		tok->kind = tok->id ? TK_KEYWORD : TK_IDENTIFIER;
+		if (!tok->id)
+			tok->sym = intern(start, tok->len);
+	} else {
+		error_at(p, "invalid token %s, %s", __FILE_NAME__, p);
+		return 0;
 	}
-	return false;
+
+#if _DEBUG
+	print_token_type(*tok);
+#endif
+	return p;
 }
 
 Token *tokenize(char *p) {
-	memset(AllTokens, 0, sizeof(AllTokens));
+	// Every token is at least one byte long, so this bound can never overflow
+	arena_reset(&TokenArena);
+	TokenCapacity = strlen(p) + 1;
+	TokenCount = 0;
+	AllTokens = arena_push_array(&TokenArena, Token, TokenCapacity);
 	ResetCurrentToken();
-	while (*p) {
-		if (is_whitespace(*p)) {
-			p += 1;
-			continue;
-		}
+	ResetSymbols();
+	for (;;) {
+		Token *tok = AllTokens + TokenCount++;
+		p = lex_token(skip_whitespace(p), tok);
+		if (!p) return 0;
+		if (tok->kind == TK_EOF) return AllTokens;
+	}
+}
 
-		if (is_digit(*p)) {
-			Token *current = new_token(TK_NUM, p, 0);
-			char *q = p;
-			current->val = str_lu(p, &p);
-			current->len = p - q;
-			continue;
-		}
+// Index of the first token starting at or after pos
+static unsigned int token_lower_bound(const char *pos) {
+	unsigned int low = 0, high = TokenCount;
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+		if (AllTokens[mid].loc < pos)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
 
-		int punct_len = read_punct(p);
-		if (punct_len) {
-			new_token(TK_PUNCT, p, punct_len);
-			p += punct_len;
-			continue;
+Token *retokenize(char *text, unsigned int offset, unsigned int deleted_len, unsigned int inserted_len) {
+	// The token before the edit may grow into it (ab|c, <|=), so lexing
+	// restarts there. Old tokens starting past the deleted bytes are intact,
+	// only their location shifts by delta
+	unsigned int first = token_lower_bound(text + offset);
+	char *p = text + offset;
+	if (first) {
+		first -= 1;
+		p = AllTokens[first].loc;
+	}
+	unsigned int resync = token_lower_bound(text + offset + deleted_len);
+	int delta = (int)inserted_len - (int)deleted_len;
+
+	// Tokens depend only on the text from their first byte on, so once the
+	// lexer reaches an old token boundary past the edit the rest of the
+	// stream is unchanged. The old EOF token guarantees a boundary exists
+	arena_reset(&EditArena);
+	unsigned int capacity = inserted_len + 16;
+	Token *lexed = arena_push_array(&EditArena, Token, capacity);
+	unsigned int count = 0;
+	for (;;) {
+		p = skip_whitespace(p);
+		if (p >= text + offset + inserted_len) {
+			while (AllTokens[resync].loc + delta < p)
+				resync += 1;
+			if (AllTokens[resync].loc + delta == p)
+				break;
 		}
 
-		if (is_ident1(*p)) {
-			char *start = p;
-			do {
-				++p;
-			} while (is_ident2(*p));
-			unsigned int length = p - start;
-			new_token(is_keyword(start, length) ? TK_KEYWORD : TK_IDENTIFIER, start, length);
-			continue;
+		if (count == capacity) {
+			Token *grown = arena_push_array(&EditArena, Token, capacity * 2);
+			memcpy(grown, lexed, count * sizeof(Token));
+			lexed = grown;
+			capacity *= 2;
 		}
+		p = lex_token(p, lexed + count++);
+		if (!p) return 0;
+	}
 
-		error_at(p, "invalid token %s, %s", __FILE_NAME__, p);
-		return 0;
+	unsigned int new_count = TokenCount - (resync - first) + count;
+	Token *tokens = AllTokens;
+	if (new_count > TokenCapacity) {
+		TokenCapacity = new_count * 2;
+		tokens = arena_push_array(&TokenArena, Token, TokenCapacity);
+		memcpy(tokens, AllTokens, first * sizeof(Token));
 	}
-	new_token(TK_EOF, p, 0);
+	memmove(tokens + first + count, AllTokens + resync, (TokenCount - resync) * sizeof(Token));
+	for (unsigned int i = first + count; i < new_count; ++i)
+		tokens[i].loc += delta;
+	memcpy(tokens + first, lexed, count * sizeof(Token));
+
+	AllTokens = tokens;
+	TokenCount = new_count;
+	ResetCurrentToken();
 	return AllTokens;
 }
@@ -1,4 +1,6 @@
 #pragma once
+#include "defines.h"
+#include "symbols.h"
 
 typedef enum {
 	TK_EOF = 0,
@@ -8,16 +10,77 @@ typedef enum {
 	TK_NUM,
 } TokenKind;
 
+// Keyword and punctuator IDs, assigned by the tokenizer so the parser can
+// dispatch with integer switches instead of string compares
+typedef enum {
+	TOKEN_ID_NONE = 0,
+
+	KW_RETURN,
+	KW_IF,
+	KW_ELSE,
+	KW_FOR,
+	KW_WHILE,
+	KW_INT,
+	KW_SWITCH,
+	KW_CASE,
+	KW_DEFAULT,
+	KW_BREAK,
+
+	PUNCT_ADD,
+	PUNCT_SUB,
+	PUNCT_MUL,
+	PUNCT_DIV,
+	PUNCT_MOD,
+	PUNCT_LPAREN,
+	PUNCT_RPAREN,
+	PUNCT_LBRACE,
+	PUNCT_RBRACE,
+	PUNCT_LT,
+	PUNCT_GT,
+	PUNCT_LE,
+	PUNCT_GE,
+	PUNCT_EQ,
+	PUNCT_NE,
+	PUNCT_SHL,
+	PUNCT_SHR,
+	PUNCT_ASSIGN,
+	PUNCT_AMP,
+	PUNCT_PIPE,
+	PUNCT_CARET,
+	PUNCT_LOGAND,
+	PUNCT_LOGOR,
+	PUNCT_QUESTION,
+	PUNCT_COLON,
+	PUNCT_COMMA,
+	PUNCT_SEMICOLON,
+
+	TOKEN_ID_COUNT
+} TokenId;
+
 typedef struct Token Token;
 struct Token {
 	TokenKind kind;
-	unsigned int val;
+	TokenId id;
+	union {
+		unsigned int val; // TK_NUM
+		Symbol *sym; // TK_IDENTIFIER
+	};
 	char *loc;
 	unsigned int len;
 };
 
+// Bytes the tokenizer may read past the null terminator
+#define SIMD_PADDING 16
+
 Token *tokenize(char *p);
+// Patches the token stream after text[offset, offset + deleted_len) was
+// replaced by inserted_len bytes. text must already hold the edited source
+// and the stream must come from a successful tokenize or retokenize
+Token *retokenize(char *text, unsigned int offset, unsigned int deleted_len, unsigned int inserted_len);
+const char *TokenId_str(TokenId id);
+void SetTokenizerSIMD(bool enabled);
 
 const Token *CurrentToken();
 const Token *NextToken();
+void SetCurrentToken(const Token *tok);
 void ResetCurrentToken();
@@ -0,0 +1,508 @@
+#include "vectorize.h"
+
+// Loop vectorization. A counted loop
+//
+//     for (init; i < n; i = i + 1) { statements }
+//
+// whose statements each store to or accumulate elements indexed by i becomes
+//
+//     init;
+//     limit = n - 3;
+//     if (limit < n && the elements do not overlap) {
+//         for (; i < limit; i = i + 4) { the statements, on four lanes }
+//         the lanes of each accumulator combined into its variable
+//     }
+//     for (; i < n; i = i + 1) { statements }
+//
+// so the original loop does what is left over. The statements are
+//
+//     *(p + i) = E;                    a store
+//     s = s + E;  s = s - E;           a sum
+//     s = s < E ? E : s;               a maximum or minimum, with any of the
+//     if (E > s) s = E;                comparisons and operand orders
+//
+// where E only reads elements *(q + i + c), numbers and variables the loop
+// does not assign, combined by + - * & | ^, negation, comparisons and
+// shifts by an invariant count. An element is base + i * 4 plus a constant,
+// the way new_add scales i, with a base the loop does not assign. n is an
+// invariant expression that cannot trap, s is only used by its statement.
+//
+// The vector loop does a statement for four elements before the next one,
+// which only gives the same result when no element that is stored is also
+// read or stored in another lane. Two elements with the same base are
+// checked here, other pairs before the vector loop: their addresses have to
+// be the same or 16 bytes apart at least. Addition wraps, so the sums come
+// out the same in any order, and so do the maximum and minimum
+
+#define VECTOR_LANES 4
+#define MAX_STREAMS 8
+#define MAX_STATEMENTS 8
+
+// The elements base + i * 4 + offset
+typedef struct Stream Stream;
+struct Stream {
+	Obj *base;
+	int offset;
+	bool stored;
+};
+
+typedef struct Statement Statement;
+struct Statement {
+	u8 kind; // ND_DEREF for a store, ND_ADD, ND_SUB, ND_MAX or ND_MIN
+	Stream *stream; // Stored to
+	Obj *var; // Accumulated into
+	Obj *lanes; // The v128 accumulator
+	NodeId value;
+};
+
+static Obj *Index;
+static Stream Streams[MAX_STREAMS];
+static unsigned int StreamCount;
+static Statement Statements[MAX_STATEMENTS];
+static unsigned int StatementCount;
+
+#define is_num(id) (N(id)->kind == ND_NUM)
+#define is_var(id, v) (N(id)->kind == ND_VAR && N(id)->var == (v))
+
+static bool is_accumulated(const Obj *var) {
+	for (unsigned int i = 0; i < StatementCount; ++i) {
+		if (Statements[i].var == var) return true;
+	}
+	return false;
+}
+
+// A local the loop does not assign, the increment only assigns the index
+static bool is_invariant_var(const Obj *var) {
+	return !var->escapes && var != Index && !is_accumulated(var) && var->type != &TypeV128;
+}
+
+static bool is_invariant(NodeId id) {
+	const Node *node = N(id);
+	switch (node->kind) {
+		case ND_NUM:
+			return true;
+		case ND_VAR:
+			return is_invariant_var(node->var);
+		case ND_NEG:
+			return is_invariant(node->lhs);
+		case ND_ADD:
+		case ND_SUB:
+		case ND_MUL:
+		case ND_SHL:
+		case ND_SHR:
+		case ND_BITAND:
+		case ND_BITOR:
+		case ND_BITXOR:
+			return is_invariant(node->lhs) && is_invariant(node->rhs);
+	}
+	return false;
+}
+
+// Invariant expressions are used again outside the loop
+static NodeId copy_invariant(NodeId id) {
+	const Node *node = N(id);
+	switch (node->kind) {
+		case ND_NUM:
+			return new_num(node->val);
+		case ND_VAR:
+			return new_variable(node->var);
+		case ND_NEG:
+			return new_unary(ND_NEG, copy_invariant(node->lhs));
+	}
+	NodeKind kind = node->kind;
+	NodeId rhs = N(id)->rhs;
+	NodeId lhs = copy_invariant(N(id)->lhs);
+	return new_binary(kind, lhs, copy_invariant(rhs));
+}
+
+static bool same_tree(NodeId a, NodeId b) {
+	if (!a || !b) return a == b;
+	const Node *x = N(a), *y = N(b);
+	if (x->kind != y->kind) return false;
+	switch (x->kind) {
+		case ND_NUM:
+			return x->val == y->val;
+		case ND_VAR:
+			return x->var == y->var;
+		case ND_COND:
+		case ND_FUNCCALL:
+		case ND_BLOCK:
+		case ND_IF:
+		case ND_FOR:
+			return false;
+	}
+	return same_tree(x->lhs, y->lhs) && same_tree(x->rhs, y->rhs);
+}
+
+// i * 4 or 4 * i
+static bool is_scaled_index(NodeId id) {
+	const Node *node = N(id);
+	if (node->kind != ND_MUL) return false;
+	return (is_var(node->lhs, Index) && is_num(node->rhs) && N(node->rhs)->val == VECTOR_LANES)
+		|| (is_var(node->rhs, Index) && is_num(node->lhs) && N(node->lhs)->val == VECTOR_LANES);
+}
+
+// base + i * 4, optionally plus or minus a constant
+static Stream *find_stream(NodeId address) {
+	const Node *node = N(address);
+	unsigned int offset = 0;
+	if ((node->kind == ND_ADD || node->kind == ND_SUB) && is_num(node->rhs)) {
+		offset = N(node->rhs)->val;
+		if (node->kind == ND_SUB)
+			offset = -offset;
+		node = N(node->lhs);
+	}
+	if (node->kind != ND_ADD) return 0;
+	NodeId base;
+	if (is_scaled_index(node->rhs))
+		base = node->lhs;
+	else if (is_scaled_index(node->lhs))
+		base = node->rhs;
+	else
+		return 0;
+	if (N(base)->kind != ND_VAR || N(base)->var->escapes || N(base)->var == Index) return 0;
+
+	Obj *var = N(base)->var;
+	for (unsigned int i = 0; i < StreamCount; ++i) {
+		if (Streams[i].base == var && Streams[i].offset == (int)offset)
+			return Streams + i;
+	}
+	if (StreamCount == MAX_STREAMS) return 0;
+	Streams[StreamCount] = (Stream){var, offset, false};
+	return Streams + StreamCount++;
+}
+
+// Whether E can be computed on four lanes at once
+static bool is_widenable(NodeId id) {
+	const Node *node = N(id);
+	switch (node->kind) {
+		case ND_NUM:
+			return true;
+		case ND_VAR:
+			return is_invariant_var(node->var);
+		case ND_DEREF:
+			return find_stream(node->lhs) != 0;
+		case ND_NEG:
+			return is_widenable(node->lhs);
+		case ND_SHL:
+		case ND_SHR:
+			return is_widenable(node->lhs) && is_invariant(node->rhs);
+		case ND_ADD:
+		case ND_SUB:
+		case ND_MUL:
+		case ND_BITAND:
+		case ND_BITOR:
+		case ND_BITXOR:
+		case ND_EQ:
+		case ND_NE:
+		case ND_LT:
+		case ND_LE:
+		case ND_GT:
+		case ND_GE:
+			return is_widenable(node->lhs) && is_widenable(node->rhs);
+	}
+	return false;
+}
+
+static bool is_comparison(NodeKind kind) {
+	return kind == ND_LT || kind == ND_LE || kind == ND_GT || kind == ND_GE;
+}
+
+// cond ? picked : other, where cond compares s and the value. Returns
+// ND_MAX or ND_MIN and sets *value, which stays 0 for anything else
+static NodeKind select_kind(NodeId cond, NodeId picked, NodeId other, Obj *var, NodeId *value) {
+	const Node *node = N(cond);
+	if (!is_comparison(node->kind)) return 0;
+	NodeId lhs = node->lhs, rhs = node->rhs;
+	NodeId expr = is_var(lhs, var) ? rhs : lhs;
+	if (!is_var(lhs, var) && !is_var(rhs, var)) return 0;
+	bool picks_value = same_tree(picked, expr) && is_var(other, var);
+	bool picks_var = is_var(picked, var) && same_tree(other, expr);
+	if (!picks_value && !picks_var) return 0;
+	*value = expr;
+	// Picking the lhs when lhs > rhs keeps the larger one
+	bool picks_lhs = same_tree(picked, lhs);
+	bool greater = node->kind == ND_GT || node->kind == ND_GE;
+	return picks_lhs == greater ? ND_MAX : ND_MIN;
+}
+
+static bool add_statement(NodeId id) {
+	if (StatementCount == MAX_STATEMENTS) return false;
+	Statement *stmt = Statements + StatementCount;
+	*stmt = (Statement){0};
+	const Node *node = N(id);
+
+	if (node->kind == ND_IF) {
+		// if (cmp(E, s)) s = E;
+		NodeId then = node->rhs;
+		if (node->els || !then) return false;
+		if (N(then)->kind == ND_BLOCK) {
+			then = N(then)->lhs;
+			if (!then || N(then)->next) return false;
+		}
+		const Node *assign = N(then);
+		if (assign->kind != ND_ASSIGN || N(assign->lhs)->kind != ND_VAR) return false;
+		stmt->var = N(assign->lhs)->var;
+		stmt->kind = select_kind(node->lhs, assign->rhs, assign->lhs, stmt->var, &stmt->value);
+	} else if (node->kind == ND_ASSIGN && N(node->lhs)->kind == ND_DEREF) {
+		stmt->kind = ND_DEREF;
+		stmt->stream = find_stream(N(node->lhs)->lhs);
+		if (!stmt->stream) return false;
+		stmt->stream->stored = true;
+		stmt->value = node->rhs;
+	} else if (node->kind == ND_ASSIGN && N(node->lhs)->kind == ND_VAR) {
+		Obj *var = N(node->lhs)->var;
+		const Node *rhs = N(node->rhs);
+		stmt->var = var;
+		if (rhs->kind == ND_ADD && is_var(rhs->lhs, var)) {
+			stmt->kind = ND_ADD;
+			stmt->value = rhs->rhs;
+		} else if (rhs->kind == ND_ADD && is_var(rhs->rhs, var)) {
+			stmt->kind = ND_ADD;
+			stmt->value = rhs->lhs;
+		} else if (rhs->kind == ND_SUB && is_var(rhs->lhs, var)) {
+			stmt->kind = ND_SUB;
+			stmt->value = rhs->rhs;
+		} else if (rhs->kind == ND_COND) {
+			stmt->kind = select_kind(rhs->lhs, rhs->rhs, rhs->els, var, &stmt->value);
+		}
+	}
+	if (!stmt->value) return false;
+	if (stmt->var && (stmt->var->escapes || stmt->var == Index || is_accumulated(stmt->var)))
+		return false;
+	StatementCount += 1;
+	return true;
+}
+
+static NodeId element_address(const Stream *stream) {
+	NodeId index = new_binary(ND_MUL, new_variable(Index), new_num(VECTOR_LANES));
+	NodeId address = new_binary(ND_ADD, new_variable(stream->base), index);
+	return stream->offset ? new_binary(ND_ADD, address, new_num(stream->offset)) : address;
+}
+
+static NodeId vector_load(NodeId address) {
+	NodeId load = new_binary(ND_DEREF, address, 0);
+	N(load)->type = &TypeV128;
+	return load;
+}
+
+// E on four lanes. Comparisons give all ones where they hold, negated that
+// is the 1 the scalar comparison gives
+static NodeId widen(NodeId id) {
+	const Node *node = N(id);
+	NodeKind kind = node->kind;
+	NodeId lhs = node->lhs, rhs = node->rhs;
+	switch (kind) {
+		case ND_NUM:
+		case ND_VAR:
+			return new_unary(ND_SPLAT, kind == ND_NUM ? new_num(node->val) : new_variable(node->var));
+		case ND_DEREF:
+			return vector_load(element_address(find_stream(lhs)));
+		case ND_NEG:
+			return new_unary(ND_NEG, widen(lhs));
+		case ND_SHL:
+		case ND_SHR: {
+			NodeId value = widen(lhs);
+			return new_binary(kind, value, copy_invariant(rhs));
+		}
+	}
+	NodeId a = widen(lhs);
+	NodeId b = widen(rhs);
+	NodeId result = new_binary(kind, a, b);
+	return is_comparison(kind) || kind == ND_EQ || kind == ND_NE ? new_unary(ND_NEG, result) : result;
+}
+
+static void append(NodeId *head, NodeId *tail, NodeId node) {
+	if (*tail)
+		N(*tail)->next = node;
+	else
+		*head = node;
+	*tail = node;
+}
+
+static NodeId new_block(NodeId statements) {
+	NodeId block = new_node(ND_BLOCK);
+	N(block)->lhs = statements;
+	return block;
+}
+
+static NodeId assign(Obj *var, NodeId value) {
+	return new_binary(ND_ASSIGN, new_variable(var), value);
+}
+
+static NodeId lane(Obj *var, int index) {
+	NodeId node = new_unary(ND_LANE, new_variable(var));
+	N(node)->val = index;
+	return node;
+}
+
+// a - b == 0 || a - b > 15 || a - b < -15 for the addresses of two streams
+static NodeId no_overlap(const Stream *a, const Stream *b) {
+	NodeId condition = 0;
+	NodeKind kinds[] = {ND_EQ, ND_GT, ND_LT};
+	int bounds[] = {0, VECTOR_LANES * 4 - 1, -(VECTOR_LANES * 4 - 1)};
+	for (int i = 0; i < 3; ++i) {
+		NodeId distance = new_binary(ND_SUB, new_variable(a->base), new_variable(b->base));
+		if (a->offset != b->offset)
+			distance = new_binary(ND_ADD, distance, new_num((unsigned int)a->offset - b->offset));
+		NodeId test = new_binary(kinds[i], distance, new_num(bounds[i]));
+		condition = condition ? new_binary(ND_LOGOR, condition, test) : test;
+	}
+	return condition;
+}
+
+// Checks the pairs with one stream stored. Returns false when two streams
+// with the same base overlap, otherwise the runtime checks go into *guard,
+// which stays 0 when there are none
+static bool check_overlap(NodeId *guard) {
+	for (unsigned int i = 0; i < StreamCount; ++i) {
+		for (unsigned int j = i + 1; j < StreamCount; ++j) {
+			const Stream *a = Streams + i, *b = Streams + j;
+			if (!a->stored && !b->stored) continue;
+			if (a->base == b->base) {
+				long long distance = (long long)a->offset - b->offset;
+				if (distance < VECTOR_LANES * 4 && distance > -VECTOR_LANES * 4) return false;
+				continue;
+			}
+			NodeId check = no_overlap(a, b);
+			*guard = *guard ? new_binary(ND_LOGAND, *guard, check) : check;
+		}
+	}
+	return true;
+}
+
+static NodeId vector_statement(const Statement *stmt) {
+	NodeId value = widen(stmt->value);
+	if (stmt->kind == ND_DEREF) {
+		NodeId target = vector_load(element_address(stmt->stream));
+		return new_binary(ND_ASSIGN, target, value);
+	}
+	return assign(stmt->lanes, new_binary(stmt->kind, new_variable(stmt->lanes), value));
+}
+
+// Folds the lanes of an accumulator into its variable. The lanes of s = s - E
+// start at 0 and already hold minus the sum of E, so they are added too
+static void combine_lanes(Function *fn, const Statement *stmt, NodeId *head, NodeId *tail) {
+	if (stmt->kind == ND_ADD || stmt->kind == ND_SUB) {
+		NodeId sum = new_variable(stmt->var);
+		for (int i = 0; i < VECTOR_LANES; ++i)
+			sum = new_binary(ND_ADD, sum, lane(stmt->lanes, i));
+		append(head, tail, assign(stmt->var, sum));
+		return;
+	}
+	Obj *tmp = new_temp_lvar(fn, 0);
+	NodeKind kind = stmt->kind == ND_MAX ? ND_GT : ND_LT;
+	for (int i = 0; i < VECTOR_LANES; ++i) {
+		append(head, tail, assign(tmp, lane(stmt->lanes, i)));
+		NodeId select = new_node(ND_COND);
+		NodeId cond = new_binary(kind, new_variable(stmt->var), new_variable(tmp));
+		NodeId picked = new_variable(stmt->var);
+		NodeId other = new_variable(tmp);
+		N(select)->lhs = cond;
+		N(select)->rhs = picked;
+		N(select)->els = other;
+		add_type(select);
+		append(head, tail, assign(stmt->var, select));
+	}
+}
+
+NodeId vectorize_loop(Function *fn, NodeId loop, NodeId *vector_loop) {
+	*vector_loop = 0;
+	const Node *node = N(loop);
+	NodeId clauses = node->clauses;
+	NodeId cond = node->lhs, body = node->rhs, increment = N(clauses)->rhs;
+	if (!cond || !body || !increment) return loop;
+
+	// i = i + 1
+	const Node *inc = N(increment);
+	if (inc->kind != ND_ASSIGN || N(inc->lhs)->kind != ND_VAR) return loop;
+	Index = N(inc->lhs)->var;
+	const Node *step = N(inc->rhs);
+	if (Index->escapes || step->kind != ND_ADD || !is_var(step->lhs, Index) || !is_num(step->rhs) || N(step->rhs)->val != 1)
+		return loop;
+
+	StreamCount = StatementCount = 0;
+	NodeId statements = N(body)->kind == ND_BLOCK ? N(body)->lhs : body;
+	if (!statements) return loop;
+	for (NodeId id = statements; id; id = N(id)->next) {
+		if (!add_statement(id)) return loop;
+		// A lone statement is not in a list
+		if (id == body) break;
+	}
+	for (unsigned int i = 0; i < StatementCount; ++i) {
+		if (!is_widenable(Statements[i].value)) return loop;
+	}
+	for (unsigned int i = 0; i < StreamCount; ++i) {
+		if (!is_invariant_var(Streams[i].base)) return loop;
+	}
+
+	// i < n or n > i
+	const Node *test = N(cond);
+	NodeId bound;
+	if (test->kind == ND_LT && is_var(test->lhs, Index))
+		bound = test->rhs;
+	else if (test->kind == ND_GT && is_var(test->rhs, Index))
+		bound = test->lhs;
+	else
+		return loop;
+	if (!is_invariant(bound)) return loop;
+
+	NodeId guard = 0;
+	if (!check_overlap(&guard)) return loop;
+
+	Obj *limit = new_temp_lvar(fn, 0);
+	NodeId head = 0, tail = 0;
+	NodeId init = N(clauses)->lhs;
+	N(clauses)->lhs = 0;
+	if (init) {
+		N(init)->next = 0;
+		append(&head, &tail, init);
+	}
+	// An expression as the bound is computed once for both checks
+	if (!is_num(bound) && N(bound)->kind != ND_VAR) {
+		Obj *tmp = new_temp_lvar(fn, 0);
+		append(&head, &tail, assign(tmp, copy_invariant(bound)));
+		bound = new_variable(tmp);
+	}
+	append(&head, &tail, assign(limit, new_binary(ND_SUB, copy_invariant(bound), new_num(VECTOR_LANES - 1))));
+	// n - 3 must not wrap around
+	NodeId in_range = new_binary(ND_LT, new_variable(limit), copy_invariant(bound));
+	guard = guard ? new_binary(ND_LOGAND, in_range, guard) : in_range;
+
+	NodeId vector_head = 0, vector_tail = 0;
+	NodeId body_head = 0, body_tail = 0;
+	for (unsigned int i = 0; i < StatementCount; ++i) {
+		Statement *stmt = Statements + i;
+		if (stmt->var) {
+			stmt->lanes = new_temp_lvar(fn, &TypeV128);
+			NodeId start = stmt->kind == ND_MAX || stmt->kind == ND_MIN ? new_variable(stmt->var) : new_num(0);
+			append(&vector_head, &vector_tail, assign(stmt->lanes, new_unary(ND_SPLAT, start)));
+		}
+		append(&body_head, &body_tail, vector_statement(stmt));
+	}
+
+	NodeId vectorized = new_node(ND_FOR);
+	NodeId vector_clauses = new_node(ND_FOR_CLAUSES);
+	NodeId vector_increment = assign(Index, new_binary(ND_ADD, new_variable(Index), new_num(VECTOR_LANES)));
+	NodeId vector_cond = new_binary(ND_LT, new_variable(Index), new_variable(limit));
+	NodeId vector_body = new_block(body_head);
+	N(vector_clauses)->rhs = vector_increment;
+	N(vectorized)->clauses = vector_clauses;
+	N(vectorized)->lhs = vector_cond;
+	N(vectorized)->rhs = vector_body;
+	append(&vector_head, &vector_tail, vectorized);
+	for (unsigned int i = 0; i < StatementCount; ++i) {
+		if (Statements[i].var)
+			combine_lanes(fn, Statements + i, &vector_head, &vector_tail);
+	}
+
+	NodeId guarded = new_node(ND_IF);
+	NodeId vector_block = new_block(vector_head);
+	N(guarded)->lhs = guard;
+	N(guarded)->rhs = vector_block;
+	append(&head, &tail, guarded);
+	N(loop)->next = 0;
+	append(&head, &tail, loop);
+	*vector_loop = vectorized;
+	return new_block(head);
+}
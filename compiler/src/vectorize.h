@@ -0,0 +1,9 @@
+#pragma once
+#include "codegen.h"
+
+// Turns a counted ND_FOR into a loop that does four iterations at a time
+// with v128 instructions, followed by the loop itself for what is left.
+// Returns the node to use instead of loop and sets *vector_loop to the new
+// loop, or returns loop and sets it to 0 when the loop is not one the
+// vectorizer handles
+NodeId vectorize_loop(Function *fn, NodeId loop, NodeId *vector_loop);
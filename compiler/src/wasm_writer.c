@@ -0,0 +1,65 @@
+#include "wasm_writer.h"
+#include "standard_functions.h"
+
+#define BUFFER_MIN_CAPACITY 1024
+
+void buffer_reset(ByteBuffer *buffer) {
+	arena_reset(buffer->arena);
+	buffer->data = 0;
+	buffer->length = 0;
+	buffer->capacity = 0;
+}
+
+// Doubles the buffer, old copies stay in the arena until the next reset
+void buffer_reserve(ByteBuffer *buffer, unsigned int extra) {
+	if (buffer->length + extra <= buffer->capacity) return;
+	unsigned int capacity = buffer->capacity ? buffer->capacity * 2 : BUFFER_MIN_CAPACITY;
+	while (capacity < buffer->length + extra) capacity *= 2;
+	unsigned char *data = arena_push(buffer->arena, capacity);
+	if (buffer->length)
+		memcpy(data, buffer->data, buffer->length);
+	buffer->data = data;
+	buffer->capacity = capacity;
+}
+
+void emit_bytes(ByteBuffer *buffer, const void *bytes, unsigned int length) {
+	buffer_reserve(buffer, length);
+	memcpy(buffer->data + buffer->length, bytes, length);
+	buffer->length += length;
+}
+
+void emit_uleb(ByteBuffer *buffer, unsigned int value) {
+	buffer_reserve(buffer, LEB128_PADDED_SIZE);
+	do {
+		u8 byte = value & 0x7F;
+		value >>= 7;
+		buffer->data[buffer->length++] = value ? byte | 0x80 : byte;
+	} while (value);
+}
+
+void emit_sleb(ByteBuffer *buffer, int x) {
+	buffer_reserve(buffer, LEB128_PADDED_SIZE);
+	unsigned int written = 0;
+	EncodeLEB128(buffer->data + buffer->length, x, written);
+	buffer->length += written;
+}
+
+unsigned int emit_slot(ByteBuffer *buffer) {
+	buffer_reserve(buffer, LEB128_PADDED_SIZE);
+	unsigned int slot = buffer->length;
+	buffer->length += LEB128_PADDED_SIZE;
+	return slot;
+}
+
+void patch_slot(ByteBuffer *buffer, unsigned int slot, unsigned int value) {
+	EncodeLEB128Padded(buffer->data + slot, value);
+}
+
+unsigned int begin_section(ByteBuffer *buffer, u8 id) {
+	emit_byte(buffer, id);
+	return emit_slot(buffer);
+}
+
+void end_section(ByteBuffer *buffer, unsigned int slot) {
+	patch_slot(buffer, slot, buffer->length - slot - LEB128_PADDED_SIZE);
+}
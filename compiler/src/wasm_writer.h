@@ -0,0 +1,44 @@
+#pragma once
+#include "defines.h"
+#include "arena.h"
+
+// Growable byte buffer for the output module. Sizes that are only known
+// after their contents are written (sections, function bodies) get a
+// LEB128_PADDED_SIZE wide slot that is patched once the contents are done,
+// so nothing ever has to be moved.
+
+typedef struct ByteBuffer ByteBuffer;
+struct ByteBuffer {
+	Arena *arena;
+	unsigned char *data;
+	unsigned int length;
+	unsigned int capacity;
+};
+
+void buffer_reset(ByteBuffer *buffer);
+// Makes room for at least extra more bytes, data may move
+void buffer_reserve(ByteBuffer *buffer, unsigned int extra);
+
+static inline void emit_byte(ByteBuffer *buffer, u8 byte) {
+	if (buffer->length == buffer->capacity)
+		buffer_reserve(buffer, 1);
+	buffer->data[buffer->length++] = byte;
+}
+
+void emit_bytes(ByteBuffer *buffer, const void *bytes, unsigned int length);
+void emit_uleb(ByteBuffer *buffer, unsigned int value);
+void emit_sleb(ByteBuffer *buffer, int value);
+
+// A SimdOpCode behind its prefix
+static inline void emit_simd(ByteBuffer *buffer, u8 op) {
+	emit_byte(buffer, OP_SIMD);
+	emit_uleb(buffer, op);
+}
+
+// Reserves a padded LEB128 slot, returns its offset for patch_slot
+unsigned int emit_slot(ByteBuffer *buffer);
+void patch_slot(ByteBuffer *buffer, unsigned int slot, unsigned int value);
+
+// Sections and function bodies are prefixed with their size in bytes
+unsigned int begin_section(ByteBuffer *buffer, u8 id);
+void end_section(ByteBuffer *buffer, unsigned int slot);
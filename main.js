@@ -1,6 +1,7 @@
 import compiler from "./compiler.js"
 
 const ENABLE_TEST_CASES = 1;
+const ENABLE_BENCHMARKS = 0;
 
 const editor = document.getElementById("editor");
 const compile_button = document.getElementById("compile_button");
@@ -9,13 +10,26 @@ const wasm_exp_button = document.getElementById("wasm_explorer");
 let program = null;
 let binary = null;
 
+// Optimization levels of compile and edit, OptLevel in compiler/src/optimize.h
+const O0 = 0, O1 = 1, O2 = 2;
+
+// return_call is part of the tail call proposal, which older engines reject
+const tailCallProbe = new Uint8Array([0, 97, 115, 109, 1, 0, 0, 0, 1, 4, 1, 96, 0, 0, 3, 2, 1, 0, 10, 6, 1, 4, 0, 18, 0, 11]);
+compiler.set_tail_calls(WebAssembly.validate(tailCallProbe));
+
+// Order of Pass in compiler/src/timing.h
+const passNames = ["tokenize", "parse", "optimize", "codegen", "ir", "peephole"];
+
 let timeoutId = 0;
+// Typing only needs the code to be checked, so it compiles without optimizations
 editor.oninput = async () => {
-	program = await compile(editor.value);
+	program = await update(editor.value, O0);
 }
 // await editor.oninput();
 
-compile_button.onclick = () => {
+compile_button.onclick = async () => {
+	program = await compile(editor.value, O2);
+	if (!program) return;
 	const result = program.main();
 	console.log(result);
 }
@@ -45,15 +59,53 @@ wasm_explorer.onclick = async () => {
 	}
 }
 
-async function compile(value) {
-	const encoder = new TextEncoder('utf-8');
-	const view = new Uint8Array(compiler.memory.buffer, compiler.get_mem_addr(), 1024);
+const encoder = new TextEncoder('utf-8');
+
+// Source the compiler currently holds, null when the next change needs a full compile.
+// Edits are sent as byte offsets, so only ASCII sources take the incremental path
+let compiledSource = null;
+const isAscii = /^[\x00-\x7F]*$/;
+
+async function compile(value, level = O2) {
+	const view = new Uint8Array(compiler.memory.buffer, compiler.get_mem_addr(), compiler.get_mem_size());
+
+	const start = performance.now();
+	const { written } = encoder.encodeInto(value, view);
+	view[written] = 0;
+	compiledSource = isAscii.test(value) ? value : null;
+
+	return instantiate(compiler.compile(level), start);
+}
+
+// Sends only the changed span to the compiler, which re-lexes the tokens around it
+async function update(value, level) {
+	const previous = compiledSource;
+	if (previous === null)
+		return compile(value, level);
 
 	const start = performance.now();
-	encoder.encodeInto(value, view);
-	view[value.length] = 0;
+	const common = Math.min(previous.length, value.length);
+	let prefix = 0;
+	while (prefix < common && previous.charCodeAt(prefix) == value.charCodeAt(prefix))
+		++prefix;
+	let suffix = 0;
+	while (suffix < common - prefix && previous.charCodeAt(previous.length - 1 - suffix) == value.charCodeAt(value.length - 1 - suffix))
+		++suffix;
+
+	const inserted = value.slice(prefix, value.length - suffix);
+	if (inserted.length > compiler.get_edit_size() || !isAscii.test(inserted))
+		return compile(value, level);
+
+	encoder.encodeInto(inserted, new Uint8Array(compiler.memory.buffer, compiler.get_edit_addr(), inserted.length));
+	const len = compiler.edit(prefix, previous.length - prefix - suffix, inserted.length, level);
+	if (len < 0)
+		return compile(value, level);
+	compiledSource = value;
 
-	const len = compiler.compile();
+	return instantiate(len, start);
+}
+
+async function instantiate(len, start) {
 	if (len == 0) {
 		console.log("== Compilation Failed == ");
 		return;
@@ -66,6 +118,9 @@ async function compile(value) {
 	const { instance } = await WebAssembly.instantiate(binary);
 	const webAssemblyToX86 = performance.now();
 	console.log("Compilation to WebAssembly -- %.3fms", compilationToWebAssembly - start);
+	const passTimes = new Float64Array(compiler.memory.buffer, compiler.get_pass_times(), compiler.get_pass_count());
+	for (let i = 0; i < passTimes.length; ++i)
+		console.log("    %s -- %.3fms", passNames[i], passTimes[i]);
 	console.log("WebAssembly to x86 -- %.3fms", webAssemblyToX86 - compilationToWebAssembly);
 	console.log("Total Time -- %.3fms", webAssemblyToX86 - start);
 	console.log("== Compilation Successful == ");
@@ -121,35 +176,381 @@ if (ENABLE_TEST_CASES) {
 		['int main() { return simpleFunction(); }\n int simpleFunction() { return 89; }', 89],
 		['int main() { return twoPlusTwo() + 1; } int twoPlusTwo() { return 2 + 2; }', 5],
 		['int twoPlusTwo() { return 2 + 2; } int main() { return twoPlusTwo() + 1; }', 5],
-		// ['{ return add(1, 2); }', 3],
-		// ['{ return sub(10, 5); }', 5],
-		// ['{ return add(ret15(), 2); }', 17],
-		// ['{ return add(add(5, 5), sub(10, 8)); }', 12],
+		['int main() {\n\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t int a_very_long_variable_name_0123 = 1234567;\n\treturn a_very_long_variable_name_0123 - 1234560; }', 7],
+		['int main() { int integer = 4; int returned = 3; int iffy = 2; return integer + returned - iffy; }', 5],
+		['int main() { int a = 1; { int a = 2; a = a + 5; } return a; }', 1],
+		['int main() { int x = 3; { int y = 4; x = x + y; } { int y = 10; x = x + y; } return x; }', 17],
+		['int main() { int x = 5; int *p = &x; return *(p + 1 - 1); }', 5],
+		['int main() { int x = 5; int *p = &x; int *q = p + 2; return q - p; }', 2],
+		['int main() { int x = 7; int *p = &x; int **pp = &p; return **pp; }', 7],
+		['int main() { return 17 % 5; }', 2],
+		['int main() { return 1 << 4 >> 2; }', 4],
+		['int main() { return (12 & 10) + (12 | 3) + (6 ^ 3); }', 28],
+		['int main() { return 1 + 2 * 3 == 7 && 8 > 2 << 1; }', 1],
+		['int main() { int a = 0; return 0 && 1 / a || 3 > 2; }', 1],
+		['int main() { int a = 3; return a > 2 ? a < 5 ? 10 : 20 : 30; }', 10],
+		['int one() { return 1; } int main() { return one() + 10; }', 11],
+		['int main() { return one() + 10; } int two() { return 2; } int one() { return two() * 3; }', 16],
+		['int main() { int a = 0;' + ' a = a + 1;'.repeat(40) + ' return a; }', 40],
+		['int main() { return f20(); }' + Array.from({ length: 30 }, (_, i) => ` int f${i}() { return ${i} * 3 + 1; }`).join(''), 61],
+		['int main() { int sum = 0; int x = 2; int *p = &x; for (int i = 0; i < 10; i = i + 1) { sum = sum + i * *p; } return sum; }', 90],
+		['int main() { int a = 1; int b = 2; int *p = &b; *p = a + 5; a = b * 2; return a + b; }', 18],
+		['int main() { return - -10 + 5 * (3 - 1) / 2; }', 15],
+		['int main() { int a = 7; return a * 1 + 0 - (a * 0) + (a | 0); }', 14],
+		['int main() { int x = 9; int *p = &x; return *(p + 1 + 2 - 3); }', 9],
+		['int main() { int a = 3; return (0 && a) + (1 || a) + (1 && a) + (0 || a); }', 3],
+		['int main() { int a = 0; int b = a * 0 + 2; return (1 ? b : a) + (0 ? 100 : 4); }', 6],
+		['int main() { return -2147483647 - 1 == 1 << 31; }', 1],
+		['int main() { return five() * 0 + 1; } int five() { return 5; }', 1],
+		['int main() { int a; int *p; p = &a; a = 7; *p + a; }', 14],
+		['int main() { int a; int b; b = 0; for (a = 0; a < 5; a = a + 1) { b = b + a; } a; b; }', 10],
+		['int main() { int x; int y; x = 3; y = x; y = y + 0; if (y != 3) { return 1; } return y; }', 3],
+		['int main() { int a; int b; a = 3; b = 0; if (a > 1 && b == 0) { return 1; } return 2; }', 1],
+		['int main() { int i; int n; n = 0; for (i = 0; i < 10 && n != 6; i = i + 1) { n = n + 2; } i * 10 + n; }', 36],
+		['int main() { int a; int b; a = 0; b = 5; for (; a != b && (b < 0 || a < b);) { a = a + 1; } a; }', 5],
+		['int main() { int a; a = 4; (a > 2 ? a : 9) + (a == 0 ? 1 : a - 1); }', 7],
+		['int main() { int a; a = 4; (a || 0) + (0 || a - 4) * 10 + (a && a - 2) * 100; }', 101],
+		['int main() { int a; int b; int c; int *p; int i; int s; int n; p = &c; p = &b; p = &a; a = 1; b = 2; c = 3; n = 3; s = 0; for (i = 0; i < n; i = i + 1) { s = s + *(p + i) * (n * 2 + 1); } s; }', 42],
+		['int main() { int a; int b; int c; int *p; int i; p = &c; p = &b; p = &a; for (i = 2; i >= 0; i = i - 1) { *(p + i) = i * 10; } p = &c; *(p - 1) + *p; }', 30],
+		['int main() { int i; int j; int n; n = 0; for (i = 0; (i < 20 && i * i != 49) || (i > 100 && i * 2 < 300); i = i + 1) { for (j = 0; j < i * 2; j = j + 1) { n = n + 1; } } i * 100 + n; }', 742],
+		['int main() { int i; int s; s = 0; for (i = 0; i < 10; i = i + 1) { s = s + step(); } s; } int step() { return two() * 3; } int two() { 2; }', 60],
+		['int main() { return depth() + 1; } int depth() { return 0 ? depth() : 4; } int unused() { return missing_too(); } int missing_too() { return 1; }', 5],
+		['int main() { return twice(); } int twice() { return once() + once(); } int once() { int x; x = 3; return x; }', 6],
+		['int main() { int a; int b; int t; int i; a = 1; b = 2; for (i = 0; i < 5; i = i + 1) { t = a; a = b; b = t; } a * 10 + b; }', 21],
+		['int main() { int x; int y; int i; x = 0; y = 0; for (i = 0; i < 4; i = i + 1) { x = x + i * 3; y = y + i * 3; if (x > 4) y = y + 1; } x * 100 + y; }', 1820],
+		['int main() { int a; int b; a = 5; b = a > 3 && a < 10; if (b) a = a * 2; a + b; }', 11],
+		['int main() { int a; a = 3; return a; a = 4; return 9; }', 3],
+		['int main() { int a; a = 5; if (0) { a = 1; } else { a = a + 2; } if (1) { a = a * 2; } a; }', 14],
+		['int main() { int a; int s; s = 0; if (s) { if (0) { s = 2; } } else { s = 3; } for (a = 0; 0; a = a + 1) { s = 9; } for (;1;) { return s + a; } }', 3],
+		['int fib() { int *n; int a; int *p; n = 4; p = &a; if (*n < 2) { return *n; } *n = *n - 1; a = fib(); *n = *n - 1; a = a + fib(); *n = *n + 2; return a; } int main() { int *n; n = 4; *n = 10; return fib(); }', 55],
+		['int g() { int a; int *p; p = &a; a = 100; return a; } int main() { int x; int *p; p = &x; x = 5; g(); return x + g(); }', 105],
+		['int add(int a, int b) { return a + b; } int main() { return add(1, 2); }', 3],
+		['int sub(int a, int b) { return a - b; } int main() { return sub(10, 5); }', 5],
+		['int add(int a, int b) { return a + b; } int ret15() { return 15; } int main() { return add(ret15(), 2); }', 17],
+		['int add(int a, int b) { return a + b; } int sub(int a, int b) { return a - b; } int main() { return add(add(5, 5), sub(10, 8)); }', 12],
+		['int fib(int n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main() { return fib(10); }', 55],
+		['int bump(int *p, int by) { *p = *p + by; by = 0; return by; } int main() { int a; a = 40; bump(&a, 2); return a; }', 42],
+		['int swap(int a, int b) { int *p; int t; p = &a; t = *p; *p = b; b = t; return a * 10 + b; } int main() { return swap(1, 2); }', 21],
+		['int pick(int a, int b, int c) { int i; for (i = 0; i < c; i = i + 1) { a = a + b; } a; } int one() { return 1; } int main() { return pick(one(), 3, 4) + one(); }', 14],
+		['int main() { int *a = 4096; int *b = 8192; int *c = 12288; int i; int n = 103; int s = 0; for (i = 0; i < n; i = i + 1) { *(a + i) = i; *(b + i) = i * 3; } for (i = 0; i < n; i = i + 1) { *(c + i) = *(a + i) + *(b + i) * 2; } for (i = 0; i < n; i = i + 1) { s = s + *(c + i); } s; }', 36771],
+		['int main() { int *a = 4096; int i; int hi = -1000; int lo = 1000; for (i = 0; i < 61; i = i + 1) { *(a + i) = (i * 37) % 101 - 50; } for (i = 0; i < 61; i = i + 1) { if (*(a + i) > hi) hi = *(a + i); lo = *(a + i) < lo ? *(a + i) : lo; } hi * 1000 + lo; }', 49950],
+		['int main() { int *a = 4096; int i; int n = 30; int s = 0; for (i = 0; i < n; i = i + 1) { *(a + i) = i - 15; } for (i = 0; i < n; i = i + 1) { s = s + ((*(a + i) > 0) - (*(a + i) << 1)); } s; }', 44],
+		['int main() { int *a = 4096; int i; *a = 5; for (i = 0; i < 20; i = i + 1) { *(a + i + 1) = *(a + i) + 1; } *(a + 20); }', 25],
+		['int main() { int *a = 4096; int *b = a + 1; int i; *a = 5; for (i = 0; i < 20; i = i + 1) { *(b + i) = *(a + i) + 1; } *(b + 19); }', 25],
+		['int main() { int *a = 4096; int i; int s = 0; for (i = 0; i < 3; i = i + 1) { *(a + i) = 7; } for (i = 0; i < 3; i = i + 1) { s = s + *(a + i); } s; }', 21],
+		['int main() { int a = -7; return a / 2; }', -3],
+		['int main() { int *p = 4096; int *q = p + 5; return (p - q) * 10 + (q - p); }', -45],
+		['int div7(int x) { return x / 7 * 100 + x % 7; } int main() { return div7(-100) * 3 + div7(100); }', -2804],
+		['int f(int x) { return x / 8 + x % 8 * 10 + x / -4 * 100; } int main() { return f(-21); }', 448],
+		['int main() { int *p = 4096; int *q = p - 2000; return q / 2; }', 2147481696],
+		['int f(int x) { return x * 8 + x * -2147483648 + (x + 1) / 1000000007; } int main() { return f(3) + f(-2147483647); }', 30],
+		['int f(int x, int y) { return (x + y) / 10 + (x - y) % -3 * 100; } int main() { return f(-57, 2) + f(2147483647, 1); }', -214748569],
+		['int f(int x) { int r = 0; switch (x) { case 0: r = 10; break; case 1: r = 11; break; case 2: r = 12; case 3: r = r + 13; break; case 5: r = 15; break; default: r = 99; } return r; } int main() { return f(0) + f(2) * 100 + f(3) * 10000 + f(4) * 1000000 + f(5); }', 99132525],
+		['int f(int x) { switch (x * 7) { case -700: return 1; case 7: return 2; case 70: return 3; case 700: return 4; case 7000: return 5; case 70000: return 6; case 14: return 7; case 140: return 8; } return 0; } int main() { return f(-100) * 100000000 + f(1) * 10000000 + f(10) * 1000000 + f(100) * 100000 + f(1000) * 10000 + f(10000) * 1000 + f(2) * 100 + f(20) * 10 + f(3); }', 123456780],
+		['int main() { int a = 0; for (int i = 0; i < 5; i = i + 1) { switch (i) { case 1: a = a + 1; case 3: a = a + 10; break; default: a = a + 100; } } switch (a) { } switch (a) { default: a = a + 1000; } return a; }', 1321],
+		['int main() { int x = 2; int y = 0; switch (x) { case 2: switch (y) { case 0: y = 40; break; case 1: y = 2; } y = y + 2; break; case 3: y = 100; } return y; }', 42],
+		['int main() { int x = 0; switch (x) { case 1: if (x) break; else x = 5; x = 7; break; case 0: if (x == 0) { x = 3; break; } x = 9; } return x; }', 3],
+		['int bump(int *p) { *p = *p + 1; return *p; } int main() { int n = 0; switch (bump(&n)) { case 1: case 2: case 3: case 4: n = n + 10; } return n; }', 11],
+		['int f(int x) { switch (x) { case -2147483648: return 1; case 2147483647: return 2; case 4: return 3; case 0: return 6; } return 9; } int main() { return f(-2147483647 - 1) * 1000 + f(2147483647) * 100 + f(4) * 10 + f(5); }', 1239],
+		['int sum(int n, int acc) { if (n == 0) return acc; return sum(n - 1, acc + n); } int main() { return sum(1000000, 0); }', 1784293664],
+		['int even(int n) { if (n == 0) return 1; return odd(n - 1); } int odd(int n) { if (n == 0) return 0; return even(n - 1); } int main() { return even(1000001) * 10 + odd(1000001); }', 1],
+		['int f(int a, int b, int n) { if (n == 0) return a * 100 + b; return f(b, a, n - 1); } int gcd(int a, int b) { if (b == 0) return a; return gcd(b, a % b); } int main() { return f(1, 2, 3) * 100000 + gcd(1071, 462) * 100 + gcd(17, 5); }', 20102101],
+		['int f(int n, int s) { int t; if (n % 2) t = n; if (n == 0) return s; return f(n - 1, s * 2 + t); } int main() { return f(10, 0); }', 2845],
+		['int f(int n, int acc) { int *p = &acc; if (n == 0) return *p; return f(n - 1, *p + n); } int main() { return f(1000, 0); }', 500500],
+		['int main() { int *a = 4096; int i; int s = 0; for (i = 0; i < 8; i = i + 1) { *(a + i) = 1; } for (i = 0; i < 8; i = i + 1) { s = s - *(a + i); } return s; }', -8],
+		['int main() { int *a = 4096; int i; int s = 100; for (i = 0; i < 11; i = i + 1) { *(a + i) = i; } for (i = 0; i < 11; i = i + 1) { s = s - *(a + i) * 2; } return s; }', -10],
+		['int main() { int c = 0; for (int i = 0; i < 9; i = i + 1) { for (int j = 0; j < 8; j = j + 1) { c = i; } } return c; }', 8],
+		['int f(int p) { for (int i = 1; i < 2; i = i + 1) { for (int j = 0; j < 2; j = j + 1) { p = i; } } return p; } int main() { return f(-33); }', 1],
+		['int f(int n) { if (n > 5) return f(n - 1); n + 40; } int main() { int a = 3; if (a > 5) { return 1; } a + f(8); }', 48],
+		['int add(int a, int b) { return a + b; } int sq(int x) { return x * x; } int f(int y) { return sq(y) + 1; } int bump(int *p) { *p = *p + 1; return *p; } int main() { int s = 0; int n = 0; for (int i = 0; i < 10; i = i + 1) { s = add(s, i); } return s * 10000 + f(3) * 100 + add(bump(&n), bump(&n)) * 10 + sq(n + 1); }', 451039],
+	];
+
+	// Every case runs at each optimization level
+	const levels = [O0, O1, O2];
+
+	// The second program is compiled right after the first, so it reuses the
+	// cached body of main, whose calls have to reach callees that moved or
+	// changed. Two statements keep the functions from being inlined, which
+	// would leave main uncached
+	const cache_cases = [
+		['int one() { int r = 1; return r; } int two() { int r = 2; return r; } int main() { int r = one() * 10 + two(); return r; }',
+			'int two() { int r = 2; return r; } int one() { int r = 1; return r; } int main() { int r = one() * 10 + two(); return r; }', 12],
+		['int one() { int r = 1; return r; } int main() { int r = one() + 10; return r; }',
+			'int one() { int r = 5; return r; } int main() { int r = one() + 10; return r; }', 15],
+		['int main() { int r = one() + 10; return r; } int one() { int r = 1; return r; }',
+			'int zero() { int r = 0; return r; } int main() { int r = one() + 10; return r; } int three() { int r = 3; return r; } int one() { int r = three(); return r; }', 13],
+		['int pick(int x) { int r = x * 2; return r; } int main() { int r = 7; return pick(r); }',
+			'int pad() { int r = 0; return r; } int main() { int r = 7; return pick(r); } int pick(int x) { int r = x * 3; return r; }', 21],
+	];
+
+	// Each frame of f holds x on the shadow stack, and 100000 of them do not
+	// fit in memory. The prologue has to trap before a frame is written past it
+	const trap_cases = [
+		'int f(int n) { int x = n; int *p = &x; if (n == 0) return 0; return f(n - 1) + *p; } int main() { return f(100000); }',
+	];
+
+	// Each source after the first is reached by editing the one before it, so
+	// only the tokens around the change are lexed again. A full compile of the
+	// same text has to give the same result, null when it does not compile
+	const edit_cases = [
+		['int main() { in x = 5; return x; }', [
+			'int main() { int x = 5; return x; }',
+			'int main() { int x = 5; return x + 1; }']],
+		['int main() { int ab = 3; int a = 1; int b = 2; return a b; }', [
+			'int main() { int ab = 3; int a = 1; int b = 2; return ab; }',
+			'int main() { int ab = 3; int a = 1; int b = 2; return ab < = 3; }',
+			'int main() { int ab = 3; int a = 1; int b = 2; return ab <= 3; }']],
+		['int main() { return 7; }', [
+			' int main() { return 7; }',
+			'int g() { return 2; } int main() { return 7; }',
+			'nt g() { return 2; } int main() { return 7; }',
+			'int g() { return 2; } int main() { return 7 * g(); }']],
+		['int main() { return g() * 2; }', [
+			'int main() { return g() * 2; } int g() { return 4; }',
+			'int main() { return g() * 2; } int g() { return 4; ',
+			'int main() { return g() * 2; } int g() { return 4; }\n']],
+		['int main() { return 6; }', [
+			'int main() { return 6 @ 2; }',
+			'int main() { return 6 * 2; }',
+			'int main() { return 6 * 2 @; }',
+			'int main() { return 6 * 2 ; }']],
 	];
 
 	void async function() {
 		let i = 0;
-		for (; i < test_cases.length; ++i) {
+		for (; i < test_cases.length * levels.length; ++i) {
+			const [source, expected] = test_cases[i % test_cases.length];
+			const level = levels[Math.floor(i / test_cases.length)];
 			let compile_result = null;
 			try {
-				const program = await compile(test_cases[i][0]);
+				const program = await compile(source, level);
 				compile_result = program.main();
 			} catch (e) {
 				console.log("== Failed Test Case ==\nCompiler generated invalid code or threw an exception");
 				console.log(e);
 				debugger;
-				const program = await compile(test_cases[i][0]);
+				const program = await compile(source, level);
 				compile_result = program.main();
 			}
-			if (compile_result != test_cases[i][1]) {
-				console.log("== Failed Test Case ==\n'%s' should return %d", test_cases[i][0], test_cases[i][1]);
+			if (compile_result != expected) {
+				console.log("== Failed Test Case ==\n'%s' should return %d at O%d", source, expected, level);
 				console.log("Actual Result: %d", compile_result);
 				break;
 			}
 		}
-		if (i == test_cases.length) {
+		let passed = i == test_cases.length * levels.length;
+		for (let j = 0; passed && j < cache_cases.length * levels.length; ++j) {
+			const [first, second, expected] = cache_cases[j % cache_cases.length];
+			const level = levels[Math.floor(j / cache_cases.length)];
+			await compile(first, level);
+			const program = await compile(second, level);
+			const compile_result = program ? program.main() : null;
+			if (compile_result != expected) {
+				console.log("== Failed Test Case ==\n'%s' compiled after '%s' should return %d at O%d", second, first, expected, level);
+				console.log("Actual Result: %d", compile_result);
+				passed = false;
+			}
+		}
+		for (let j = 0; passed && j < trap_cases.length * levels.length; ++j) {
+			const source = trap_cases[j % trap_cases.length];
+			const level = levels[Math.floor(j / trap_cases.length)];
+			const program = await compile(source, level);
+			let trapped = false;
+			try {
+				program.main();
+			} catch (e) {
+				trapped = e instanceof WebAssembly.RuntimeError;
+			}
+			if (!trapped) {
+				console.log("== Failed Test Case ==\n'%s' should trap at O%d", source, level);
+				passed = false;
+			}
+		}
+		for (let j = 0; passed && j < edit_cases.length * levels.length; ++j) {
+			const [first, edits] = edit_cases[j % edit_cases.length];
+			const level = levels[Math.floor(j / edit_cases.length)];
+			const expected = [];
+			for (const source of edits) {
+				const program = await compile(source, level);
+				expected.push(program ? program.main() : null);
+			}
+			let previous = first;
+			await compile(first, level);
+			for (let k = 0; passed && k < edits.length; ++k) {
+				const program = await update(edits[k], level);
+				const edit_result = program ? program.main() : null;
+				if (edit_result !== expected[k]) {
+					console.log("== Failed Test Case ==\n'%s' edited into '%s' should return %s like a full compile at O%d", previous, edits[k], expected[k], level);
+					console.log("Actual Result: %s", edit_result);
+					passed = false;
+				}
+				previous = edits[k];
+			}
+		}
+		if (passed) {
 			console.clear();
 			console.log("== All Test Cases Passed ==");
 		}
 	}();
 }
+
+if (ENABLE_BENCHMARKS) {
+	const source =
+		'int main() {\n' +
+		'\tint iteration_count = 0;\n' +
+		'\tint accumulated_value = 1234567;\n' +
+		'\tfor (int index = 0; index < 1000; index = index + 1) {\n' +
+		'\t\tif (accumulated_value >= 500000) {\n' +
+		'\t\t\taccumulated_value = accumulated_value / 2;\n' +
+		'\t\t} else {\n' +
+		'\t\t\taccumulated_value = accumulated_value * 3 + 1;\n' +
+		'\t\t}\n' +
+		'\t\titeration_count = iteration_count + 1;\n' +
+		'\t}\n' +
+		'\treturn iteration_count;\n' +
+		'}\n';
+
+	const loadSource = (source) => {
+		const view = new Uint8Array(compiler.memory.buffer, compiler.get_mem_addr(), compiler.get_mem_size());
+		const { written } = encoder.encodeInto(source, view);
+		view[written] = 0;
+		return written;
+	};
+
+	const written = loadSource(source);
+	const iterations = 20000;
+	for (const simd of [false, true]) {
+		const start = performance.now();
+		compiler.tokenize_benchmark(iterations, simd);
+		const seconds = (performance.now() - start) / 1000;
+		console.log("Tokenizer (%s) -- %.1f MB/s", simd ? "SIMD" : "scalar", written * iterations / seconds / 1e6);
+	}
+
+	// Long left-leaning chains used to re-walk the whole chain for every new term
+	const terms = 10000;
+	const chains = [
+		['int', 'int main() { int a = 1; return ' + Array(terms).fill('a').join(' + ') + '; }'],
+		['pointer', 'int main() { int a = 1; int *p = &a; return *(p' + ' + a - a'.repeat(terms / 2) + '); }'],
+		['mixed operator', 'int main() { int a = 1; return a' + ' * a + a << a & a == a || a'.repeat(terms / 6) + '; }'],
+	];
+	for (const [name, chain] of chains) {
+		loadSource(chain);
+		const parses = 20;
+		const start = performance.now();
+		compiler.parse_benchmark(parses);
+		const ms = (performance.now() - start) / parses;
+		console.log("Parse + type check, %d term %s chain -- %.3fms (%.1fns per term)", terms, name, ms, ms * 1e6 / terms);
+	}
+
+	// A keystroke in the middle of a large source, re-lexed in place vs from scratch
+	const large = source.repeat(50);
+	const large_written = loadSource(large);
+	for (const incremental of [false, true]) {
+		const keystrokes = 2000;
+		const start = performance.now();
+		if (incremental)
+			compiler.edit_benchmark(keystrokes, large_written >> 1);
+		else
+			compiler.tokenize_benchmark(keystrokes, true);
+		const us = (performance.now() - start) * 1000 / keystrokes;
+		console.log("Keystroke in a %d byte source (%s) -- %.2fus", large_written, incremental ? "re-lex window" : "full re-lex", us);
+	}
+
+	// Editing one function, the untouched ones come from the function cache
+	for (const functions of [4, 16, 48]) {
+		let program = 'int main() { return f0(); }\n';
+		for (let i = 0; i < functions; ++i)
+			program += `int f${i}() { return ${i} * 3 + 1; }\n`;
+		loadSource(program);
+		compiler.compile(O0);
+
+		// Toggles the last digit in main's body
+		const offset = program.indexOf('f0()') + 1;
+		const edit = new Uint8Array(compiler.memory.buffer, compiler.get_edit_addr(), 1);
+		const compiles = 1000;
+		const start = performance.now();
+		for (let i = 0; i < compiles; ++i) {
+			edit[0] = '0'.charCodeAt(0) + ((i + 1) & 1);
+			compiler.edit(offset, 1, 1, O0);
+		}
+		const us = (performance.now() - start) * 1000 / compiles;
+		console.log("Edit + compile with %d untouched functions -- %.2fus", functions, us);
+	}
+
+	// What each optimization level costs in compile time. Every compile changes
+	// all functions, so none of them comes from the function cache
+	for (const level of [O0, O1, O2]) {
+		const compiles = 50, functions = 32;
+		const passTotals = new Array(passNames.length).fill(0);
+		let total = 0;
+		for (let i = 0; i < compiles; ++i) {
+			let program = 'int main() { return 0';
+			for (let f = 0; f < functions; ++f)
+				program += ` + f${f}()`;
+			program += '; }\n';
+			for (let f = 0; f < functions; ++f)
+				program += source.replace('main', `f${f}`).replace('1000', `${1000 + i}`);
+			loadSource(program);
+			const start = performance.now();
+			compiler.compile(level);
+			total += performance.now() - start;
+			const passTimes = new Float64Array(compiler.memory.buffer, compiler.get_pass_times(), compiler.get_pass_count());
+			passTimes.forEach((ms, pass) => passTotals[pass] += ms);
+		}
+		const passes = passNames.map((name, pass) => `${name} ${(passTotals[pass] / compiles).toFixed(3)}`).join(", ");
+		console.log("Compile %d functions at O%d -- %.3fms (%s)", functions, level, total / compiles, passes);
+	}
+
+	// Runtime of a tight loop in the generated code
+	void async function() {
+		for (const level of [O0, O1, O2]) {
+			const program = await compile('int main() { int sum = 0; for (int i = 0; i < 10000000; i = i + 1) { sum = sum + (i & 7); } return sum; }', level);
+			const start = performance.now();
+			const result = program.main();
+			console.log("Generated loop at O%d, 10M iterations -- %.3fms (result %d)", level, performance.now() - start, result);
+		}
+
+		// Elementwise and reduction loops over 4096 ints, which O2 vectorizes
+		const arrays = 'int main() { int *a = 4096; int *b = 20480; int s = 0; for (int i = 0; i < 4096; i = i + 1) { *(a + i) = i; *(b + i) = i * 3; } ' +
+			'for (int r = 0; r < 1000; r = r + 1) { for (int i = 0; i < 4096; i = i + 1) { *(a + i) = *(a + i) + *(b + i); s = s + *(b + i); } } return s; }';
+		for (const level of [O1, O2]) {
+			const program = await compile(arrays, level);
+			const start = performance.now();
+			const result = program.main();
+			console.log("Array loops at O%d, 4M elements -- %.3fms (result %d)", level, performance.now() - start, result);
+		}
+
+		// Division and remainder by constants, which O1 and up turn into shifts and multiplications
+		const digits = 'int main() { int sum = 0; for (int i = 0; i < 10000000; i = i + 1) { sum = sum + i % 10 + i / 10 % 10 + i / 100 % 10; } return sum; }';
+		for (const level of [O0, O1]) {
+			const program = await compile(digits, level);
+			const start = performance.now();
+			const result = program.main();
+			console.log("Digit sums at O%d, 10M numbers -- %.3fms (result %d)", level, performance.now() - start, result);
+		}
+
+		// An interpreter loop picking one of 16 operations at random, as a switch,
+		// which becomes a br_table, and as the if/else chain it replaces
+		const operations = ['a + 1', 'a * 3', 'a - 7', 'a ^ 85', 'a >> 1', 'a + i', 'a & 65535', 'a | 3', 'a + 11', 'a * 5', 'a - i', 'a ^ 1234', 'a << 1', 'a + 99', 'a & 1048575', 'a | 16'];
+		const loop = 'int main() { int a = 1; int x = 12345; for (int i = 0; i < 10000000; i = i + 1) { x = x * 1103515245 + 12345; int op = (x >> 16) & 15; ';
+		const dispatches = {
+			switch: loop + 'switch (op) { ' + operations.map((operation, op) => `case ${op}: a = ${operation}; break; `).join('') + '} } return a; }',
+			'if/else': loop + operations.map((operation, op) => `if (op == ${op}) a = ${operation};`).join(' else ') + ' } return a; }',
+		};
+		for (const [name, source] of Object.entries(dispatches)) {
+			const program = await compile(source, O1);
+			const start = performance.now();
+			const result = program.main();
+			console.log("Dispatch by %s, 10M operations -- %.3fms (result %d)", name, performance.now() - start, result);
+		}
+
+		// A sum by tail recursion, return_call at O0 and O1, a loop at O2
+		const recursion = 'int sum(int n, int acc) { if (n == 0) return acc; return sum(n - 1, acc + (n & 7)); } int main() { return sum(10000000, 0); }';
+		for (const level of [O0, O1, O2]) {
+			const program = await compile(recursion, level);
+			const start = performance.now();
+			const result = program.main();
+			console.log("Tail recursion at O%d, 10M calls -- %.3fms (result %d)", level, performance.now() - start, result);
+		}
+	}();
+}